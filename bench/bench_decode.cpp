@@ -0,0 +1,94 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+// Compares full disassembly to text, which code flow analysis used to do for every instruction,
+// against the minimal decode mode it uses now, over a large buffer of synthetic code.
+
+#include <chrono>
+#include <random>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <Zydis/Zydis.h>
+
+using Clock = std::chrono::steady_clock;
+
+
+
+// A selection of common x86-64 instruction encodings.
+static std::vector<std::vector<uint8_t>> const patterns = {
+    {0x55},                                           // push rbp
+    {0x48, 0x89, 0xe5},                               // mov rbp, rsp
+    {0x48, 0x83, 0xec, 0x20},                         // sub rsp, 0x20
+    {0x48, 0x89, 0x7d, 0xf8},                         // mov [rbp-8], rdi
+    {0x48, 0x8d, 0x05, 0x10, 0x20, 0x00, 0x00},       // lea rax, [rip+0x2010]
+    {0xe8, 0x00, 0x10, 0x00, 0x00},                   // call rel32
+    {0x74, 0x08},                                     // jz rel8
+    {0x0f, 0x85, 0x40, 0x01, 0x00, 0x00},             // jnz rel32
+    {0x48, 0x39, 0xc8},                               // cmp rax, rcx
+    {0x48, 0x01, 0xd0},                               // add rax, rdx
+    {0x0f, 0x10, 0x44, 0x24, 0x10},                   // movups xmm0, [rsp+0x10]
+    {0xc5, 0xfc, 0x58, 0xc1},                         // vaddps ymm0, ymm0, ymm1
+    {0x8b, 0x04, 0x8d, 0x00, 0x10, 0x40, 0x00},       // mov eax, [rcx*4+0x401000]
+    {0xff, 0x24, 0xc5, 0x00, 0x20, 0x40, 0x00},       // jmp [rax*8+0x402000]
+    {0x48, 0xc7, 0x44, 0x24, 0x08, 0x01, 0, 0, 0},    // mov qword [rsp+8], 1
+    {0x0f, 0x1f, 0x44, 0x00, 0x00},                   // nop dword [rax+rax]
+    {0xc3},                                           // ret
+};
+
+int main(int argc, char **argv) {
+    size_t size = argc > 1 ? strtoul(argv[1], NULL, 0) : 64 << 20;
+
+    // Fill the buffer with random instructions.
+    std::mt19937         rng(1234);
+    std::vector<uint8_t> code;
+    code.reserve(size + 16);
+    while (code.size() < size) {
+        auto &pattern = patterns[rng() % patterns.size()];
+        code.insert(code.end(), pattern.begin(), pattern.end());
+    }
+
+    // Before: disassemble to Intel syntax text.
+    size_t before = 0;
+    auto   start  = Clock::now();
+    for (size_t pos = 0; pos < code.size();) {
+        ZydisDisassembledInstruction insn;
+        if (ZYAN_FAILED(ZydisDisassembleIntel(
+                ZYDIS_MACHINE_MODE_LONG_64,
+                (uint64_t)&code[pos],
+                &code[pos],
+                code.size() - pos,
+                &insn
+            ))) {
+            printf("Decoding failed at offset %zu\n", pos);
+            return 1;
+        }
+        pos += insn.info.length;
+        before++;
+    }
+    double beforeTime = std::chrono::duration<double>(Clock::now() - start).count();
+
+    // After: minimal decoding with a preinitialized decoder.
+    ZydisDecoder decoder;
+    ZydisDecoderInit(&decoder, ZYDIS_MACHINE_MODE_LONG_64, ZYDIS_STACK_WIDTH_64);
+    ZydisDecoderEnableMode(&decoder, ZYDIS_DECODER_MODE_MINIMAL, ZYAN_TRUE);
+    size_t after = 0;
+    start        = Clock::now();
+    for (size_t pos = 0; pos < code.size();) {
+        ZydisDecodedInstruction insn;
+        if (ZYAN_FAILED(ZydisDecoderDecodeInstruction(&decoder, NULL, &code[pos], code.size() - pos, &insn))) {
+            printf("Decoding failed at offset %zu\n", pos);
+            return 1;
+        }
+        pos += insn.length;
+        after++;
+    }
+    double afterTime = std::chrono::duration<double>(Clock::now() - start).count();
+
+    printf("code: %zu bytes, %zu instructions\n", code.size(), after);
+    printf("ZydisDisassembleIntel  %8.2f M insn/s\n", before / beforeTime / 1e6);
+    printf("minimal decode         %8.2f M insn/s (%.1fx)\n", after / afterTime / 1e6, beforeTime / afterTime);
+
+    return before != after;
+}
@@ -0,0 +1,132 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+// A synthetic game to measure CoreTorio's costs without Factorio.
+// Usage: bench_game [<results file> [<run name>]]
+//
+// Made of many generated functions (see bench_game_gen), and meant to be run with `libcoretorio.so` in LD_PRELOAD,
+// `CORETORIO_INJECT_EMPTY` set to the generated list of functions to inject into and `CORETORIO_TIMINGS` set to
+// the results file. CoreTorio then appends the time its startup phases took, and this program appends the cycles
+// per call of functions of each shape with and without an injection, as lines of JSON. The `bench_game_run` target
+// does all of that.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <x86intrin.h>
+
+
+
+namespace synth {
+// All generated functions.
+extern int (*const functions[])(int);
+// Number of generated functions.
+extern size_t const functionCount;
+} // namespace synth
+
+// Touched by the benchmark functions, so their prologues contain a RIP-relative memory operand.
+volatile int benchCounter;
+
+// Functions to measure, in pairs of one without and one with an injection.
+#define BENCH_SHAPE(shape, body)                                                                                       \
+    extern "C" __attribute__((noinline)) int bench_##shape##_plain(int x) body                                        \
+    extern "C" __attribute__((noinline)) int bench_##shape##_hooked(int x) body
+
+extern "C" __attribute__((noinline)) int bench_callee(int x) {
+    benchCounter += x;
+    return benchCounter;
+}
+BENCH_SHAPE(loop, {
+    int sum = x;
+    for (int i = 0; i < 4; i++) {
+        sum = sum * 31 + i;
+    }
+    return sum;
+})
+BENCH_SHAPE(switch, {
+    switch (x & 7) {
+        case 0: return x + 1;
+        case 1: return x * 3;
+        case 2: return x ^ 5;
+        case 3: return x - 7;
+        case 4: return (x << 2) + 9;
+        case 5: return (x >> 1) ^ 11;
+        case 6: return ~x + 13;
+        default: return x * x;
+    }
+})
+BENCH_SHAPE(tail_call, { return bench_callee(x + 1); })
+BENCH_SHAPE(leaf, {
+    benchCounter += x;
+    return benchCounter;
+})
+
+// Get the average number of cycles per call of a function.
+static double measure(int (*func)(int), size_t iterations) {
+    // Warm up caches and branch predictors first.
+    for (size_t i = 0; i < iterations / 16; i++) {
+        func(i);
+    }
+    uint64_t start = __rdtsc();
+    for (size_t i = 0; i < iterations; i++) {
+        func(i);
+    }
+    return (double)(__rdtsc() - start) / iterations;
+}
+
+int main(int argc, char **argv) {
+    FILE *out = argc > 1 ? fopen(argv[1], "a") : stdout;
+    if (!out) {
+        perror("Opening results file failed");
+        return 1;
+    }
+    char const *run        = argc > 2 ? argv[2] : "default";
+    size_t      iterations = 10000000;
+
+    // Call every generated function once, so that broken injections show up as crashes or a different checksum.
+    uint64_t start    = __rdtsc();
+    unsigned checksum = 0;
+    for (size_t i = 0; i < synth::functionCount; i++) {
+        checksum = checksum * 31 + synth::functions[i](i);
+    }
+    fprintf(
+        out,
+        "{\"pid\": %d, \"run\": \"%s\", \"functions\": %zu, \"checksum\": %u, \"cycles\": %zu}\n",
+        (int)getpid(),
+        run,
+        synth::functionCount,
+        checksum,
+        (size_t)(__rdtsc() - start)
+    );
+
+    // Called through volatile pointers, so the calls are not inlined or hoisted.
+    struct {
+        char const *shape;
+        int (*volatile plain)(int);
+        int (*volatile hooked)(int);
+    } shapes[] = {
+        {"loop", bench_loop_plain, bench_loop_hooked},
+        {"switch", bench_switch_plain, bench_switch_hooked},
+        {"tail_call", bench_tail_call_plain, bench_tail_call_hooked},
+        {"leaf", bench_leaf_plain, bench_leaf_hooked},
+    };
+    for (auto &shape : shapes) {
+        double plain  = measure(shape.plain, iterations);
+        double hooked = measure(shape.hooked, iterations);
+        fprintf(
+            out,
+            "{\"pid\": %d, \"run\": \"%s\", \"shape\": \"%s\", \"plain_cycles\": %.2f, \"hooked_cycles\": %.2f}\n",
+            (int)getpid(),
+            run,
+            shape.shape,
+            plain,
+            hooked
+        );
+    }
+    if (out != stdout) {
+        fclose(out);
+    }
+    return 0;
+}
@@ -0,0 +1,174 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+// Generates the sources of the synthetic game that `bench_game` is built from.
+// Usage: bench_game_gen <output directory> <number of functions>
+//
+// Writes `game_<n>.cpp` for each of `GAME_FILES` translation units, `table.cpp` with a table of every generated
+// function, and `inject.txt` with the symbols the benchmark injects into. The functions come in a few shapes that
+// exercise different parts of the code analysis: loops, switches that compile to jump tables, tail calls and leaves
+// that access globals RIP-relative. Every generated function gets a mangled C++ name, like most of Factorio's.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+
+
+
+// Number of translation units to spread the functions over, so they compile in parallel.
+static constexpr size_t GAME_FILES  = 8;
+// Number of functions per namespace, which makes the mangled names vary in length.
+static constexpr size_t NAMESPACE   = 100;
+// Every this many functions is injected into.
+static constexpr size_t INJECT_STEP = 10;
+// Shapes of the generated functions, by index modulo `SHAPES`.
+enum Shape { LOOP, SWITCH, TAIL_CALL, LEAF, SHAPES };
+
+// Get the namespace of a generated function.
+static std::string namespaceOf(size_t index) {
+    return "m" + std::to_string(index / NAMESPACE);
+}
+
+// Get the name of a generated function.
+static std::string nameOf(size_t index) {
+    return "f" + std::to_string(index);
+}
+
+// Get the mangled symbol name of a generated function, which is `synth::m<n>::f<index>(int)`.
+static std::string mangledNameOf(size_t index) {
+    std::string ns   = namespaceOf(index);
+    std::string name = nameOf(index);
+    return "_ZN5synth" + std::to_string(ns.size()) + ns + std::to_string(name.size()) + name + "Ei";
+}
+
+// Write the body of a generated function.
+static void writeBody(FILE *out, size_t index) {
+    unsigned salt = index * 2654435761u;
+    switch (index % SHAPES) {
+        case LOOP:
+            fprintf(out, "    int sum = x;\n");
+            fprintf(out, "    for (int i = 0; i < (x & 15) + 4; i++) {\n");
+            fprintf(out, "        sum = sum * 31 + i + %u;\n", salt % 1000);
+            fprintf(out, "    }\n");
+            fprintf(out, "    return sum;\n");
+            break;
+        case SWITCH:
+            fprintf(out, "    switch (x & 7) {\n");
+            fprintf(out, "        case 0: return x + %u;\n", salt % 97);
+            fprintf(out, "        case 1: return x * %u;\n", salt % 89 + 2);
+            fprintf(out, "        case 2: return x ^ %u;\n", salt % 83);
+            fprintf(out, "        case 3: return x - %u;\n", salt % 79);
+            fprintf(out, "        case 4: return (x << 2) + %u;\n", salt % 73);
+            fprintf(out, "        case 5: return (x >> 1) ^ %u;\n", salt % 71);
+            fprintf(out, "        case 6: return ~x + %u;\n", salt % 67);
+            fprintf(out, "        default: return x * x;\n");
+            fprintf(out, "    }\n");
+            break;
+        case TAIL_CALL:
+            // Both callees come earlier in the same file, so every chain of calls is short.
+            fprintf(out, "    if (x & 1) {\n");
+            fprintf(out, "        return %s::%s(x >> 1);\n", namespaceOf(index - 1).c_str(), nameOf(index - 1).c_str());
+            fprintf(out, "    }\n");
+            fprintf(
+                out,
+                "    return %s::%s(x + %u);\n",
+                namespaceOf(index - 2).c_str(),
+                nameOf(index - 2).c_str(),
+                salt % 13
+            );
+            break;
+        case LEAF:
+            fprintf(out, "    counter += x;\n");
+            fprintf(out, "    return counter ^ %u;\n", salt % 251);
+            break;
+    }
+}
+
+// Write the functions of one translation unit.
+static bool writeFile(std::string const &dir, size_t file, size_t begin, size_t end) {
+    std::string path = dir + "/game_" + std::to_string(file) + ".cpp";
+    FILE       *out  = fopen(path.c_str(), "w");
+    if (!out) {
+        perror("Creating game source failed");
+        return false;
+    }
+    fprintf(out, "// Generated by bench_game_gen, do not edit.\n\n");
+    fprintf(out, "namespace synth {\n");
+    fprintf(out, "extern volatile int counter;\n");
+    for (size_t i = begin; i < end; i++) {
+        if (i == begin || i % NAMESPACE == 0) {
+            fprintf(out, "%snamespace %s {\n", i == begin ? "" : "}\n", namespaceOf(i).c_str());
+        }
+        fprintf(out, "__attribute__((noinline)) int %s(int x) {\n", nameOf(i).c_str());
+        writeBody(out, i);
+        fprintf(out, "}\n");
+    }
+    fprintf(out, "}\n");
+    fprintf(out, "} // namespace synth\n");
+    fclose(out);
+    return true;
+}
+
+// Write the table of all generated functions.
+static bool writeTable(std::string const &dir, size_t count) {
+    FILE *out = fopen((dir + "/table.cpp").c_str(), "w");
+    if (!out) {
+        perror("Creating game table failed");
+        return false;
+    }
+    fprintf(out, "// Generated by bench_game_gen, do not edit.\n\n");
+    fprintf(out, "#include <stddef.h>\n\n");
+    fprintf(out, "namespace synth {\n");
+    fprintf(out, "volatile int counter;\n");
+    for (size_t i = 0; i < count; i++) {
+        fprintf(out, "namespace %s { int %s(int x); }\n", namespaceOf(i).c_str(), nameOf(i).c_str());
+    }
+    fprintf(out, "extern int (*const functions[])(int) = {\n");
+    for (size_t i = 0; i < count; i++) {
+        fprintf(out, "    %s::%s,\n", namespaceOf(i).c_str(), nameOf(i).c_str());
+    }
+    fprintf(out, "};\n");
+    fprintf(out, "extern size_t const functionCount = %zu;\n", count);
+    fprintf(out, "} // namespace synth\n");
+    fclose(out);
+    return true;
+}
+
+// Write the list of symbols to inject into: every `INJECT_STEP`th generated function and the hooked benchmarks.
+static bool writeInjectList(std::string const &dir, size_t count) {
+    FILE *out = fopen((dir + "/inject.txt").c_str(), "w");
+    if (!out) {
+        perror("Creating inject list failed");
+        return false;
+    }
+    for (size_t i = 0; i < count; i += INJECT_STEP) {
+        fprintf(out, "%s\n", mangledNameOf(i).c_str());
+    }
+    for (char const *shape : {"loop", "switch", "tail_call", "leaf"}) {
+        fprintf(out, "bench_%s_hooked\n", shape);
+    }
+    fclose(out);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        printf("Usage: %s <output directory> <number of functions>\n", argv[0]);
+        return 1;
+    }
+    std::string dir   = argv[1];
+    // Rounded up so that every file starts with a whole group of shapes.
+    size_t      count = strtoul(argv[2], NULL, 0);
+    size_t      step  = GAME_FILES * SHAPES;
+    count             = (count + step - 1) / step * step;
+    if (!count) {
+        count = step;
+    }
+
+    for (size_t file = 0; file < GAME_FILES; file++) {
+        if (!writeFile(dir, file, file * count / GAME_FILES, (file + 1) * count / GAME_FILES)) {
+            return 1;
+        }
+    }
+    return writeTable(dir, count) && writeInjectList(dir, count) ? 0 : 1;
+}
@@ -0,0 +1,328 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+// Measures the overhead per call, in cycles, that injections add to a function.
+// Injects into functions of this executable, so it must be built with its symbol table.
+
+#include "injection_priv.hpp"
+#include "latency.hpp"
+#include "object.hpp"
+#include "tracing.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include <x86intrin.h>
+
+using namespace coretorio;
+
+
+
+// Touched by the targets, so their prologues contain a RIP-relative memory operand.
+volatile int benchCounter;
+// Touched by the injected functions.
+volatile int hookCounter;
+// Touched by the function that is switched on and off, and by its injection.
+volatile int toggledCounter;
+
+// Functions to inject into; one per kind of injection.
+extern "C" __attribute__((noinline)) int benchPlain(int value) {
+    benchCounter += value;
+    return benchCounter;
+}
+extern "C" __attribute__((noinline)) int benchBefore(int value) {
+    benchCounter += value;
+    return benchCounter;
+}
+extern "C" __attribute__((noinline)) int benchBeforeAfter(int value) {
+    benchCounter += value;
+    return benchCounter;
+}
+extern "C" __attribute__((noinline)) int benchCapturing(int value) {
+    benchCounter += value;
+    return benchCounter;
+}
+extern "C" __attribute__((noinline)) int benchReplaced(int value) {
+    benchCounter += value;
+    return benchCounter;
+}
+extern "C" __attribute__((noinline)) int benchProbed(int value) {
+    benchCounter += value;
+    return benchCounter;
+}
+extern "C" __attribute__((noinline)) int benchProbedEvery(int value) {
+    benchCounter += value;
+    return benchCounter;
+}
+extern "C" __attribute__((noinline)) int benchTraced(int value) {
+    benchCounter += value;
+    return benchCounter;
+}
+extern "C" __attribute__((noinline)) int benchLate(int value) {
+    benchCounter += value;
+    return benchCounter;
+}
+extern "C" __attribute__((noinline)) int benchLateBlocked(int value) {
+    benchCounter += value;
+    return benchCounter;
+}
+extern "C" __attribute__((noinline)) int benchToggled(int value) {
+    toggledCounter += value;
+    return toggledCounter;
+}
+
+static void hook() {
+    hookCounter++;
+}
+static void toggledHook() {
+    toggledCounter++;
+}
+
+// Original code of `benchReplaced`.
+static int (*benchOriginal)(int);
+// Replacement for `benchReplaced` that still runs the original.
+static int replacement(int value) {
+    hookCounter++;
+    return benchOriginal(value);
+}
+
+// Get the average number of cycles per call of a function.
+static double measure(int (*func)(int), size_t iterations) {
+    // Warm up caches and branch predictors first.
+    for (size_t i = 0; i < iterations / 16; i++) {
+        func(1);
+    }
+    uint64_t start = __rdtsc();
+    for (size_t i = 0; i < iterations; i++) {
+        func(1);
+    }
+    return (double)(__rdtsc() - start) / iterations;
+}
+
+// Switch the injection on `benchToggled` on and off while other threads call it.
+// Gets the average and longest time per switch, in microseconds.
+static bool measureToggle(size_t toggles, size_t threads, double &average, double &longest) {
+    std::atomic<bool>        stop{false};
+    std::vector<std::thread> callers;
+    for (size_t i = 0; i < threads; i++) {
+        callers.emplace_back([&stop] {
+            int (*volatile func)(int) = benchToggled;
+            while (!stop) {
+                func(1);
+            }
+        });
+    }
+    bool success = true;
+    average      = 0;
+    longest      = 0;
+    for (size_t i = 0; i < toggles && success; i++) {
+        auto start  = std::chrono::steady_clock::now();
+        success     = injection::setEnabled("benchToggled", i % 2);
+        double time = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        average    += time / toggles;
+        longest     = time > longest ? time : longest;
+    }
+    stop = true;
+    for (auto &thread : callers) {
+        thread.join();
+    }
+    return success;
+}
+
+// Whether `hook` runs when a function is called.
+static bool hookRuns(int (*func)(int)) {
+    int (*volatile call)(int) = func;
+    int before                = hookCounter;
+    call(1);
+    return hookCounter != before;
+}
+
+// Whether the injection on `benchToggled` is switched on.
+static bool toggledHookRuns() {
+    int (*volatile func)(int) = benchToggled;
+    int before                = toggledCounter;
+    func(1);
+    return toggledCounter - before == 2;
+}
+
+// Run an action that rewrites code once while another thread blocks all signals, either asleep in the kernel or
+// running. Gets the time taken, in microseconds, and whether it succeeded.
+static double measureBlocked(bool running, bool (*action)(), bool &success) {
+    int wake[2];
+    if (pipe(wake)) {
+        success = false;
+        return 0;
+    }
+    std::atomic<bool> stop{false};
+    std::atomic<bool> blocked{false};
+    std::thread       blocker([&] {
+        sigset_t all;
+        sigfillset(&all);
+        pthread_sigmask(SIG_BLOCK, &all, NULL);
+        blocked = true;
+        char byte;
+        while (!stop) {
+            if (!running && read(wake[0], &byte, 1) < 0) {
+                break;
+            }
+        }
+    });
+    while (!blocked) {
+        std::this_thread::yield();
+    }
+    // Give a sleeping thread time to get into `read`.
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    auto   start = std::chrono::steady_clock::now();
+    success      = action();
+    double time  = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+    stop = true;
+    if (write(wake[1], "", 1) < 0) {
+        success = false;
+    }
+    blocker.join();
+    close(wake[0]);
+    close(wake[1]);
+    return time;
+}
+
+int main(int argc, char **argv) {
+    size_t iterations = argc > 1 ? strtoul(argv[1], NULL, 0) : 10000000;
+
+    if (!object::interpret_elf()) {
+        return 1;
+    }
+    // Called through volatile pointers, so the calls are not inlined or hoisted.
+    int (*volatile plain)(int)       = benchPlain;
+    int (*volatile before)(int)      = benchBefore;
+    int (*volatile beforeAfter)(int) = benchBeforeAfter;
+    int (*volatile capturing)(int)   = benchCapturing;
+    int (*volatile replaced)(int)    = benchReplaced;
+    int (*volatile probed)(int)      = benchProbed;
+    int (*volatile probedEvery)(int) = benchProbedEvery;
+    int (*volatile traced)(int)      = benchTraced;
+    double baseline                  = measure(plain, iterations);
+
+    injection::init();
+    injection::injectBefore("benchBefore", hook);
+    injection::injectBefore("benchBeforeAfter", hook);
+    injection::injectAfter("benchBeforeAfter", hook);
+    int captured = 0;
+    injection::injectBefore("benchCapturing", [&captured] { captured++; });
+    injection::replace("benchReplaced", replacement, &benchOriginal);
+    latency::probe("benchProbed");
+    latency::probe("benchProbedEvery", 1);
+    tracing::trace("benchTraced");
+    injection::injectBefore("benchToggled", toggledHook);
+    injection::setEnabled("benchToggled", false);
+    if (!injection::performInjections()) {
+        return 1;
+    }
+
+    int    expect = benchCounter;
+    double cycles[7];
+    cycles[0] = measure(before, iterations);
+    cycles[1] = measure(beforeAfter, iterations);
+    cycles[2] = measure(capturing, iterations);
+    cycles[3] = measure(replaced, iterations);
+    cycles[4] = measure(probed, iterations);
+    if (!tracing::startTrace("bench_hook.trace")) {
+        return 1;
+    }
+    cycles[5] = measure(traced, iterations);
+    tracing::stopTrace();
+    cycles[6] = measure(probedEvery, iterations);
+    expect    = expect + 7 * (iterations + iterations / 16);
+    if (benchCounter != expect || (size_t)hookCounter != 4 * (iterations + iterations / 16)
+        || (size_t)captured != iterations + iterations / 16) {
+        printf("Injected functions were not called the expected number of times\n");
+        return 1;
+    }
+    latency::Histogram every;
+    if (!latency::getHistogram("benchProbedEvery", every) || every.total() != iterations + iterations / 16) {
+        printf("The latency probe with an interval of 1 did not time every call\n");
+        return 1;
+    }
+
+    printf("%-24s %8.2f cycles/call\n", "no injection", baseline);
+    printf("%-24s %8.2f cycles/call (+%.2f)\n", "before", cycles[0], cycles[0] - baseline);
+    printf("%-24s %8.2f cycles/call (+%.2f)\n", "before and after", cycles[1], cycles[1] - baseline);
+    printf("%-24s %8.2f cycles/call (+%.2f)\n", "before, capturing", cycles[2], cycles[2] - baseline);
+    printf("%-24s %8.2f cycles/call (+%.2f)\n", "replaced, original", cycles[3], cycles[3] - baseline);
+    printf("%-24s %8.2f cycles/call (+%.2f)\n", "latency probe", cycles[4], cycles[4] - baseline);
+    printf("%-24s %8.2f cycles/call (+%.2f)\n", "latency probe, all calls", cycles[6], cycles[6] - baseline);
+    latency::dumpHistograms(stdout);
+    // Every traced call is two events.
+    tracing::TraceStats stats = tracing::getTraceStats();
+    printf(
+        "%-24s %8.2f cycles/event (%zu written, %zu dropped)\n",
+        "trace event",
+        (cycles[5] - baseline) / 2,
+        (size_t)stats.written,
+        (size_t)stats.dropped
+    );
+
+    double average, longest;
+    if (!measureToggle(1000, 4, average, longest)) {
+        printf("Switching injections failed\n");
+        return 1;
+    }
+    printf("%-24s %8.2f us/switch (longest %.2f us)\n", "switching, 4 threads", average, longest);
+
+    // A thread that blocks signals is not waited for while it sleeps in the kernel, and fails a switch right away
+    // while it runs.
+    auto toggle = [] {
+        bool enabled = !toggledHookRuns();
+        return injection::setEnabled("benchToggled", enabled) && toggledHookRuns() == enabled;
+    };
+    bool   success;
+    double time = measureBlocked(false, toggle, success);
+    if (!success) {
+        printf("Switching injections with a thread that blocks signals asleep failed\n");
+        return 1;
+    }
+    printf("%-24s %8.2f us/switch\n", "switching, blocked sleeper", time);
+    time = measureBlocked(true, toggle, success);
+    if (success) {
+        printf("Switching injections with a thread that blocks signals running succeeded\n");
+        return 1;
+    }
+    printf("%-24s %8.2f us to fail\n", "switching, blocked runner", time);
+
+    // Later batches are switched on the same way. One that fails stays off and can be switched on afterwards.
+    time = measureBlocked(
+        false,
+        [] {
+            injection::injectBefore("benchLate", hook);
+            return injection::performInjections() && hookRuns(benchLate);
+        },
+        success
+    );
+    if (!success) {
+        printf("Injecting a later batch with a thread that blocks signals asleep failed\n");
+        return 1;
+    }
+    printf("%-24s %8.2f us/batch\n", "later batch, blocked sleeper", time);
+    time = measureBlocked(
+        true,
+        [] {
+            injection::injectBefore("benchLateBlocked", hook);
+            return injection::performInjections();
+        },
+        success
+    );
+    if (success || hookRuns(benchLateBlocked) || !injection::setEnabled("benchLateBlocked", true)
+        || !hookRuns(benchLateBlocked)) {
+        printf("A later batch with a thread that blocks signals running was not left off\n");
+        return 1;
+    }
+    printf("%-24s %8.2f us to fail\n", "later batch, blocked runner", time);
+    return 0;
+}
@@ -0,0 +1,109 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+// Measures the cost per call, in cycles, of the latency probe functions themselves: `probeEnter`, and for sampled
+// calls `probeExit` with the return address stack around it, as the generated code calls them around a probed
+// function. The trampoline that calls them is not included; bench_hook measures the whole probe on a real injection.
+// Also checks that a thread takes over the state of one that exited.
+
+#include "injection_priv.hpp"
+#include "latency_priv.hpp"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+#include <x86intrin.h>
+
+using namespace coretorio::latency;
+using coretorio::injection::popReturn;
+using coretorio::injection::pushReturn;
+
+
+
+// Called instead of the probes for the baseline, so that both loops make the same call and branch.
+__attribute__((noinline)) static bool emptyEnter(void *) {
+    asm volatile("");
+    return false;
+}
+__attribute__((noinline)) static void emptyExit(void *) {
+    asm volatile("");
+}
+
+// Call the probe functions for one call of a probed function.
+static void probeCall(bool (*enter)(void *), void (*exit)(void *), void *probe, void *histogram) {
+    if (enter(probe)) {
+        pushReturn(NULL);
+        exit(histogram);
+        popReturn();
+    }
+}
+
+// Get the average number of cycles per probed call.
+static double measure(bool (*volatile enter)(void *), void (*volatile exit)(void *), void *probe, size_t iterations) {
+    size_t index     = (uintptr_t)probe & 0xffffffff;
+    void  *histogram = (void *)(offsetof(ThreadLatency, histograms) + index * sizeof(Histogram));
+    for (size_t i = 0; i < iterations / 16; i++) {
+        probeCall(enter, exit, probe, histogram);
+    }
+    uint64_t start = __rdtsc();
+    for (size_t i = 0; i < iterations; i++) {
+        probeCall(enter, exit, probe, histogram);
+    }
+    return (double)(__rdtsc() - start) / iterations;
+}
+
+// Get the number of calls a probe recorded on all threads.
+static uint64_t recordedCalls(size_t index) {
+    uint64_t recorded = 0;
+    for (ThreadLatency *state = threadStates.load(); state; state = state->next) {
+        for (uint64_t count : state->histograms[index].counts) {
+            recorded += count;
+        }
+    }
+    return recorded;
+}
+
+int main(int argc, char **argv) {
+    size_t iterations = argc > 1 ? strtoul(argv[1], NULL, 0) : 20000000;
+    size_t calls      = iterations + iterations / 16;
+
+    void  *every    = probeArgument(0, 1);
+    void  *sampled  = probeArgument(1, DEFAULT_SAMPLE_INTERVAL);
+    double baseline = measure(emptyEnter, emptyExit, every, iterations);
+    double timed    = measure(probeEnter, probeExit, every, iterations);
+    double skipped  = measure(probeEnter, probeExit, sampled, iterations);
+
+    // Every call must have been recorded with an interval of 1, and about one in the interval otherwise.
+    uint64_t recorded = recordedCalls(0);
+    if (recorded != calls) {
+        printf("Probes recorded %llu calls instead of %zu\n", (unsigned long long)recorded, calls);
+        return 1;
+    }
+    recorded        = recordedCalls(1);
+    double expected = (double)calls / DEFAULT_SAMPLE_INTERVAL;
+    if (recorded < expected * 0.9 || recorded > expected * 1.1) {
+        printf("Probes sampled %llu calls instead of about %.0f\n", (unsigned long long)recorded, expected);
+        return 1;
+    }
+
+    // Threads that probed and exited leave their state to the next thread instead of each adding one.
+    for (int i = 0; i < 4; i++) {
+        std::thread([every] {
+            probeCall(probeEnter, probeExit, every, (void *)offsetof(ThreadLatency, histograms));
+        }).join();
+    }
+    size_t states = 0;
+    for (ThreadLatency *state = threadStates.load(); state; state = state->next) {
+        states++;
+    }
+    if (states != 2) {
+        printf("Probes made %zu states for 2 threads at a time\n", states);
+        return 1;
+    }
+    printf("%-24s %8.2f cycles/call\n", "empty calls", baseline);
+    printf("%-24s %8.2f cycles/call (+%.2f)\n", "probes, every call", timed, timed - baseline);
+    printf("%-24s %8.2f cycles/call (+%.2f)\n", "probes, 1 in 64 sampled", skipped, skipped - baseline);
+    return 0;
+}
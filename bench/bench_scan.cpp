@@ -0,0 +1,130 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+// Measures the throughput of the signature scanner with each instruction set and number of patterns,
+// on synthetic code about the size of Factorio's .text section with the patterns planted in it, against a separate
+// pass per pattern.
+
+#include "signature_scan.hpp"
+
+#include <chrono>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+using namespace coretorio::signature;
+using Clock = std::chrono::steady_clock;
+
+
+
+// Generate bytes with roughly the distribution of x86-64 code: mostly common opcode and ModRM bytes, some zeroes
+// and padding, and the rest random.
+static std::vector<uint8_t> syntheticCode(std::mt19937_64 &rng, size_t size) {
+    static uint8_t const common[] = {0x48, 0x89, 0x8b, 0x0f, 0xe8, 0x24, 0x4c, 0x41, 0x85, 0x8d, 0x83, 0xc3, 0x74};
+    std::vector<uint8_t> code(size);
+    for (auto &byte : code) {
+        uint64_t roll = rng();
+        switch (roll % 8) {
+            case 0:
+            case 1:
+            case 2: byte = common[(roll >> 8) % sizeof(common)]; break;
+            case 3: byte = roll % 64 ? 0x00 : 0xcc; break;
+            default: byte = roll >> 8; break;
+        }
+    }
+    return code;
+}
+
+// Generate a pattern of a typical length with some wildcards, and plant it in the code once.
+static Pattern plantPattern(std::mt19937_64 &rng, std::vector<uint8_t> &code) {
+    size_t      length = 12 + rng() % 12;
+    size_t      pos    = rng() % (code.size() - length);
+    std::string text;
+    for (size_t i = 0; i < length; i++) {
+        char hex[4];
+        snprintf(hex, sizeof(hex), "%02x ", code[pos + i]);
+        // Wildcards stand in for displacements and immediates, which change between builds.
+        text += i > 0 && rng() % 4 == 0 ? "?? " : hex;
+    }
+    Pattern pattern;
+    Pattern::parse(text, pattern);
+    return pattern;
+}
+
+int main(int argc, char **argv) {
+    size_t size   = argc > 1 ? strtoul(argv[1], NULL, 0) : 40 << 20;
+    size_t rounds = 4;
+
+    std::mt19937_64      rng(1234);
+    std::vector<uint8_t> code = syntheticCode(rng, size);
+    std::vector<Pattern> all;
+    for (size_t i = 0; i < 64; i++) {
+        all.push_back(plantPattern(rng, code));
+    }
+
+    printf("Scanning %.1f MiB of synthetic code\n", size / 1048576.0);
+    for (size_t count : {1, 8, 64}) {
+        std::vector<Pattern>             patterns(all.begin(), all.begin() + count);
+        std::vector<std::vector<size_t>> expected;
+        for (ScanLevel level : {ScanLevel::SCALAR, ScanLevel::SSE42, ScanLevel::AVX2}) {
+            if (level == ScanLevel::AVX2 && !__builtin_cpu_supports("avx2")) {
+                continue;
+            }
+            std::vector<std::vector<size_t>> matches;
+            auto                             start = Clock::now();
+            for (size_t i = 0; i < rounds; i++) {
+                scan(code.data(), code.size(), patterns, matches, level);
+            }
+            double seconds = std::chrono::duration<double>(Clock::now() - start).count() / rounds;
+
+            // Every level must find the same matches, including every planted one.
+            if (expected.empty()) {
+                expected = matches;
+            } else if (matches != expected) {
+                printf("Scanning with %s found different matches\n", scanLevelName(level));
+                return 1;
+            }
+            for (auto &found : matches) {
+                if (found.empty()) {
+                    printf("Scanning with %s missed a planted pattern\n", scanLevelName(level));
+                    return 1;
+                }
+            }
+            printf(
+                "%-8s %2zu patterns: %8.2f GB/s (%.2f ms)\n",
+                scanLevelName(level),
+                count,
+                size / seconds / 1e9,
+                seconds * 1e3
+            );
+        }
+
+        // Baseline: a separate pass per pattern with the best instruction set, as searching one signature at a
+        // time would do.
+        ScanLevel                        level = bestScanLevel();
+        std::vector<std::vector<size_t>> matches(count);
+        auto                             start = Clock::now();
+        for (size_t i = 0; i < rounds; i++) {
+            for (size_t j = 0; j < count; j++) {
+                std::vector<std::vector<size_t>> single;
+                scan(code.data(), code.size(), {patterns[j]}, single, level);
+                matches[j] = std::move(single[0]);
+            }
+        }
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count() / rounds;
+        if (matches != expected) {
+            printf("Scanning one pattern at a time found different matches\n");
+            return 1;
+        }
+        printf(
+            "%-8s %2zu patterns: %8.2f GB/s (%.2f ms), one pass per pattern\n",
+            scanLevelName(level),
+            count,
+            size / seconds / 1e9,
+            seconds * 1e3
+        );
+    }
+    return 0;
+}
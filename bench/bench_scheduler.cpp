@@ -0,0 +1,88 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+// Measures what moving a tick's work to the scheduler costs and gains: simulated ticks submit tasks to a
+// `TickGroup` and wait for them, as an injection before and after the tick function would, for several sizes of
+// task, against running the same work on the calling thread. The worker statistics are printed at the end.
+// Pass the number of workers and optionally a list of CPUs, such as `4 2-5`.
+
+#include "scheduler.hpp"
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+using namespace coretorio::scheduler;
+using Clock = std::chrono::steady_clock;
+
+
+
+// Elapsed time in microseconds.
+static double elapsedUs(Clock::time_point start) {
+    return std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+}
+
+// Work standing in for analytics over some entities; returns a value so that it is not optimized out.
+static uint64_t work(uint64_t seed, size_t iterations) {
+    uint64_t value = seed | 1;
+    for (size_t i = 0; i < iterations; i++) {
+        value ^= value << 13;
+        value ^= value >> 7;
+        value ^= value << 17;
+    }
+    return value;
+}
+
+int main(int argc, char **argv) {
+    Config config;
+    config.workers = argc > 1 ? strtoul(argv[1], NULL, 0) : 0;
+    if (argc > 2) {
+        setenv("CORETORIO_SCHED_CPUS", argv[2], 1);
+    }
+    if (!start(config)) {
+        return 1;
+    }
+
+    size_t            ticks = 2000;
+    TickGroup         group;
+    volatile uint64_t sink = 0;
+    printf("%zu ticks per measurement\n", ticks);
+    for (size_t tasks : {8, 64, 512}) {
+        for (size_t iterations : {0, 1000, 20000}) {
+            // The same work on the calling thread, for comparison.
+            auto start = Clock::now();
+            for (size_t tick = 0; tick < ticks; tick++) {
+                for (size_t i = 0; i < tasks; i++) {
+                    sink = sink + work(tick * tasks + i, iterations);
+                }
+            }
+            double inlineUs = elapsedUs(start) / ticks;
+
+            std::vector<uint64_t> results(tasks);
+            start = Clock::now();
+            for (size_t tick = 0; tick < ticks; tick++) {
+                for (size_t i = 0; i < tasks; i++) {
+                    group.submit([&results, i, seed = tick * tasks + i, iterations] {
+                        results[i] = work(seed, iterations);
+                    });
+                }
+                group.wait();
+                for (uint64_t result : results) {
+                    sink = sink + result;
+                }
+            }
+            double scheduledUs = elapsedUs(start) / ticks;
+            printf(
+                "%4zu tasks of %5zu iterations: %9.2f us per tick inline, %9.2f us scheduled (%.2fx)\n",
+                tasks,
+                iterations,
+                inlineUs,
+                scheduledUs,
+                inlineUs / scheduledUs
+            );
+        }
+    }
+    dumpStats(stdout);
+    return 0;
+}
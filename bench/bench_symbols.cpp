@@ -0,0 +1,214 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+// Compares symbol lookup through the flat `SymbolIndex` against the `std::map` it replaced,
+// and address lookup through `AddressIndex` against a `std::map` of address ranges,
+// on a synthetic symbol table about the size of Factorio's.
+
+#include "address_index.hpp"
+#include "symbol_index.hpp"
+
+#include <chrono>
+#include <map>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+using namespace coretorio::object;
+using Clock = std::chrono::steady_clock;
+
+
+
+// Elapsed time in nanoseconds.
+static double elapsedNs(Clock::time_point start) {
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+}
+
+// Generate a plausible Itanium-mangled name.
+static std::string mangledName(std::mt19937_64 &rng, size_t i) {
+    static char const *const namespaces[] = {"", "8Factorio", "3Gui", "6Entity", "3Map", "5Train", "7Circuit"};
+    static char const *const classes[]    = {"Inserter", "AssemblingMachine", "TransportBelt", "Surface", "GuiElement"};
+    static char const *const methods[]    = {"update", "render", "serialise", "onTick", "destroy", "getPosition"};
+    static char const *const params[]     = {"Ev", "Ei", "ERK8MapPosition", "EP6Entityb", "ERKSt6vectorIiSaIiEE"};
+
+    std::string cls  = std::string(classes[rng() % 5]) + std::to_string(i);
+    std::string meth = methods[rng() % 6];
+    std::string name = "_ZN";
+    name += namespaces[rng() % 7];
+    name += std::to_string(cls.size()) + cls;
+    name += std::to_string(meth.size()) + meth;
+    name += params[rng() % 5];
+    return name;
+}
+
+int main(int argc, char **argv) {
+    size_t symbolCount = argc > 1 ? strtoul(argv[1], NULL, 0) : 500000;
+    size_t lookupCount = 1000000;
+    size_t batchSize   = 256;
+
+    // Generate the symbol table; names are kept in one buffer like a real .strtab.
+    std::mt19937_64          rng(1234);
+    std::vector<std::string> owned;
+    owned.reserve(symbolCount);
+    for (size_t i = 0; i < symbolCount; i++) {
+        owned.push_back(mangledName(rng, i));
+    }
+    std::vector<Symbol> syms(symbolCount);
+    for (size_t i = 0; i < symbolCount; i++) {
+        syms[i]              = Symbol{};
+        syms[i].st_name_str  = owned[i];
+        syms[i].st_info      = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC);
+        syms[i].st_shndx     = 1;
+        syms[i].st_value     = 0x400000 + i * 64;
+        syms[i].st_size      = 16 + rng() % 48;
+        syms[i].st_value_ptr = (void *)syms[i].st_value;
+    }
+
+    // Lookups hit random existing names, with one in eight missing.
+    std::vector<std::string> missing;
+    for (size_t i = 0; i < lookupCount / 8; i++) {
+        missing.push_back(mangledName(rng, symbolCount + i));
+    }
+    std::vector<std::string_view> queries(lookupCount);
+    for (size_t i = 0; i < lookupCount; i++) {
+        queries[i] = i % 8 == 7 ? std::string_view(missing[i / 8]) : std::string_view(owned[rng() % symbolCount]);
+    }
+
+    // Build both.
+    auto start = Clock::now();
+    std::map<std::string_view, Symbol> map;
+    for (auto &sym : syms) {
+        map.emplace(sym.st_name_str, sym);
+    }
+    double mapBuild = elapsedNs(start);
+
+    start = Clock::now();
+    SymbolIndex index;
+    index.build(std::vector<Symbol>(syms));
+    double indexBuild = elapsedNs(start);
+
+    // Single lookups.
+    size_t found = 0;
+    start        = Clock::now();
+    for (auto name : queries) {
+        auto res  = map.find(name);
+        found    += res != map.end();
+    }
+    double mapLookup = elapsedNs(start);
+
+    size_t indexFound = 0;
+    start             = Clock::now();
+    for (auto name : queries) {
+        indexFound += index.find(name) != NULL;
+    }
+    double indexLookup = elapsedNs(start);
+
+    // Batched lookups.
+    size_t                      batchFound = 0;
+    std::vector<Symbol const *> out(batchSize);
+    start = Clock::now();
+    for (size_t i = 0; i < lookupCount; i += batchSize) {
+        size_t n    = lookupCount - i < batchSize ? lookupCount - i : batchSize;
+        batchFound += index.findMany(&queries[i], out.data(), n);
+    }
+    double batchLookup = elapsedNs(start);
+
+    // Batched lookups with the hashes computed ahead of time, like `SymbolId`s declared `constexpr`.
+    std::vector<uint64_t> hashes(lookupCount);
+    for (size_t i = 0; i < lookupCount; i++) {
+        hashes[i] = hashName(queries[i]);
+    }
+    size_t hashedFound = 0;
+    start              = Clock::now();
+    for (size_t i = 0; i < lookupCount; i += batchSize) {
+        size_t n     = lookupCount - i < batchSize ? lookupCount - i : batchSize;
+        hashedFound += index.findMany(&queries[i], &hashes[i], out.data(), n);
+    }
+    double hashedLookup = elapsedNs(start);
+
+    if (found != indexFound || found != batchFound || found != hashedFound) {
+        printf(
+            "Mismatch: map found %zu, index %zu, batch %zu, prehashed %zu\n",
+            found,
+            indexFound,
+            batchFound,
+            hashedFound
+        );
+        return 1;
+    }
+
+    // Address lookups, some of which fall in the gaps between functions.
+    std::vector<uint64_t> addrs(lookupCount);
+    for (auto &addr : addrs) {
+        addr = 0x400000 + rng() % (symbolCount * 64);
+    }
+
+    start = Clock::now();
+    std::map<uint64_t, Symbol const *> addrMap;
+    for (auto &sym : syms) {
+        addrMap.emplace(sym.st_value, &sym);
+    }
+    double addrMapBuild = elapsedNs(start);
+
+    start = Clock::now();
+    AddressIndex addrIndex;
+    addrIndex.build(syms.data(), syms.size());
+    double addrIndexBuild = elapsedNs(start);
+
+    size_t addrFound = 0;
+    start            = Clock::now();
+    for (auto addr : addrs) {
+        auto res = addrMap.upper_bound(addr);
+        if (res != addrMap.begin() && addr - (--res)->first < res->second->st_size) {
+            addrFound++;
+        }
+    }
+    double addrMapLookup = elapsedNs(start);
+
+    size_t addrIndexFound = 0;
+    start                 = Clock::now();
+    for (auto addr : addrs) {
+        addrIndexFound += addrIndex.find(addr) >= 0;
+    }
+    double addrIndexLookup = elapsedNs(start);
+
+    if (addrFound != addrIndexFound) {
+        printf("Mismatch: address map found %zu, index %zu\n", addrFound, addrIndexFound);
+        return 1;
+    }
+
+    // A map node is the key, the value and three pointers plus a color, rounded to malloc granularity.
+    size_t mapNode = (sizeof(std::string_view) + sizeof(Symbol) + 32 + 15) & ~(size_t)15;
+    printf("symbols: %zu, lookups: %zu (%zu hits)\n", symbolCount, lookupCount, found);
+    printf(
+        "std::map        build %8.2f ms  lookup %7.1f ns  memory ~%6.1f MiB\n",
+        mapBuild / 1e6,
+        mapLookup / lookupCount,
+        mapNode * map.size() / 1048576.0
+    );
+    printf(
+        "SymbolIndex     build %8.2f ms  lookup %7.1f ns  memory  %6.1f MiB\n",
+        indexBuild / 1e6,
+        indexLookup / lookupCount,
+        index.memoryUsage() / 1048576.0
+    );
+    printf("SymbolIndex x%-3zu              lookup %7.1f ns\n", batchSize, batchLookup / lookupCount);
+    printf("SymbolIndex x%-3zu prehashed    lookup %7.1f ns\n", batchSize, hashedLookup / lookupCount);
+    printf("address lookups: %zu (%zu hits)\n", lookupCount, addrFound);
+    printf(
+        "std::map        build %8.2f ms  lookup %7.1f ns  memory ~%6.1f MiB\n",
+        addrMapBuild / 1e6,
+        addrMapLookup / lookupCount,
+        48.0 * addrMap.size() / 1048576.0
+    );
+    printf(
+        "AddressIndex    build %8.2f ms  lookup %7.1f ns  memory  %6.1f MiB\n",
+        addrIndexBuild / 1e6,
+        addrIndexLookup / lookupCount,
+        addrIndex.memoryUsage() / 1048576.0
+    );
+
+    return 0;
+}
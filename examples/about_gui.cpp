@@ -0,0 +1,25 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+// Example coremod: prints a message whenever the about GUI is opened.
+// Build with CORETORIO_EXAMPLES and copy the shared object into the coremod directory.
+
+#include "coremod.hpp"
+#include "injection.hpp"
+
+#include <stdio.h>
+
+
+
+CORETORIO_COREMOD("about-gui", "", "");
+
+// The `AboutGui()` constructor, hashed at compile time.
+static constexpr coretorio::injection::SymbolId ABOUT_GUI_CTOR("_ZN8AboutGuiC1Ev");
+
+static void onAboutGui() {
+    printf("You opened the about GUI!\n");
+}
+
+CORETORIO_COREMOD_INIT {
+    coretorio::injection::injectBefore(ABOUT_GUI_CTOR, onAboutGui);
+}
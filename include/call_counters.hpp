@@ -0,0 +1,72 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+#include <stdint.h>
+#include <string>
+
+#pragma once
+
+
+
+namespace coretorio::counters {
+
+// Counts of calls to hooked functions, published in shared memory.
+//
+// The counts are kept in `/dev/shm/coretorio-counters.<pid>` while the game runs, where other local processes can
+// map them read-only and poll them without stopping the game. The file is removed when the game exits normally;
+// readers that have it mapped keep the final counts. If the game is killed or crashes, the file is left behind, and
+// a reader may remove files whose process no longer exists. All values are little-endian and naturally aligned,
+// so that 32- and 64-bit values never tear. The file holds:
+//   - a `CounterHeader` at offset 0;
+//   - `maxCounters` `CounterName`s at `namesOffset`;
+//   - `maxThreads` blocks of `maxCounters` 64-bit counts at `blocksOffset`, `blockSize` bytes apart.
+// Each thread that calls a counted function gets its own block, aligned to a cache line, and increments its counts
+// without atomic instructions. The number of calls of counter `i` is the sum of entry `i` of the first `threads`
+// blocks. A block keeps its counts when its thread exits and is handed to the next new thread, so sums never
+// decrease. `counters` and `threads` only increase, and the names and blocks below them are complete once they can
+// be seen; a reader should load them with acquire semantics and only start once `magic` is set.
+
+// Magic number at the start of the file; the last character is the layout version.
+static constexpr char COUNTERS_MAGIC[8] = {'C', 'T', 'C', 'O', 'U', 'N', 'T', '1'};
+
+// Header of the shared memory file.
+struct CounterHeader {
+    // `COUNTERS_MAGIC`, written last when the file is set up.
+    char     magic[8];
+    // Number of entries in the names table and in each block.
+    uint32_t maxCounters;
+    // Number of per-thread blocks.
+    uint32_t maxThreads;
+    // Number of counters in use.
+    uint32_t counters;
+    // Number of per-thread blocks in use.
+    uint32_t threads;
+    // Offset of the names table in the file.
+    uint64_t namesOffset;
+    // Offset of the first per-thread block in the file.
+    uint64_t blocksOffset;
+    // Distance between per-thread blocks in bytes; a multiple of 64.
+    uint64_t blockSize;
+    // Number of calls that were not counted because all blocks were in use.
+    uint64_t dropped;
+    // Reserved, zero.
+    uint64_t reserved;
+};
+static_assert(sizeof(CounterHeader) == 64, "CounterHeader is part of a fixed layout");
+
+// Description of a counter in the names table.
+struct CounterName {
+    // Address of the counted function in the game.
+    uint64_t address;
+    // Symbol name of the counted function, NUL-terminated and truncated if needed.
+    char     name[120];
+};
+static_assert(sizeof(CounterName) == 128, "CounterName is part of a fixed layout");
+
+// Count the calls to one of Factorio's functions; takes effect with the next `injection::performInjections`.
+// Returns false if the function does not exist or no more counters are available.
+bool     countCalls(std::string const &symbolName);
+// Get the number of calls to a function counted so far, summed over all threads; 0 if it is not counted.
+uint64_t getCallCount(std::string const &symbolName);
+
+} // namespace coretorio::counters
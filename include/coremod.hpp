@@ -0,0 +1,33 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+
+
+// A coremod is a shared object in the coremod directory that declares itself with `CORETORIO_COREMOD` and defines
+// `CORETORIO_COREMOD_INIT`, in which it adds its injections:
+//
+//     CORETORIO_COREMOD("better-gui", "gui-base", "");
+//     CORETORIO_COREMOD_INIT {
+//         coretorio::injection::injectBefore(ABOUT_GUI_CTOR, onAboutGui);
+//     }
+//
+// The declaration is read from the file before the coremod is loaded, so that coremods are loaded and initialized
+// after the ones they depend on; the injections of all coremods are then performed together. Injections must not be
+// added from constructors of static objects, which run when the coremod is loaded.
+
+// Name of the ELF section that holds the declaration.
+#define CORETORIO_COREMOD_SECTION     ".coretorio.coremod"
+// Name of the function that adds a coremod's injections.
+#define CORETORIO_COREMOD_INIT_SYMBOL "coretorio_coremod_init"
+
+// Declare a coremod: its name, the coremods it requires, and optional coremods it must come after if they are
+// present, each a list of names separated by spaces. Names can't contain whitespace.
+// A coremod is not loaded if a coremod it requires is missing or fails.
+#define CORETORIO_COREMOD(name, dependencies, after)                                                                   \
+    __attribute__((section(CORETORIO_COREMOD_SECTION), used)) static char const coretorioCoremod[] =                   \
+        "name " name "\nrequires " dependencies "\nafter " after "\n"
+
+// Define the function that adds a coremod's injections.
+#define CORETORIO_COREMOD_INIT extern "C" __attribute__((visibility("default"))) void coretorio_coremod_init()
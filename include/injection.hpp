@@ -1,8 +1,17 @@
 // Copyright © 2024, Julian Scheffers
 // SPDX-License-Identifier: MIT
 
+#include "symbol_id.hpp"
+
+#include <array>
 #include <functional>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 #include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 
 #pragma once
 
@@ -11,9 +20,81 @@
 namespace coretorio::injection {
 
 // A function to call, which is only notified and nothing else.
-using SimpleInjection = std::function<void()>;
+// The generated code calls it directly.
+using SimpleInjection    = void (*)();
+// A function object to call, for injections that need to capture state.
+// The generated code calls it through a small thunk, so prefer `SimpleInjection` for hot functions.
+using CapturingInjection = std::function<void()>;
+
+// Registers of a hooked function as saved by the generated code, for injections that access arguments or return
+// values. Changes are written back to the registers when the injection returns.
+struct alignas(16) CallRegisters {
+    // Index of each register in `gpr`.
+    enum { RDI, RSI, RDX, RCX, R8, R9, RAX };
+    // General-purpose registers: the integer arguments in order, then rax.
+    // Integer results are returned in rax and rdx.
+    uint64_t gpr[7];
+    // Vector registers xmm0-7: the floating point arguments in order; xmm0 and xmm1 hold floating point results.
+    alignas(16) uint8_t xmm[8][16];
+    // Address of the first argument passed on the stack; NULL for return values.
+    uint8_t            *stack;
+};
+
 // Something that can be injected into a function.
-using Injection       = SimpleInjection;
+struct Injection {
+    // Address of the function the generated code calls.
+    void *func;
+    // Argument passed to `func`, or NULL if it takes none.
+    void *arg;
+    // Whether `func` may change vector registers; if not, they are not saved around it.
+    // Only xmm0-15 are saved, not the upper halves of the ymm and zmm registers, zmm16-31 or the AVX-512 mask
+    // registers: saving those would take `xsave` or 256-bit moves, which cost more than the rest of the trampoline
+    // and slow down SSE code that follows on some CPUs. Almost any code may change them, since compilers and libc
+    // functions such as `memcpy` end AVX code with `vzeroupper`, so only inject functions that don't use SIMD into
+    // functions that take or return 256- or 512-bit vectors.
+    bool  usesSimd      = true;
+    // Whether `func` takes a `CallRegisters *` as second argument.
+    bool  passRegisters = false;
+    // Whether this injection takes part in sampling calls. A sampled before-injection returns a `bool`, true if it
+    // samples the call. If a site has sampled before-injections and all of its after-injections are sampled, the
+    // after-injections only run for calls that one of them sampled, and other calls keep their return address.
+    // Sampled after-injections must still cope with running for calls that they did not sample themselves.
+    bool  sampled       = false;
+
+    Injection(void *func, void *arg) : func(func), arg(arg) {
+    }
+    // Create an injection from a function, lambda or other function object.
+    // Plain functions and lambdas without captures are called directly;
+    // anything else is stored in a `CapturingInjection` that is never freed.
+    template <typename Func, typename = std::enable_if_t<!std::is_same_v<std::decay_t<Func>, Injection>>>
+    Injection(Func &&func) : Injection(from(std::forward<Func>(func))) {
+    }
+
+    // Get a copy of this injection that is marked as not changing any vector (SSE/AVX) registers.
+    // Only use this for functions compiled without vector instructions, such as with `-mgeneral-regs-only`.
+    Injection withoutSimd() const {
+        Injection copy = *this;
+        copy.usesSimd  = false;
+        return copy;
+    }
+    // Get a copy of this injection that is marked as sampling calls; see `sampled`.
+    Injection withSampling() const {
+        Injection copy = *this;
+        copy.sampled   = true;
+        return copy;
+    }
+
+    // Create an injection that calls a `CapturingInjection`.
+    static Injection fromCapturing(CapturingInjection func);
+    // Create an injection from a function, lambda or other function object.
+    template <typename Func> static Injection from(Func &&func) {
+        if constexpr (std::is_convertible_v<Func, SimpleInjection>) {
+            return Injection(reinterpret_cast<void *>(static_cast<SimpleInjection>(func)), NULL);
+        } else {
+            return fromCapturing(CapturingInjection(std::forward<Func>(func)));
+        }
+    }
+};
 
 
 // Point of a function to inject code into.
@@ -38,14 +119,183 @@ struct InjectionPoint {
 
 // Inject code to run at one of Factorio's functions.
 void injectAt(std::string const &symbolName, Injection toInject, InjectionPoint point);
+// Inject code to run at one of Factorio's functions, named by a `SymbolId`.
+void injectAt(SymbolId symbol, Injection toInject, InjectionPoint point);
 
 // Inject code to run before one of Factorio's functions.
-static inline void injectBefore(std::string const &symbolName, SimpleInjection toInject) {
+static inline void injectBefore(std::string const &symbolName, Injection toInject) {
     injectAt(symbolName, toInject, InjectionPoint::before());
 }
+// Inject code to run before one of Factorio's functions, named by a `SymbolId`.
+static inline void injectBefore(SymbolId symbol, Injection toInject) {
+    injectAt(symbol, toInject, InjectionPoint::before());
+}
 // Inject code to run after one of Factorio's functions.
-static inline void injectAfter(std::string const &symbolName, SimpleInjection toInject) {
+// While the function runs, its return address is replaced, so it must not be unwound through by an exception.
+static inline void injectAfter(std::string const &symbolName, Injection toInject) {
     injectAt(symbolName, toInject, InjectionPoint::after());
 }
+// Inject code to run after one of Factorio's functions, named by a `SymbolId`.
+static inline void injectAfter(SymbolId symbol, Injection toInject) {
+    injectAt(symbol, toInject, InjectionPoint::after());
+}
+
+// Replace one of Factorio's functions with another one of the same signature.
+// Once `performInjections` has succeeded, `original` (if not NULL) points to a function that runs the original
+// code, for the replacement to fall back to. Injections before and after the function still run.
+void replaceAt(std::string const &symbolName, void *replacement, void **original);
+// Replace one of Factorio's functions, named by a `SymbolId`, with another one of the same signature.
+void replaceAt(SymbolId symbol, void *replacement, void **original);
+// Replace one of Factorio's functions with another one of the same signature.
+// Once `performInjections` has succeeded, `original` (if not NULL) points to a function that runs the original
+// code, for the replacement to fall back to. Calls cost a direct jump more than calling `replacement`, and also an
+// indirect `jmp [rip]` if `replacement` is more than 2 GiB away from the game's code, as functions of a coremod library
+// usually are.
+template <typename Func>
+static inline void replace(std::string const &symbolName, Func *replacement, Func **original = NULL) {
+    static_assert(std::is_function_v<Func>, "Replacements must be functions");
+    replaceAt(symbolName, reinterpret_cast<void *>(replacement), reinterpret_cast<void **>(original));
+}
+// Replace one of Factorio's functions, named by a `SymbolId`, with another one of the same signature.
+template <typename Func> static inline void replace(SymbolId symbol, Func *replacement, Func **original = NULL) {
+    static_assert(std::is_function_v<Func>, "Replacements must be functions");
+    replaceAt(symbol, reinterpret_cast<void *>(replacement), reinterpret_cast<void **>(original));
+}
+
+// Switch the injections and replacement on one of Factorio's functions on or off; callable from any thread.
+// Before `performInjections`, this sets the state they start in. Afterwards, the entry of the function is rewritten
+// while other threads may be running it, which takes some microseconds; while off, the function is unchanged and
+// runs at full speed. Returns false if there is nothing to switch or the function could not be rewritten, as when a
+// thread that blocks all signals is running.
+bool setEnabled(std::string const &symbolName, bool enabled);
+// Switch the injections and replacement on one of Factorio's functions, named by a `SymbolId`, on or off.
+bool setEnabled(SymbolId symbol, bool enabled);
+
+// Find one of Factorio's functions by a pattern of its code, for functions whose symbol is missing or was renamed.
+// The pattern is hexadecimal bytes separated by spaces, where `??` matches any byte, like "48 89 5c 24 ?? 57";
+// `offset` is added to where it matches to get the start of the function. Injections at `symbolName` use the symbol
+// if there is one and the pattern otherwise, which must then match exactly once in the game's .text section.
+// All patterns are searched for together by the next `performInjections`. Returns false if the pattern is invalid.
+bool defineSignature(std::string const &symbolName, std::string const &pattern, ptrdiff_t offset = 0);
+
+
+namespace detail {
+
+// Where an argument is passed according to the System V ABI.
+struct ArgLocation {
+    // Register file or stack.
+    enum Kind { GPR, XMM, STACK } kind;
+    // Index in `CallRegisters::gpr`, `CallRegisters::xmm` or in 8-byte stack slots.
+    size_t index;
+};
+
+// Whether a type is passed in a general-purpose register.
+template <typename T>
+constexpr bool isIntegerClass = std::is_integral_v<T> || std::is_enum_v<T> || std::is_pointer_v<T>;
+// Whether a type is passed in a vector register.
+template <typename T> constexpr bool isVectorClass = std::is_same_v<T, float> || std::is_same_v<T, double>;
+
+// Assign locations to arguments the way the System V ABI does for scalar arguments.
+template <typename... Args> constexpr std::array<ArgLocation, sizeof...(Args)> locateArgs() {
+    static_assert(
+        (... && (isIntegerClass<Args> || isVectorClass<Args>)),
+        "Only integer, enum, pointer, float and double arguments are supported; declare references as pointers"
+    );
+    std::array<ArgLocation, sizeof...(Args)> locations{};
+    bool const vector[] = {isVectorClass<Args>..., false};
+    size_t     gpr = 0, xmm = 0, stack = 0;
+    for (size_t i = 0; i < sizeof...(Args); i++) {
+        if (vector[i]) {
+            locations[i] = xmm < 8 ? ArgLocation{ArgLocation::XMM, xmm++} : ArgLocation{ArgLocation::STACK, stack++};
+        } else {
+            locations[i] = gpr < 6 ? ArgLocation{ArgLocation::GPR, gpr++} : ArgLocation{ArgLocation::STACK, stack++};
+        }
+    }
+    return locations;
+}
+
+// Get the saved copy of a value at a location.
+static inline void *locate(CallRegisters &regs, ArgLocation location) {
+    switch (location.kind) {
+        case ArgLocation::GPR: return &regs.gpr[location.index];
+        case ArgLocation::XMM: return regs.xmm[location.index];
+        default: return regs.stack + 8 * location.index;
+    }
+}
+
+// Calls typed injections for functions with the signature `Ret(Args...)`.
+template <typename Sig> struct Adapter;
+template <typename Ret, typename... Args> struct Adapter<Ret(Args...)> {
+    // Injection that runs before the function and may change its arguments.
+    using BeforeHook = void (*)(Args &...);
+    // Injection that runs after the function and may change its return value.
+    using AfterHook  = void (*)(std::conditional_t<std::is_void_v<Ret>, void *, Ret> &);
+
+    // Call a `BeforeHook` with the arguments, then store them back.
+    static void before(void *hook, CallRegisters *regs) {
+        callBefore(hook, *regs, std::index_sequence_for<Args...>());
+    }
+    template <size_t... I> static void callBefore(void *hook, CallRegisters &regs, std::index_sequence<I...>) {
+        constexpr auto      locations = locateArgs<Args...>();
+        std::tuple<Args...> values;
+        (memcpy(&std::get<I>(values), locate(regs, locations[I]), sizeof(Args)), ...);
+        reinterpret_cast<BeforeHook>(hook)(std::get<I>(values)...);
+        (memcpy(locate(regs, locations[I]), &std::get<I>(values), sizeof(Args)), ...);
+    }
+
+    // Call an `AfterHook` with the return value, then store it back.
+    static void after(void *hook, CallRegisters *regs) {
+        static_assert(!std::is_void_v<Ret>, "Use the untyped `injectAfter` for functions without a return value");
+        static_assert(
+            isIntegerClass<Ret> || isVectorClass<Ret>,
+            "Only integer, enum, pointer, float and double return values are supported"
+        );
+        void *slot = isVectorClass<Ret> ? (void *)regs->xmm[0] : (void *)&regs->gpr[CallRegisters::RAX];
+        Ret   value;
+        memcpy(&value, slot, sizeof(Ret));
+        reinterpret_cast<AfterHook>(hook)(value);
+        memcpy(slot, &value, sizeof(Ret));
+    }
+
+    // Create the injection that calls a `BeforeHook`.
+    static Injection forBefore(BeforeHook hook) {
+        Injection injection((void *)&before, reinterpret_cast<void *>(hook));
+        injection.passRegisters = true;
+        return injection;
+    }
+    // Create the injection that calls an `AfterHook`.
+    static Injection forAfter(AfterHook hook) {
+        Injection injection((void *)&after, reinterpret_cast<void *>(hook));
+        injection.passRegisters = true;
+        return injection;
+    }
+};
+
+} // namespace detail
+
+// Inject code to run before one of Factorio's functions, with access to its arguments.
+// `Sig` is the function's signature, such as `void(Gui *, int)`, and the injection takes each argument by
+// reference, such as `void hook(Gui *&gui, int &index)`; changes to them are passed on to the function.
+template <typename Sig>
+static inline void injectBefore(std::string const &symbolName, typename detail::Adapter<Sig>::BeforeHook hook) {
+    injectAt(symbolName, detail::Adapter<Sig>::forBefore(hook), InjectionPoint::before());
+}
+// Inject code to run before one of Factorio's functions, named by a `SymbolId`, with access to its arguments.
+template <typename Sig>
+static inline void injectBefore(SymbolId symbol, typename detail::Adapter<Sig>::BeforeHook hook) {
+    injectAt(symbol, detail::Adapter<Sig>::forBefore(hook), InjectionPoint::before());
+}
+// Inject code to run after one of Factorio's functions, with access to its return value.
+// `Sig` is the function's signature, and the injection takes the return value by reference, such as
+// `void hook(int &result)`; changes to it are returned to the caller.
+template <typename Sig>
+static inline void injectAfter(std::string const &symbolName, typename detail::Adapter<Sig>::AfterHook hook) {
+    injectAt(symbolName, detail::Adapter<Sig>::forAfter(hook), InjectionPoint::after());
+}
+// Inject code to run after one of Factorio's functions, named by a `SymbolId`, with access to its return value.
+template <typename Sig>
+static inline void injectAfter(SymbolId symbol, typename detail::Adapter<Sig>::AfterHook hook) {
+    injectAt(symbol, detail::Adapter<Sig>::forAfter(hook), InjectionPoint::after());
+}
 
 } // namespace coretorio::injection
@@ -0,0 +1,75 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+#pragma once
+
+
+
+namespace coretorio::latency {
+
+// Histogram of durations in TSC cycles with logarithmic buckets, in the style of HdrHistogram.
+// Values below `2 * SUB_BUCKETS` have a bucket each; above that, every power of two is split into `SUB_BUCKETS`
+// buckets, so a value is known to within 1 / `SUB_BUCKETS` of itself. Histograms are merged by adding counts.
+struct Histogram {
+    // Number of bits of a value below its highest set bit that select a bucket.
+    static constexpr int    SUB_BITS    = 3;
+    // Number of buckets per power of two.
+    static constexpr size_t SUB_BUCKETS = 1 << SUB_BITS;
+    // Number of buckets, enough for any 64-bit value.
+    static constexpr size_t BUCKETS     = (64 - SUB_BITS) * SUB_BUCKETS + SUB_BUCKETS;
+
+    // Number of values in each bucket.
+    uint64_t counts[BUCKETS] = {};
+
+    // Get the bucket a value goes in.
+    static size_t bucketOf(uint64_t value) {
+        if (value < SUB_BUCKETS) {
+            return value;
+        }
+        int shift = 63 - __builtin_clzll(value) - SUB_BITS;
+        return shift * SUB_BUCKETS + (value >> shift);
+    }
+    // Get the lowest value that goes in a bucket.
+    static uint64_t lowerBound(size_t bucket) {
+        if (bucket < 2 * SUB_BUCKETS) {
+            return bucket;
+        }
+        size_t shift = bucket / SUB_BUCKETS - 1;
+        return (uint64_t)(bucket % SUB_BUCKETS + SUB_BUCKETS) << shift;
+    }
+
+    // Add the counts of another histogram to this one.
+    void     merge(Histogram const &other);
+    // Get the number of values.
+    uint64_t total() const;
+    // Get the lower bound of the bucket that the given fraction of values is at or below, 0 if there are none.
+    uint64_t percentile(double fraction) const;
+    // Get an estimate of the sum of the values, from the lower bounds of their buckets.
+    uint64_t sum() const;
+};
+
+// Sample interval of probes that are not given one.
+static constexpr uint32_t DEFAULT_SAMPLE_INTERVAL = 64;
+
+// Measure the time spent in one of Factorio's functions, including calls that end in a tail call and recursive calls;
+// takes effect with the next `injection::performInjections`.
+// One in about `sampleInterval` calls is timed, at random intervals, and only those pay for timing; the others pay for
+// little more than counting down to the next sample. An interval of 1 times every call. Probing a function again keeps
+// its first interval.
+// The probe is an injection after the function, so while a sampled call runs its return address is replaced: an
+// exception thrown through it terminates the game. Only probe functions that no exception propagates out of.
+// Returns false if the function does not exist, the interval is 0 or above 2^31, or no more probes are available.
+bool probe(std::string const &symbolName, uint32_t sampleInterval = DEFAULT_SAMPLE_INTERVAL);
+// Get the durations of the sampled calls to a probed function so far, merged over all threads.
+// Returns false if the function is not probed.
+bool getHistogram(std::string const &symbolName, Histogram &out);
+// Write a summary of the durations of every probed function, the most total time first; the numbers of calls and
+// total times are estimated from the samples.
+void dumpHistograms(FILE *to);
+
+} // namespace coretorio::latency
@@ -0,0 +1,222 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+#include "injection.hpp"
+
+#include <atomic>
+#include <memory>
+#include <optional>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#pragma once
+
+
+
+namespace coretorio::scheduler {
+
+// A pool of worker threads that coremods can move work off Factorio's update thread to.
+//
+// Every worker has its own queue of tasks: tasks submitted by a task go on the queue of the worker running it, and
+// a worker that runs out of work steals the oldest task from another worker's queue. Tasks submitted from any other
+// thread, such as from an injection into the game, go on a shared queue that workers take batches from, so the rest
+// of the batch can be stolen by the others. Idle workers spin briefly, then sleep until a task is submitted.
+//
+// Work for a tick is submitted to a `TickGroup` before the tick function and waited for at a chosen point after it:
+//
+//     static coretorio::scheduler::TickGroup analytics;
+//     CORETORIO_COREMOD_INIT {
+//         coretorio::injection::injectBefore(GAME_UPDATE, [] {
+//             analytics.submit([] { countEntities(); });
+//         });
+//         coretorio::scheduler::waitAt(analytics, GAME_UPDATE, coretorio::injection::InjectionPoint::after());
+//     }
+//
+// A thread waiting for a group or future runs queued tasks itself instead of blocking, so waiting does not add a
+// context switch and tasks make progress even if all workers are busy. Tasks must not throw.
+
+struct TickGroup;
+
+// Settings of the worker threads.
+// Settings left at their defaults are taken from the environment when the workers are started.
+struct Config {
+    // Number of worker threads, or 0 to use CORETORIO_SCHED_WORKERS, which defaults to half the CPUs so that the
+    // game's own threads keep the rest.
+    size_t           workers = 0;
+    // CPUs to pin the workers to, handed out to them in turn, or empty to use CORETORIO_SCHED_CPUS, a list such as
+    // `2-5,8`; if neither is set, workers may run on any CPU.
+    std::vector<int> cpus;
+};
+
+// Statistics of one worker thread since it started.
+struct WorkerStats {
+    // CPU the worker is pinned to, or -1 if it is not pinned.
+    int      cpu;
+    // Number of tasks it ran.
+    uint64_t tasks;
+    // Number of tasks it took from the queues of other workers.
+    uint64_t steals;
+    // Number of attempts to steal that found no task or lost the task to another thread.
+    uint64_t failedSteals;
+    // Number of times it went to sleep for lack of work.
+    uint64_t sleeps;
+    // Time spent without work, looking for some or asleep.
+    double   idleMs;
+};
+
+// Statistics of the scheduler since the workers started.
+struct Stats {
+    // Statistics of each worker.
+    std::vector<WorkerStats> workers;
+    // Number of tasks submitted.
+    uint64_t                 submitted;
+    // Number of tasks run by threads waiting for a group or future instead of by the workers.
+    uint64_t                 helped;
+};
+
+// Start the worker threads; they run until the process exits.
+// Called by the first submitted task if no coremod does so before. Returns false if the workers are already running
+// or a setting is invalid.
+bool  start(Config const &config = Config());
+// Get the statistics of the scheduler; all zero if the workers have not started.
+Stats getStats();
+// Write the statistics of every worker.
+void  dumpStats(FILE *to);
+
+namespace detail {
+
+// A unit of work in the queues.
+struct Task {
+    // Group that waits for this task, or NULL.
+    TickGroup            *group = NULL;
+    // Set once the task has run.
+    std::atomic_bool      done{false};
+    // Keeps the task alive while it is queued; released once it has run, after which its future may be the only owner.
+    std::shared_ptr<Task> self;
+
+    virtual ~Task() = default;
+    // Do the work; called exactly once, on whichever thread takes the task.
+    virtual void run() noexcept = 0;
+};
+
+// A task and its result.
+template <typename Result> struct ResultTask : Task {
+    // Result, set once the task has run.
+    std::optional<Result> result;
+};
+
+// A task without result.
+template <> struct ResultTask<void> : Task {};
+
+// A task that calls a function object.
+template <typename Func, typename Result> struct FuncTask : ResultTask<Result> {
+    // Function object to call.
+    Func func;
+
+    template <typename Arg> FuncTask(Arg &&func) : func(std::forward<Arg>(func)) {
+    }
+
+    void run() noexcept override {
+        if constexpr (std::is_void_v<Result>) {
+            func();
+        } else {
+            this->result.emplace(func());
+        }
+    }
+};
+
+// Queue a task, starting the workers if they are not running yet.
+void enqueue(std::shared_ptr<Task> task);
+// Run queued tasks on the calling thread until `isDone(arg)` returns true.
+void helpUntil(bool (*isDone)(void *), void *arg);
+// Wait for a `TickGroup`; what `waitAt` injects.
+void waitForGroup(void *group);
+
+} // namespace detail
+
+// Handle to the result of a submitted task.
+template <typename Result> struct Future {
+    // The task, or NULL for a future that has no task.
+    std::shared_ptr<detail::ResultTask<Result>> task;
+
+    Future() = default;
+    explicit Future(std::shared_ptr<detail::ResultTask<Result>> task) : task(std::move(task)) {
+    }
+
+    // Whether this future has a task.
+    bool valid() const {
+        return task != NULL;
+    }
+    // Whether the task has finished.
+    bool ready() const {
+        return task->done.load(std::memory_order_acquire);
+    }
+    // Wait for the task to finish; the calling thread runs queued tasks in the meantime.
+    void wait() const {
+        detail::helpUntil(
+            [](void *task) { return ((detail::Task *)task)->done.load(std::memory_order_acquire); },
+            task.get()
+        );
+    }
+    // Wait for the task to finish and get its result.
+    decltype(auto) get() const {
+        wait();
+        if constexpr (!std::is_void_v<Result>) {
+            return (*task->result);
+        }
+    }
+};
+
+namespace detail {
+
+// Submit a function object as a task for a group, or for no group if `group` is NULL.
+template <typename Func> auto submitTask(Func &&func, TickGroup *group) {
+    using Result = std::invoke_result_t<std::decay_t<Func> &>;
+    auto task    = std::make_shared<FuncTask<std::decay_t<Func>, Result>>(std::forward<Func>(func));
+    task->group  = group;
+    enqueue(task);
+    return Future<Result>(std::move(task));
+}
+
+} // namespace detail
+
+// Tasks that must be finished by a point of the game's tick.
+// A group can be submitted to and waited for again every tick, but only one thread may wait for it at a time.
+struct TickGroup {
+    // Number of submitted tasks that have not finished.
+    std::atomic_size_t pending{0};
+
+    // Submit a function object as a task that `wait` waits for.
+    template <typename Func> auto submit(Func &&func) {
+        pending.fetch_add(1, std::memory_order_relaxed);
+        return detail::submitTask(std::forward<Func>(func), this);
+    }
+    // Wait until every task submitted so far has finished; the calling thread runs queued tasks in the meantime.
+    void wait() {
+        detail::helpUntil(
+            [](void *group) { return ((TickGroup *)group)->pending.load(std::memory_order_acquire) == 0; },
+            this
+        );
+    }
+};
+
+// Submit a function object as a task.
+template <typename Func> auto submit(Func &&func) {
+    return detail::submitTask(std::forward<Func>(func), NULL);
+}
+
+// Wait for a group at one of Factorio's functions, such as after the tick function, every time it is reached.
+// The group must stay valid for as long as the injection exists.
+static inline void waitAt(TickGroup &group, std::string const &symbolName, injection::InjectionPoint point) {
+    injection::injectAt(symbolName, injection::Injection((void *)&detail::waitForGroup, &group), point);
+}
+// Wait for a group at one of Factorio's functions, named by a `SymbolId`.
+static inline void waitAt(TickGroup &group, injection::SymbolId symbol, injection::InjectionPoint point) {
+    injection::injectAt(symbol, injection::Injection((void *)&detail::waitForGroup, &group), point);
+}
+
+} // namespace coretorio::scheduler
@@ -0,0 +1,43 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+#include <stdint.h>
+#include <string_view>
+
+#pragma once
+
+
+
+namespace coretorio::injection {
+
+// Hash a symbol name (64-bit FNV-1a with a final mix so the low bits are usable as a table index).
+// The symbol index uses the same hash, so names hashed ahead of time are looked up without hashing them again.
+constexpr uint64_t hashSymbolName(std::string_view name) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (char c : name) {
+        hash ^= (uint8_t)c;
+        hash *= 0x100000001b3;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccd;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+// Name of one of Factorio's symbols together with its hash.
+// Declared `constexpr`, the name is hashed at compile time:
+//     static constexpr SymbolId ABOUT_GUI_CTOR("_ZN8AboutGuiC1Ev");
+// Injecting by `SymbolId` neither hashes nor copies the name, so registering many hooks does not allocate; the name
+// is only referenced and must stay valid for as long as the injections exist, which string literals always do.
+// Two different names with the same hash are reported as an error when the second is injected at.
+struct SymbolId {
+    // Symbol name, not owned.
+    std::string_view name;
+    // Hash of `name`.
+    uint64_t         hash;
+
+    constexpr explicit SymbolId(std::string_view name) : name(name), hash(hashSymbolName(name)) {
+    }
+};
+
+} // namespace coretorio::injection
@@ -0,0 +1,101 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+#include <stdint.h>
+#include <string>
+
+#pragma once
+
+
+
+namespace coretorio::tracing {
+
+// Binary trace of the calls to traced functions.
+//
+// Every entry to and exit from a traced function is an event, which the calling thread pushes into a ring buffer of
+// its own without taking locks or making system calls. A background thread drains the ring buffers into the trace
+// file, which is mapped into memory and grows as needed. If a ring buffer is full, its thread drops the event and
+// counts it instead of waiting. All values in the file are little-endian and naturally aligned. The file holds:
+//   - a `TraceHeader` at offset 0;
+//   - `maxSymbols` `TraceSymbol`s right after the header;
+//   - `events` `TraceEvent`s at `eventsOffset`.
+// Events of one thread are in the order they happened; events of different threads are interleaved in chunks.
+// The header is updated after every chunk of events, so the file is usable even if the game does not exit cleanly.
+
+// Magic number at the start of the file; the last character is the layout version.
+static constexpr char     TRACE_MAGIC[8] = {'C', 'T', 'T', 'R', 'A', 'C', 'E', '1'};
+// Flag in `TraceEvent::symbol` that marks an exit instead of an entry.
+static constexpr uint32_t TRACE_EXIT     = 1u << 31;
+
+// Header of the trace file.
+struct TraceHeader {
+    // `TRACE_MAGIC`, written last when the file is set up.
+    char     magic[8];
+    // Number of entries in the symbol table.
+    uint32_t maxSymbols;
+    // Number of symbols in use.
+    uint32_t symbols;
+    // Offset of the first event in the file.
+    uint64_t eventsOffset;
+    // Number of events in the file.
+    uint64_t events;
+    // Number of events that were dropped because a ring buffer was full.
+    uint64_t dropped;
+    // Time stamp counter value when tracing started.
+    uint64_t startTime;
+    // Time stamp counter ticks per second, as measured while tracing.
+    uint64_t tscFrequency;
+    // Process ID of the game.
+    uint32_t pid;
+    // Reserved, zero.
+    uint32_t reserved;
+};
+static_assert(sizeof(TraceHeader) == 64, "TraceHeader is part of a fixed layout");
+
+// Description of a traced function in the symbol table.
+struct TraceSymbol {
+    // Address of the traced function in the game.
+    uint64_t address;
+    // Symbol name of the traced function, NUL-terminated and truncated if needed.
+    char     name[120];
+};
+static_assert(sizeof(TraceSymbol) == 128, "TraceSymbol is part of a fixed layout");
+
+// An entry to or exit from a traced function.
+struct TraceEvent {
+    // Time stamp counter value.
+    uint64_t time;
+    // Thread ID of the thread that made the call.
+    uint32_t thread;
+    // Index in the symbol table, with `TRACE_EXIT` set for exits.
+    uint32_t symbol;
+};
+static_assert(sizeof(TraceEvent) == 16, "TraceEvent is part of a fixed layout");
+
+// Counts of traced events so far.
+struct TraceStats {
+    // Number of events written to the trace file.
+    uint64_t written;
+    // Number of events that were dropped because a ring buffer was full.
+    uint64_t dropped;
+};
+
+// Trace every entry to and exit from one of Factorio's functions, including calls that end in a tail call;
+// takes effect with the next `injection::performInjections`.
+// The exit event comes from an injection after the function, so while it runs its return address is replaced: an
+// exception thrown through it terminates the game. Only trace functions that no exception propagates out of.
+// Returns false if the function does not exist or no more symbols are available.
+bool       trace(std::string const &symbolName);
+// Start writing events to a new trace file, replacing it if it exists.
+// Returns false if the file could not be created or a trace is already being written.
+bool       startTrace(std::string const &path);
+// Stop tracing, write all remaining events and close the trace file.
+// Returns false if no trace was being written.
+bool       stopTrace();
+// Get the number of events written and dropped by the current or last trace.
+TraceStats getTraceStats();
+// Convert a trace file to the JSON format of Chrome's trace viewer, with times in microseconds.
+// Returns false if the trace could not be read or the output could not be written.
+bool       convertToChromeJson(std::string const &tracePath, std::string const &jsonPath);
+
+} // namespace coretorio::tracing
@@ -0,0 +1,72 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+#include "object.hpp"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#pragma once
+
+
+
+namespace coretorio::object {
+
+// Immutable index of function address ranges, for mapping code addresses back to symbols.
+// Start addresses are stored in Eytzinger (breadth-first) order so a lookup walks the array top-down,
+// and the next levels can be prefetched a whole cache line at a time.
+struct AddressIndex {
+    // Key storage, if owned by the index; padded so that `keys` is cache line aligned.
+    std::vector<uint64_t> keyStorage;
+    // Size storage, if owned by the index.
+    std::vector<uint32_t> sizeStorage;
+    // Symbol index storage, if owned by the index.
+    std::vector<uint32_t> indexStorage;
+    // Function start addresses in Eytzinger order, 1-based.
+    uint64_t const       *keys    = NULL;
+    // Function sizes, in the same order as `keys`.
+    uint32_t const       *sizes   = NULL;
+    // Symbol indices, in the same order as `keys`.
+    uint32_t const       *indices = NULL;
+    // Number of functions in the index.
+    size_t                count   = 0;
+
+    // Build the index from the functions in a symbol table.
+    // Where multiple symbols start at the same address, the largest and then the first one is used.
+    void build(Symbol const *symbols, size_t symbolCount);
+
+    // Find the index of the symbol containing an address, or -1 if none does.
+    ptrdiff_t find(uint64_t addr) const {
+        size_t k = 1;
+        while (k <= count) {
+            __builtin_prefetch(keys + k * 8);
+            k = 2 * k + (keys[k] <= addr);
+        }
+        // The last right turn in the path taken is the last start address <= `addr`.
+        k >>= __builtin_ctzl(k) + 1;
+        if (k == 0 || addr - keys[k] >= sizes[k]) {
+            return -1;
+        }
+        return indices[k];
+    }
+
+    // Find the lowest function start address above an address, or 0 if there is none.
+    uint64_t findNextStart(uint64_t addr) const {
+        size_t k = 1;
+        while (k <= count) {
+            __builtin_prefetch(keys + k * 8);
+            k = 2 * k + (keys[k] <= addr);
+        }
+        // The last left turn in the path taken is the first start address > `addr`.
+        k >>= __builtin_ffsl(~k);
+        return k == 0 ? 0 : keys[k];
+    }
+
+    // Approximate memory used by the index.
+    size_t memoryUsage() const {
+        return (count + 1) * (sizeof(uint64_t) + 2 * sizeof(uint32_t));
+    }
+};
+
+} // namespace coretorio::object
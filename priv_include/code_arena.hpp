@@ -0,0 +1,57 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#pragma once
+
+
+
+namespace coretorio::injection {
+
+// Allocator for executable memory within rel32 range of the code it is generated for.
+// Memory is handed out writable and only becomes executable when `seal` is called, which flips every page written
+// since the previous `seal` with one `mprotect` per chunk. Sealed pages are never made writable again, so code in
+// them can keep running while more is allocated for later injections.
+struct CodeArena {
+    // Alignment of every allocation; one cache line.
+    static constexpr size_t ALIGN      = 64;
+    // Minimum size of a chunk of memory reserved from the kernel.
+    static constexpr size_t CHUNK_SIZE = 1 << 20;
+
+    // A contiguous mapping that allocations are taken from.
+    struct Chunk {
+        // Start address of the mapping.
+        size_t addr;
+        // Size of the mapping.
+        size_t size;
+        // Number of bytes handed out.
+        size_t used;
+        // Number of bytes already made executable; a multiple of the page size.
+        size_t sealed;
+    };
+
+    // Lowest address a chunk may start at.
+    size_t             nearLow  = 0;
+    // Highest address a chunk may end at.
+    size_t             nearHigh = SIZE_MAX;
+    // Chunks, in the order they were reserved.
+    std::vector<Chunk> chunks;
+
+    // Keep all memory within rel32 range of the code in [start, end).
+    void                setTarget(size_t start, size_t end);
+    // Allocate writable memory for code, returns 0 on failure.
+    size_t              alloc(size_t size);
+    // Make all memory allocated since the last call executable.
+    bool                seal();
+    // Get the number of bytes used in each chunk, to roll back to later.
+    std::vector<size_t> checkpoint() const;
+    // Free all memory allocated since `checkpoint` was called that has not been sealed since.
+    void                rollback(std::vector<size_t> const &used);
+    // Reserve a chunk of at least `size` bytes, returns NULL on failure.
+    Chunk              *reserve(size_t size);
+};
+
+} // namespace coretorio::injection
@@ -0,0 +1,22 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+#include <string>
+
+#pragma once
+
+
+
+namespace coretorio::coremods {
+
+// Get the directory coremods are loaded from.
+// Set by the CORETORIO_COREMODS environment variable, defaults to `coremods` in the working directory.
+std::string directory();
+
+// Load every coremod in a directory and add their injections, without performing them.
+// The files are found and their declarations read on the worker pool; the coremods are then loaded and initialized
+// one at a time on the calling thread, each after the ones it depends on, and the time each took is printed.
+// Returns false if any coremod could not be loaded; the others are still loaded.
+bool loadAll(std::string const &dir);
+
+} // namespace coretorio::coremods
@@ -4,9 +4,11 @@
 #include "injection.hpp"
 #include "object.hpp"
 
-#include <map>
+#include <algorithm>
+#include <chrono>
 #include <memory>
 #include <stdint.h>
+#include <stdio.h>
 #include <vector>
 
 #pragma once
@@ -16,14 +18,75 @@
 namespace coretorio::injection {
 using object::Symbol;
 
+struct CodeArena;
+struct InjectionCtx;
+struct Toggle;
+
+// Injections at one point of a site, in the order they were added.
+// The first one is stored inline, so that registering a hook that is the only one at its point does not allocate.
+struct InjectionList {
+    // The first injection, if `count` is at least 1.
+    Injection              first{NULL, NULL};
+    // The injections after the first.
+    std::vector<Injection> rest;
+    // Number of injections.
+    size_t                 count = 0;
+
+    // Iterates over the injections in order.
+    struct Iterator {
+        InjectionList const *list;
+        size_t               index;
+
+        Injection const &operator*() const {
+            return index ? list->rest[index - 1] : list->first;
+        }
+        Iterator &operator++() {
+            index++;
+            return *this;
+        }
+        bool operator!=(Iterator const &other) const {
+            return index != other.index;
+        }
+    };
+
+    void push_back(Injection injection) {
+        if (count++) {
+            rest.push_back(injection);
+        } else {
+            first = injection;
+        }
+    }
+    size_t size() const {
+        return count;
+    }
+    Iterator begin() const {
+        return {this, 0};
+    }
+    Iterator end() const {
+        return {this, count};
+    }
+};
+
 // An injection site.
 struct InjectionSite {
-    // Symbol to inject at.
-    Symbol const          *symbol;
+    // Symbol name and hash the site was added by.
+    SymbolId       id{""};
+    // Symbol to inject at, resolved by `performInjections`.
+    Symbol const  *symbol = NULL;
     // Injections to place before the function.
-    std::vector<Injection> before;
+    InjectionList  before;
     // Injections to place after the function.
-    std::vector<Injection> after;
+    InjectionList  after;
+    // Function to run instead, or NULL if the function is not replaced.
+    void          *replacement = NULL;
+    // Where to store the address of the original function when the function is replaced, or NULL.
+    void         **original    = NULL;
+    // Whether the injections and replacement are active; the initial state before `performInjections`.
+    bool           enabled     = true;
+    // Switch for the entry patch, created by `performInjections`.
+    Toggle        *toggle      = NULL;
+    // Whether the site was injected; no injections can be added to it anymore.
+    bool           installed   = false;
 };
 
 // A section of generated code.
@@ -34,32 +97,97 @@ struct Section {
     std::vector<uint8_t> code;
 };
 
+// Reference to a section of an `InjectionCtx`: the index of a patch or one of the special values below.
+// Indices stay valid when sections are added or contexts are merged, unlike pointers.
+using SectionRef = uint32_t;
+// Section reference to the generated code.
+static constexpr SectionRef SECTION_GENERATED = UINT32_MAX - 1;
+// Section reference that means the offset is an absolute address.
+static constexpr SectionRef SECTION_ABSOLUTE  = UINT32_MAX;
+
 // Relocation entry.
+// The value written is `S + A - P` for relative and `S + A` for absolute types, where S is the referenced address,
+// A the addend and P the address of the field itself.
 struct Reloc {
-    // Architecture-specific relocation type.
-    int      type;
+    enum Type : uint8_t {
+        // 8-bit PC-relative, for short jumps.
+        REL8,
+        // 32-bit PC-relative operand of a `call` or `jmp` at the end of the instruction, with an addend of -4.
+        // If the target is out of range, the branch goes through a veneer instead.
+        BRANCH32,
+        // 32-bit PC-relative data reference, such as a RIP-relative displacement.
+        REL32,
+        // 64-bit absolute address.
+        ABS64,
+    };
+    // Relocation type.
+    Type       type;
     // Relocation addend.
-    size_t   addend;
+    int64_t    addend;
     // Target section.
-    Section *target;
+    SectionRef target;
     // Relocation offset in target section.
-    size_t   targetOffset;
+    size_t     targetOffset;
     // Reference section.
-    Section *reference;
-    // Relocation offset in reference section.
-    size_t   referenceOffset;
-    // Apply this relocation.
-    void     apply() const;
+    SectionRef reference;
+    // Relocation offset in reference section, or absolute address for `SECTION_ABSOLUTE`.
+    size_t     referenceOffset;
+
+    // Apply this relocation with the referenced address `symbol`, returns false if the value does not fit.
+    bool apply(InjectionCtx &ctx, size_t symbol) const;
+};
+
+// Address in the generated code to publish once it is linked.
+struct Export {
+    // Where to store the address.
+    void **dest;
+    // Offset in the generated code.
+    size_t offset;
+};
+
+// Instruction boundary in a relocated prologue.
+struct Boundary {
+    // Offset of the instruction in the function.
+    uint32_t offset;
+    // Offset of its copy from the start of the relocated prologue.
+    uint32_t relocated;
+    // Whether the instruction follows a call, so that return addresses may point to it.
+    bool     afterCall;
+};
+
+// Entry patch of an injection site, with what is needed to switch it on and off at runtime.
+struct EntryPatch {
+    // Site the patch is for; filled in by `performInjections`.
+    InjectionSite        *site;
+    // Section of the patch.
+    SectionRef            patch;
+    // Offset of the relocated prologue in the generated code.
+    size_t                original;
+    // Boundaries of the instructions in the relocated prologue.
+    std::vector<Boundary> boundaries;
 };
 
 // Injection linking context.
 struct InjectionCtx {
     // Patched code sections.
-    std::vector<Section> patches;
+    std::vector<Section>    patches;
     // Primary output section.
-    Section              generated;
+    Section                 generated;
     // Relocations.
-    std::vector<Reloc>   reloc;
+    std::vector<Reloc>      reloc;
+    // Addresses to publish once linked.
+    std::vector<Export>     exports;
+    // Entry patches of the sites.
+    std::vector<EntryPatch> entries;
+
+    // Get a section by reference; must not be `SECTION_ABSOLUTE`.
+    Section &getSection(SectionRef ref) {
+        return ref == SECTION_GENERATED ? generated : patches[ref];
+    }
+    // Get the address of an offset in a section.
+    size_t addressOf(SectionRef ref, size_t offset) {
+        return ref == SECTION_ABSOLUTE ? offset : getSection(ref).addr + offset;
+    }
 };
 
 // Code flow graph instruction.
@@ -77,6 +205,8 @@ struct CodeFlowInsn {
         BRANCH,
         // Other instructions.
         OTHER,
+        // Instruction that could not be decoded.
+        INVALID,
     };
 
     // Type of this instruction.
@@ -89,74 +219,247 @@ struct CodeFlowInsn {
     bool isEndOfFunction() const {
         return type == TAILCALL || type == RETURN;
     }
+    // Whether execution can continue at the next instruction.
+    bool fallsThrough() const {
+        return type == BRANCH || type == CALL || type == OTHER;
+    }
 };
 
-// Code flow graph.
+// Code flow graph of one function, made of basic blocks.
 template <typename InsnType> struct CodeFlowGraph {
+    // Decoded instruction.
     struct Node : InsnType {
         // Next instruction after this one.
         size_t      next;
-        // Branching instruction after this one.
+        // Target of a direct branch, jump or call, 0 if there is none.
         size_t      branch;
         // Analyze code and create a new node.
         static Node analyze(size_t startAddress, size_t maxLength);
     };
 
-    // Start point of the graph.
-    size_t                 startAddress;
-    // Unordered set of instructions.
-    std::map<size_t, Node> insns;
+    // Index value for a missing block.
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+    // A run of instructions that is only entered at the top and only left at the bottom.
+    struct Block {
+        // Start address.
+        size_t   start;
+        // End address (exclusive).
+        size_t   end;
+        // Index of the first instruction in `insns`.
+        uint32_t firstInsn;
+        // Number of instructions.
+        uint32_t insnCount;
+        // Fall-through and branch target successor blocks, `NONE` if absent.
+        uint32_t succ[2];
+        // Index of the first predecessor in `preds`.
+        uint32_t firstPred;
+        // Number of predecessors.
+        uint32_t predCount;
+    };
+
+    // Start address of the function.
+    size_t                startAddress;
+    // Length of the function in bytes.
+    size_t                length;
+    // Reachable instructions, sorted by address.
+    std::vector<Node>     insns;
+    // Basic blocks, sorted by address.
+    std::vector<Block>    blocks;
+    // Predecessor block indices, grouped by block.
+    std::vector<uint32_t> preds;
+    // Time taken to analyze the function, in microseconds.
+    double                analysisTime;
+
+    // Whether an address lies within the function.
+    bool contains(size_t addr) const {
+        return addr - startAddress < length;
+    }
 
     // Create a code flow graph by analyzing code.
+    // Only direct branches are followed: an indirect jump, such as through the jump table of a `switch`, ends its block
+    // without successors, so code that is only reached through it is not in the graph, and neither are its targets
+    // as block leaders. Liveness treats every register as live after such a jump.
     static CodeFlowGraph analyze(Symbol const &symbol) {
+        auto          startTime = std::chrono::steady_clock::now();
         CodeFlowGraph graph;
         graph.startAddress = (size_t)symbol.st_value_ptr;
-        std::vector<size_t> toAnalyze;
-        toAnalyze.push_back(graph.startAddress);
+        graph.length       = symbol.st_size;
 
-        for (int i = 0; i < 400 && toAnalyze.size(); i++) {
-            size_t addr = toAnalyze.back();
+        // Decode every reachable instruction once, marking the addresses that start a block.
+        enum : uint8_t { INSN_START = 1, LEADER = 2 };
+        std::vector<uint8_t> marks(graph.length);
+        std::vector<size_t>  toAnalyze;
+        if (graph.length) {
+            toAnalyze.push_back(0);
+            marks[0] |= LEADER;
+        }
+        while (toAnalyze.size()) {
+            size_t offset = toAnalyze.back();
             toAnalyze.pop_back();
-            Node &node = graph.insns[addr];
-            if (node.addr == addr) {
-                continue;
+            while (offset < graph.length && !(marks[offset] & INSN_START)) {
+                Node node = Node::analyze(graph.startAddress + offset, graph.length - offset);
+                if (node.type == InsnType::Type::INVALID) {
+                    break;
+                }
+                marks[offset] |= INSN_START;
+                if (node.type == InsnType::Type::JUMP && node.branch && !graph.contains(node.branch)) {
+                    node.type = InsnType::Type::TAILCALL;
+                }
+                graph.insns.push_back(node);
+
+                if ((node.type == InsnType::Type::BRANCH || node.type == InsnType::Type::JUMP)
+                    && graph.contains(node.branch)) {
+                    marks[node.branch - graph.startAddress] |= LEADER;
+                    toAnalyze.push_back(node.branch - graph.startAddress);
+                }
+                offset += node.length;
+                if (node.type == InsnType::Type::BRANCH) {
+                    if (offset < graph.length) {
+                        marks[offset] |= LEADER;
+                    }
+                } else if (node.type != InsnType::Type::OTHER && node.type != InsnType::Type::CALL) {
+                    // Returns, tail calls and (indirect) jumps don't fall through.
+                    break;
+                }
             }
-            node = Node::analyze(addr, symbol.st_size - addr + graph.startAddress);
-            if (node.type == InsnType::Type::JUMP
-                && (node.addr < graph.startAddress || node.addr >= graph.startAddress + symbol.st_size)) {
-                node.type = InsnType::Type::TAILCALL;
-                printf("Tailcall\n");
+        }
+
+        // Split the instructions into blocks.
+        std::sort(graph.insns.begin(), graph.insns.end(), [](Node const &a, Node const &b) { return a.addr < b.addr; });
+        for (size_t i = 0; i < graph.insns.size(); i++) {
+            Node const &node = graph.insns[i];
+            if (i == 0 || (marks[node.addr - graph.startAddress] & LEADER) || graph.insns[i - 1].next != node.addr
+                || !graph.insns[i - 1].fallsThrough()) {
+                graph.blocks.push_back(Block{node.addr, node.next, (uint32_t)i, 0, {NONE, NONE}, 0, 0});
+            }
+            graph.blocks.back().end = node.next;
+            graph.blocks.back().insnCount++;
+        }
+
+        // Link the blocks together.
+        for (auto &block : graph.blocks) {
+            Node const &last = graph.insns[block.firstInsn + block.insnCount - 1];
+            if (last.fallsThrough()) {
+                block.succ[0] = graph.blockIndexAt(last.next);
             }
-            if (node.type == InsnType::Type::BRANCH) {
-                toAnalyze.push_back(node.branch);
+            if ((last.type == InsnType::Type::BRANCH || last.type == InsnType::Type::JUMP)
+                && graph.contains(last.branch)) {
+                block.succ[1] = graph.blockIndexAt(last.branch);
             }
-            if (node.type != InsnType::Type::RETURN && node.type != InsnType::Type::TAILCALL) {
-                toAnalyze.push_back(node.next);
+            for (uint32_t succ : block.succ) {
+                if (succ != NONE) {
+                    graph.blocks[succ].predCount++;
+                }
+            }
+        }
+        uint32_t predPos = 0;
+        for (auto &block : graph.blocks) {
+            block.firstPred  = predPos;
+            predPos         += block.predCount;
+            block.predCount  = 0;
+        }
+        graph.preds.resize(predPos);
+        for (uint32_t i = 0; i < graph.blocks.size(); i++) {
+            for (uint32_t succ : graph.blocks[i].succ) {
+                if (succ != NONE) {
+                    graph.preds[graph.blocks[succ].firstPred + graph.blocks[succ].predCount++] = i;
+                }
             }
         }
 
+        graph.analysisTime =
+            std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - startTime).count();
         return graph;
     }
 
-    // Get the node that starts at a certain address.
-    Node &getNodeAt(size_t startAddress) {
-        if (insns.find(startAddress) == insns.end()) {
-            size_t jumpAddr = 0;
-            Node  *node     = Node::analyze(startAddress, jumpAddr);
-            insns.emplace(startAddress, node);
-            return node;
-        } else {
-            return insns[startAddress];
+    // Get the index of the block containing an address, or `NONE` if there is none.
+    uint32_t blockIndexAt(size_t addr) const {
+        auto block = std::upper_bound(blocks.begin(), blocks.end(), addr, [](size_t addr, Block const &block) {
+            return addr < block.start;
+        });
+        if (block == blocks.begin() || addr >= (--block)->end) {
+            return NONE;
+        }
+        return block - blocks.begin();
+    }
+
+    // Get the block containing an address, or NULL if there is none.
+    Block const *getBlockAt(size_t addr) const {
+        uint32_t index = blockIndexAt(addr);
+        return index == NONE ? NULL : &blocks[index];
+    }
+
+    // Get the node that starts at a certain address, or NULL if there is none.
+    Node const *getNodeAt(size_t startAddress) const {
+        auto node = std::lower_bound(insns.begin(), insns.end(), startAddress, [](Node const &node, size_t addr) {
+            return node.addr < addr;
+        });
+        if (node == insns.end() || node->addr != startAddress) {
+            return NULL;
+        }
+        return &*node;
+    }
+
+    // Solve backward liveness over sets of up to 64 registers and get the set live at the start of each block.
+    // `use` holds the registers each block reads before writing them, `def` the registers it writes and `exit` the
+    // registers live where it leaves the function or continues somewhere that is not known.
+    std::vector<uint64_t> liveness(
+        std::vector<uint64_t> const &use, std::vector<uint64_t> const &def, std::vector<uint64_t> const &exit
+    ) const {
+        std::vector<uint64_t> liveIn(blocks.size());
+        // Visiting blocks backwards converges quickly, since most edges go forward.
+        bool                  changed = true;
+        while (changed) {
+            changed = false;
+            for (size_t i = blocks.size(); i-- > 0;) {
+                uint64_t liveOut = exit[i];
+                for (uint32_t succ : blocks[i].succ) {
+                    if (succ != NONE) {
+                        liveOut |= liveIn[succ];
+                    }
+                }
+                uint64_t live = use[i] | (liveOut & ~def[i]);
+                if (live != liveIn[i]) {
+                    liveIn[i] = live;
+                    changed   = true;
+                }
+            }
         }
+        return liveIn;
+    }
+
+    // Memory used by the graph in bytes.
+    size_t memoryUsage() const {
+        return sizeof(*this) + insns.capacity() * sizeof(Node) + blocks.capacity() * sizeof(Block)
+               + preds.capacity() * sizeof(uint32_t);
     }
 };
 
 // Generate code for all injections on a symbol.
 bool doCodeGen(InjectionCtx &ctx, InjectionSite const &site);
+// Place the generated code in executable memory, add veneers for branches that are out of range
+// and apply all relocations.
+bool link(InjectionCtx &ctx, CodeArena &arena);
+// Find the functions that have no symbol by their signatures, searching `.text` once for all that were not searched
+// for before. Sets the entries of `out` that are NULL and have a signature that matched; returns how many it set.
+size_t resolveSignatures(std::string_view const *names, Symbol const **out, size_t count);
+
+// Number of running functions with after-injections on this thread, whose real return addresses are kept.
+extern __attribute__((tls_model("initial-exec"))) thread_local size_t returnDepth;
+
+// Remember the real return address of a function with after-injections; called from generated code.
+void  pushReturn(void *addr);
+// Get back the real return address of a function with after-injections; called from generated code.
+void *popReturn();
 
 // Initialize the injection sub-system.
 void init();
-// Inject the code now.
+// Inject the code added since the last call now; may be called again after startup, from any thread.
+// Sites that were injected before are left as they are. If generating or linking the new sites fails, they are
+// removed and their memory is freed again, so that a later batch can still succeed. If they can't be switched on,
+// as while a thread that blocks all signals is running, this fails right away and they stay off until `setEnabled`
+// switches them on.
 bool performInjections();
 
 } // namespace coretorio::injection
@@ -0,0 +1,65 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+#include "latency.hpp"
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#pragma once
+
+
+
+namespace coretorio::latency {
+
+// Number of functions that can be probed.
+static constexpr size_t MAX_PROBES = 64;
+
+// Probe state of one thread.
+// It is only written by its thread, and read by anyone merging histograms.
+struct ThreadLatency {
+    // Number of nested sampled calls whose entry time is kept.
+    static constexpr size_t STACK_SIZE = 1024;
+
+    // A sampled call that is running.
+    struct Entry {
+        // Time the call was entered.
+        uint64_t time;
+        // Value of `injection::returnDepth` when the call was entered; its exit sees it one higher.
+        size_t   returnDepth;
+    };
+
+    // Next state in the list of all of them.
+    ThreadLatency     *next;
+    // Thread ID of the thread that owns this state.
+    std::atomic<pid_t> owner;
+    // State of the xorshift generator that spaces the samples.
+    uint64_t           random;
+    // Number of calls of each probed function until the next sampled one, by probe index.
+    uint32_t           countdown[MAX_PROBES];
+    // Number of sampled calls that are running on this thread.
+    size_t             depth;
+    // The sampled calls that are running, outermost first.
+    Entry              stack[STACK_SIZE];
+    // Histograms, by probe index.
+    Histogram          histograms[MAX_PROBES];
+};
+
+// All per-thread states, newest first; never freed.
+extern std::atomic<ThreadLatency *> threadStates;
+
+// Get the argument of `probeEnter` for a probe.
+static inline void *probeArgument(size_t index, uint32_t sampleInterval) {
+    return (void *)(index | (uint64_t)sampleInterval << 32);
+}
+
+// Decide whether to sample a call to a probed function, and if so record its entry time; called from generated code
+// with the probe index and sample interval from `probeArgument`. Returns whether the call is sampled.
+bool probeEnter(void *probe);
+// Record the duration of a sampled call to a probed function; called from generated code with the offset of the
+// function's histogram in a `ThreadLatency`.
+void probeExit(void *histogram);
+
+} // namespace coretorio::latency
@@ -0,0 +1,30 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+#include <stddef.h>
+#include <vector>
+
+#pragma once
+
+
+
+namespace coretorio::injection {
+
+// A mapping in the address space of this process.
+struct Mapping {
+    // Start address, page aligned.
+    size_t start;
+    // End address, page aligned.
+    size_t end;
+    // Protection, a combination of the `PROT_*` flags.
+    int    prot;
+};
+
+// Read the mappings of this process from /proc/self/maps, sorted by address.
+// Returns an empty list if that fails.
+std::vector<Mapping> readMemoryMap();
+
+// Get the page size.
+size_t pageSize();
+
+} // namespace coretorio::injection
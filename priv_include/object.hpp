@@ -2,7 +2,9 @@
 // SPDX-License-Identifier: MIT
 
 #include <elf.h>
-#include <string>
+#include <stddef.h>
+#include <stdint.h>
+#include <string_view>
 
 #pragma once
 
@@ -12,24 +14,41 @@ namespace coretorio::object {
 
 // ELF section header.
 struct Section : public Elf64_Shdr {
-    // Section name.
-    std::string sh_name_str;
+    // Section name, points into the mapped executable.
+    std::string_view sh_name_str;
     // Pointer to loaded address of section.
-    void       *sh_addr_ptr;
+    void            *sh_addr_ptr;
+    // Pointer to the section's contents in the mapped executable, NULL for SHT_NOBITS.
+    void const      *sh_data_ptr;
 };
 
 // ELF symbol.
 struct Symbol : public Elf64_Sym {
-    // Symbol name.
-    std::string st_name_str;
+    // Symbol name, points into the mapped executable.
+    std::string_view st_name_str;
     // Pointer to loaded address of symbol.
-    void       *st_value_ptr;
+    void            *st_value_ptr;
 };
 
+// Find a section by name.
+Section      *findSection(std::string_view name);
 // Find a symbol by name.
-Symbol *findSymbol(std::string const &name);
+Symbol const *findSymbol(std::string_view name);
+// Find the function containing an address, NULL if none does.
+// Safe to call from any thread once `interpret_elf` has returned.
+Symbol const *findSymbolByAddress(void const *addr);
+// Find the start of the first function with a symbol after an address, NULL if there is none.
+// Safe to call from any thread once `interpret_elf` has returned.
+void         *findNextFunction(void const *addr);
+// Find many symbols by name in one pass, setting missing ones to NULL.
+// Returns the number of symbols found.
+size_t        findSymbols(std::string_view const *names, Symbol const **out, size_t count);
+// Find many symbols by name and precomputed `hashName` in one pass, setting missing ones to NULL.
+// Returns the number of symbols found.
+size_t        findSymbols(std::string_view const *names, uint64_t const *hashes, Symbol const **out, size_t count);
 
 // Interpret the ELF file and determine the locations of sections and symbols.
+// The executable stays mapped read-only; section and symbol names are views into it.
 bool interpret_elf();
 
 } // namespace coretorio::object
@@ -0,0 +1,23 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+#include <functional>
+#include <stddef.h>
+
+#pragma once
+
+
+
+namespace coretorio::parallel {
+
+// Number of threads to use for parallel work.
+// Set by the CORETORIO_THREADS environment variable, defaults to the number of CPUs but at most 8.
+size_t threadCount();
+
+// Run `func(i)` for every `i` in [0, count) on a pool of worker threads and wait for all of them to finish.
+// The calling thread takes part; items are handed out dynamically, so `func` must not depend on which thread
+// or in which order items run. The workers only exist for the duration of the call, which makes this safe to
+// use from the LD_PRELOAD constructor as long as `func` does not call into the dynamic loader (dlopen, dlsym).
+void forEach(size_t count, std::function<void(size_t)> const &func);
+
+} // namespace coretorio::parallel
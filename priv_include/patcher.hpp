@@ -0,0 +1,34 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+#include "injection_priv.hpp"
+
+#include <stddef.h>
+#include <vector>
+
+#pragma once
+
+
+
+namespace coretorio::injection {
+
+// Statistics of one `installPatches` call.
+struct PatchStats {
+    // Number of patches written.
+    size_t patches  = 0;
+    // Number of pages touched.
+    size_t pages    = 0;
+    // Number of `mprotect` calls made.
+    size_t syscalls = 0;
+    // Wall time in milliseconds.
+    double time     = 0;
+};
+
+// Write patches into existing code.
+// The patches are sorted and merged by page, and each touched page range is made writable exactly once and then
+// set back to the protection it had before. Pages stay executable while writable where the system allows it;
+// where it does not, no other thread may run code in them meanwhile.
+// Returns false if the protection of a page could not be changed.
+bool installPatches(std::vector<Section> const &patches, PatchStats &stats);
+
+} // namespace coretorio::injection
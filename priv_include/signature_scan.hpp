@@ -0,0 +1,67 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string_view>
+#include <vector>
+
+#pragma once
+
+
+
+namespace coretorio::signature {
+
+// Maximum number of bytes that candidate matches are found by.
+// The scanner looks up exactly this many bytes per position.
+static constexpr uint32_t MAX_ANCHOR = 3;
+
+// A pattern of bytes, some of which may be anything.
+struct Pattern {
+    // Bytes to match, 0 where any byte matches.
+    std::vector<uint8_t> bytes;
+    // 0xff for bytes that must match, 0 for bytes that may be anything.
+    std::vector<uint8_t> mask;
+    // Offset of the bytes that candidate matches are found by, chosen to be rare in x86 code.
+    uint32_t             anchor;
+    // Number of adjacent bytes at `anchor` that must match and candidate matches are found by, up to `MAX_ANCHOR`.
+    uint32_t             anchorLength;
+
+    // Parse a pattern from hexadecimal bytes separated by spaces, where `?` or `??` matches any byte.
+    // Returns false if the text is not a valid pattern or has no byte that must match.
+    static bool parse(std::string_view text, Pattern &out);
+    // Whether the pattern matches at a position, which must have at least `bytes.size()` bytes after it.
+    bool        matches(uint8_t const *data) const {
+        for (size_t i = 0; i < bytes.size(); i++) {
+            if ((data[i] & mask[i]) != bytes[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// Instruction set used to find candidate matches.
+enum class ScanLevel { SCALAR, SSE42, AVX2 };
+
+// Get the best instruction set the CPU supports.
+// Set by the CORETORIO_SCAN environment variable to `scalar`, `sse4.2` or `avx2`, defaults to the best one supported.
+ScanLevel   bestScanLevel();
+// Get the name of an instruction set, as accepted by CORETORIO_SCAN.
+char const *scanLevelName(ScanLevel level);
+// Find all matches of all patterns in one pass over some data.
+// The patterns are spread over 16 buckets, those with similar anchors together. Every position is looked up in
+// tables of which buckets have a pattern whose anchor starts with its byte and continues with the next ones, 16 or 32
+// positions at a time with byte shuffles of the low and high nibbles; positions that pass are looked up again by
+// whole bytes, and the patterns of the buckets that still pass are compared in full. The cost per byte is about the
+// same for any number of patterns, but more patterns have more false candidates.
+// `matches[i]` is set to the offsets of the matches of `patterns[i]`, in increasing order.
+void scan(
+    uint8_t const                    *data,
+    size_t                            size,
+    std::vector<Pattern> const       &patterns,
+    std::vector<std::vector<size_t>> &matches,
+    ScanLevel                         level = bestScanLevel()
+);
+
+} // namespace coretorio::signature
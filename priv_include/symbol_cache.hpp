@@ -0,0 +1,59 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+#include "address_index.hpp"
+#include "symbol_index.hpp"
+
+#include <elf.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string_view>
+#include <sys/stat.h>
+
+#pragma once
+
+
+
+namespace coretorio::object {
+
+// Key identifying one build of the game executable.
+struct CacheKey {
+    // GNU build ID, or the executable's device, inode, size and modification time if it has none.
+    uint8_t  data[64];
+    // Number of valid bytes in `data`.
+    uint32_t length;
+};
+
+// Section table as stored in the symbol cache.
+struct CachedSections {
+    // Raw section headers.
+    Elf64_Shdr const *shdrs;
+    // Number of section headers.
+    size_t            shnum;
+    // Section header string table.
+    char const       *names;
+    // Size of the section header string table.
+    size_t            namesSize;
+};
+
+// Determine the cache key of the mapped game executable.
+void getCacheKey(CacheKey &key, uint8_t const *image, size_t imageSize, struct stat const &imageStat);
+
+// Try to load the section table and symbol indices from the symbol cache.
+// On success, the indices view the cache mapping, which stays mapped for the lifetime of the process.
+bool loadSymbolCache(
+    CacheKey const &key, size_t loadBias, CachedSections &sections, SymbolIndex &symbols, AddressIndex &functions
+);
+
+// Write the section table and symbol indices to the symbol cache, replacing any previous cache.
+// Symbol names must point into `strtab`.
+bool saveSymbolCache(
+    CacheKey const       &key,
+    size_t                loadBias,
+    CachedSections const &sections,
+    std::string_view      strtab,
+    SymbolIndex const    &symbols,
+    AddressIndex const   &functions
+);
+
+} // namespace coretorio::object
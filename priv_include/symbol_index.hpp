@@ -0,0 +1,94 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+#include "object.hpp"
+#include "symbol_id.hpp"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string_view>
+#include <vector>
+
+#pragma once
+
+
+
+namespace coretorio::object {
+
+// Hash a symbol name; the same hash as `injection::SymbolId`, so ids hashed at compile time can be looked up directly.
+constexpr uint64_t hashName(std::string_view name) {
+    return injection::hashSymbolName(name);
+}
+
+// Immutable open-addressing hash table of symbols by name.
+// Symbols are stored contiguously; the table only holds their indices.
+// The table is split into equally sized shards by hash so that it can be built in parallel and still come out
+// the same every time: each shard is filled by one thread, in symbol order.
+// The index either owns its arrays or views arrays owned by someone else, like the symbol cache.
+struct SymbolIndex {
+    // Hash table slot.
+    struct Slot {
+        // Upper 32 bits of the name hash, to skip most string compares.
+        uint32_t tag;
+        // Index into `symbols`, or `EMPTY`.
+        uint32_t index;
+    };
+    // Index value of an unused slot.
+    static constexpr uint32_t EMPTY      = UINT32_MAX;
+    // Position of the hash bits that select the shard.
+    static constexpr int      SHARD_BITS = 24;
+
+    // Symbol storage, if owned by the index.
+    std::vector<Symbol> symbolStorage;
+    // Slot storage, if owned by the index.
+    std::vector<Slot>   slotStorage;
+    // Contiguous array of all symbols.
+    Symbol const       *symbols    = NULL;
+    // Number of symbols.
+    size_t              count      = 0;
+    // Linear probing hash table shards, each `mask + 1` slots.
+    Slot const         *slots      = NULL;
+    // Mask applied to hashes to get a slot index within a shard; shard size is a power of two.
+    size_t              mask       = 0;
+    // Mask applied to hashes shifted by `SHARD_BITS` to get a shard index; shard count is a power of two.
+    size_t              shardMask  = 0;
+    // Log2 of the shard size.
+    int                 shardShift = 0;
+
+    // Build the index, taking ownership of the symbols.
+    // Where multiple symbols share a name, the first one is found.
+    void build(std::vector<Symbol> &&symbols);
+    // Build the index from symbols with precomputed name hashes, taking ownership of the symbols.
+    void build(std::vector<Symbol> &&symbols, std::vector<uint64_t> const &hashes);
+
+    // Find a symbol by name and precomputed hash.
+    Symbol const *find(std::string_view name, uint64_t hash) const {
+        uint32_t    tag   = hash >> 32;
+        Slot const *shard = slots + (((hash >> SHARD_BITS) & shardMask) << shardShift);
+        for (size_t i = hash & mask;; i = (i + 1) & mask) {
+            Slot slot = shard[i];
+            if (slot.index == EMPTY) {
+                return NULL;
+            } else if (slot.tag == tag && symbols[slot.index].st_name_str == name) {
+                return &symbols[slot.index];
+            }
+        }
+    }
+    // Find a symbol by name.
+    Symbol const *find(std::string_view name) const {
+        return find(name, hashName(name));
+    }
+    // Find many symbols in one pass, setting missing ones to NULL.
+    // Returns the number of symbols found.
+    size_t findMany(std::string_view const *names, Symbol const **out, size_t count) const;
+    // Find many symbols with precomputed name hashes in one pass, setting missing ones to NULL.
+    // Returns the number of symbols found.
+    size_t findMany(std::string_view const *names, uint64_t const *hashes, Symbol const **out, size_t count) const;
+
+    // Approximate memory used by the index and its symbols.
+    size_t memoryUsage() const {
+        return count * sizeof(Symbol) + (shardMask + 1) * (mask + 1) * sizeof(Slot);
+    }
+};
+
+} // namespace coretorio::object
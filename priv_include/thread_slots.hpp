@@ -0,0 +1,46 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+#include <atomic>
+#include <stddef.h>
+#include <sys/types.h>
+
+#pragma once
+
+
+
+namespace coretorio::threads {
+
+// Get the thread ID of the calling thread.
+pid_t currentThread();
+// Take over a slot for a thread if the slot's owner has exited; returns whether the thread got it.
+bool  takeOver(std::atomic<pid_t> &owner, pid_t self);
+// Map zeroed memory for a new slot; returns NULL if there is no memory for it.
+void *mapSlot(size_t size);
+
+// Get a slot of per-thread state for the calling thread: one whose owner has exited, or a new one in zeroed memory
+// added to `slots`. Returns NULL if there is no memory for it.
+//
+// A `Slot` has a `Slot *next`, the next slot in the list of all of them, and a `std::atomic<pid_t> owner`, the
+// thread ID of the thread that owns it. The list is never freed, so that the slots can be read from any thread. Slots
+// of exited threads are found here, rather than by a thread-exit hook, because registering one, such as with
+// `pthread_setspecific`, may allocate memory and so change vector registers.
+template <typename Slot> Slot *claimSlot(std::atomic<Slot *> &slots) {
+    pid_t self = currentThread();
+    for (Slot *slot = slots.load(std::memory_order_acquire); slot; slot = slot->next) {
+        if (takeOver(slot->owner, self)) {
+            return slot;
+        }
+    }
+    Slot *slot = (Slot *)mapSlot(sizeof(Slot));
+    if (!slot) {
+        return NULL;
+    }
+    slot->owner = self;
+    slot->next  = slots.load(std::memory_order_relaxed);
+    while (!slots.compare_exchange_weak(slot->next, slot, std::memory_order_release)) {
+    }
+    return slot;
+}
+
+} // namespace coretorio::threads
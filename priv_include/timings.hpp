@@ -0,0 +1,19 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+#include <chrono>
+
+#pragma once
+
+
+
+namespace coretorio::timings {
+
+// Milliseconds elapsed since a point in time.
+double elapsedMs(std::chrono::steady_clock::time_point start);
+// Record how long a phase of CoreTorio's startup or injection took.
+// Set by the CORETORIO_TIMINGS environment variable, every phase is appended to that file as a line of JSON:
+// `{"pid": <process ID>, "phase": "<phase>", "ms": <milliseconds>}`. Does nothing if it is not set.
+void   recordPhase(char const *phase, double ms);
+
+} // namespace coretorio::timings
@@ -0,0 +1,62 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+#include "injection_priv.hpp"
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#pragma once
+
+
+
+namespace coretorio::injection {
+
+// Entry patch of an injection site that can be switched between the original code and the jump at runtime.
+//
+// The patch is rewritten while other threads may run it, following the rules for cross-modifying code: the first
+// byte is replaced by an `int3` and all cores are serialized, then the rest of the bytes and finally the first byte
+// are written, each followed by another serialization. Threads that hit the `int3` meanwhile are sent to where the
+// new state leads, and threads that were stopped inside the original instructions are moved to the same
+// instruction in the relocated prologue before those are overwritten.
+//
+// Threads are moved by interrupting them with a signal. A thread that blocks it can't be moved, so it is only left
+// alone while it is stopped in the kernel outside of the patches, and changes fail right away while it runs.
+struct Toggle {
+    // Maximum number of bytes that the patch covers.
+    static constexpr size_t MAX_LENGTH = 32;
+
+    // Address of the patch.
+    size_t                addr;
+    // Number of bytes that the patch covers.
+    size_t                length;
+    // Protection of the pages containing the patch.
+    int                   prot;
+    // Original code.
+    uint8_t               disabledCode[MAX_LENGTH];
+    // Entry jump, padded with `int3`.
+    uint8_t               enabledCode[MAX_LENGTH];
+    // Destination of the entry jump.
+    size_t                target;
+    // Address of the relocated prologue, which runs the original code.
+    size_t                original;
+    // Boundaries of the instructions in the relocated prologue.
+    std::vector<Boundary> boundaries;
+    // State that the patch is in or being changed to; read by the signal handlers.
+    std::atomic<bool>     enabled;
+};
+
+// Make toggles known to the signal handlers, which are installed on the first call.
+// The toggles must stay valid forever, and must be in the state that their code is in.
+bool registerToggles(std::vector<Toggle *> const &toggles);
+// Switch an entry patch on or off while other threads may run it; changes are made one at a time.
+// Returns false if the patch could not be rewritten, in which case it is left in its previous state.
+bool setToggle(Toggle &toggle, bool enabled);
+// Switch entry patches on or off together while other threads may run them, which stops the other threads
+// only as often as switching one patch does. Returns false if the patches could not be rewritten, in which case
+// they are all left in their previous state.
+bool setToggles(std::vector<Toggle *> const &toggles, bool enabled);
+
+} // namespace coretorio::injection
@@ -0,0 +1,55 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+#include "tracing.hpp"
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#pragma once
+
+
+
+namespace coretorio::tracing {
+
+// Number of functions that can be traced.
+static constexpr uint32_t MAX_TRACED = 1024;
+
+// Ring buffer of events of one thread, with a single producer and a single consumer.
+// The thread pushes events at `head`, the flusher drains them from `tail`; both only ever increase.
+struct ThreadTrace {
+    // Number of events in the ring buffer, a power of two.
+    static constexpr size_t RING_SIZE = 1 << 16;
+
+    // Next ring buffer in the list of all of them.
+    ThreadTrace       *next;
+    // Thread ID of the thread that owns this ring buffer.
+    std::atomic<pid_t> owner;
+
+    // Number of events pushed; written by the producer.
+    alignas(64) std::atomic<uint64_t> head;
+    // Last value of `tail` the producer saw, so that it rarely has to read the consumer's cache line.
+    uint64_t              cachedTail;
+    // Number of events the producer dropped because the ring buffer was full.
+    std::atomic<uint64_t> dropped;
+    // Thread ID of the producer.
+    uint32_t              thread;
+
+    // Number of events drained; written by the consumer.
+    alignas(64) std::atomic<uint64_t> tail;
+
+    // The events, at their sequence number modulo `RING_SIZE`.
+    alignas(64) TraceEvent events[RING_SIZE];
+};
+
+// All ring buffers, newest first; never freed.
+extern std::atomic<ThreadTrace *> threadTraces;
+// Whether events are recorded; producers drop nothing while this is false, they just return.
+extern std::atomic<bool>          recording;
+
+// Push an event; called from generated code with the symbol index, with `TRACE_EXIT` set for exits.
+void traceEvent(void *symbol);
+
+} // namespace coretorio::tracing
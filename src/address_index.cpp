@@ -0,0 +1,66 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+#include "address_index.hpp"
+
+#include <algorithm>
+
+
+
+namespace coretorio::object {
+
+// Lay out sorted entries in Eytzinger order by an in-order walk of the implicit tree.
+static size_t eytzinger(
+    AddressIndex &index, uint64_t *keys, std::vector<uint32_t> const &sorted, Symbol const *symbols, size_t i, size_t k
+) {
+    if (k <= index.count) {
+        i                     = eytzinger(index, keys, sorted, symbols, i, 2 * k);
+        Symbol const &sym     = symbols[sorted[i]];
+        keys[k]               = (uint64_t)sym.st_value_ptr;
+        index.sizeStorage[k]  = sym.st_size > UINT32_MAX ? UINT32_MAX : sym.st_size;
+        index.indexStorage[k] = sorted[i];
+        i                     = eytzinger(index, keys, sorted, symbols, i + 1, 2 * k + 1);
+    }
+    return i;
+}
+
+// Build the index from the functions in a symbol table.
+void AddressIndex::build(Symbol const *symbols, size_t symbolCount) {
+    // Collect defined functions with a known size.
+    std::vector<uint32_t> sorted;
+    for (size_t i = 0; i < symbolCount; i++) {
+        Symbol const &sym = symbols[i];
+        if (ELF64_ST_TYPE(sym.st_info) == STT_FUNC && sym.st_shndx != SHN_UNDEF && sym.st_value_ptr && sym.st_size) {
+            sorted.push_back(i);
+        }
+    }
+    std::sort(sorted.begin(), sorted.end(), [&](uint32_t a, uint32_t b) {
+        if (symbols[a].st_value_ptr != symbols[b].st_value_ptr) {
+            return symbols[a].st_value_ptr < symbols[b].st_value_ptr;
+        } else if (symbols[a].st_size != symbols[b].st_size) {
+            return symbols[a].st_size > symbols[b].st_size;
+        }
+        return a < b;
+    });
+    sorted.erase(
+        std::unique(
+            sorted.begin(),
+            sorted.end(),
+            [&](uint32_t a, uint32_t b) { return symbols[a].st_value_ptr == symbols[b].st_value_ptr; }
+        ),
+        sorted.end()
+    );
+
+    // Allocate with room to align the keys; prefetches past the end are harmless.
+    count = sorted.size();
+    keyStorage.assign(count + 1 + 64 / sizeof(uint64_t), 0);
+    sizeStorage.assign(count + 1, 0);
+    indexStorage.assign(count + 1, 0);
+    auto alignedKeys = keyStorage.data() + ((64 - (size_t)keyStorage.data() % 64) % 64) / sizeof(uint64_t);
+    eytzinger(*this, alignedKeys, sorted, symbols, 0, 1);
+    keys    = alignedKeys;
+    sizes   = sizeStorage.data();
+    indices = indexStorage.data();
+}
+
+} // namespace coretorio::object
@@ -0,0 +1,185 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+#include "call_counters.hpp"
+#include "injection_priv.hpp"
+
+#include <fcntl.h>
+#include <map>
+#include <mutex>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+
+
+namespace coretorio::counters {
+
+// Number of functions that can be counted.
+static constexpr uint32_t MAX_COUNTERS = 1024;
+// Number of threads that can count calls at the same time.
+static constexpr uint32_t MAX_THREADS  = 256;
+
+// Mapped shared memory file, NULL until the first counter is added.
+static CounterHeader                   *shared;
+// Names table in `shared`.
+static CounterName                     *names;
+// Counter index of each counted symbol.
+static std::map<std::string, uint32_t> *counterIndex;
+// Guards adding counters and handing out blocks.
+static std::mutex                       countersMutex;
+// Blocks of threads that exited, to hand out again.
+static std::vector<uint32_t>           *freeBlocks;
+// Key whose destructor gives back the block of an exiting thread.
+static pthread_key_t                    blockKey;
+// Path of the shared memory file.
+static char                             sharedPath[64];
+
+// This thread's block of counts, NULL until it first counts a call.
+__attribute__((tls_model("initial-exec"))) static thread_local uint64_t *threadBlock;
+// Whether this thread could not get a block, or gave it back already.
+__attribute__((tls_model("initial-exec"))) static thread_local bool      threadBlockless;
+
+// Get a per-thread block of counts.
+static uint64_t *getBlock(uint32_t index) {
+    return (uint64_t *)((uint8_t *)shared + shared->blocksOffset + index * shared->blockSize);
+}
+
+// Give back the block of an exiting thread; the counts stay in it.
+static void releaseBlock(void *block) {
+    std::lock_guard<std::mutex> lock(countersMutex);
+    threadBlock     = NULL;
+    threadBlockless = true;
+    freeBlocks->push_back(((uint8_t *)block - (uint8_t *)shared - shared->blocksOffset) / shared->blockSize);
+}
+
+// Give this thread a block of counts, returns NULL if none are left.
+static uint64_t *attachThread() {
+    if (threadBlockless) {
+        return NULL;
+    }
+    std::lock_guard<std::mutex> lock(countersMutex);
+    uint32_t                    index;
+    if (freeBlocks->size()) {
+        index = freeBlocks->back();
+        freeBlocks->pop_back();
+    } else if (shared->threads < MAX_THREADS) {
+        index = shared->threads;
+        __atomic_store_n(&shared->threads, index + 1, __ATOMIC_RELEASE);
+    } else {
+        threadBlockless = true;
+        return NULL;
+    }
+    threadBlock = getBlock(index);
+    pthread_setspecific(blockKey, threadBlock);
+    return threadBlock;
+}
+
+// Count a call; this is what the generated code calls, with the counter's entry in the names table.
+static void countCall(void *counter) {
+    uint64_t *block = threadBlock;
+    if (__builtin_expect(!block, 0) && !(block = attachThread())) {
+        __atomic_fetch_add(&shared->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    // Only this thread writes the block, so a plain increment suffices; the store is still a single one so that
+    // readers never see a torn value.
+    size_t index = (CounterName *)counter - names;
+    __atomic_store_n(&block[index], block[index] + 1, __ATOMIC_RELAXED);
+}
+
+// Remove the shared memory file when the game exits, so that it doesn't keep using memory.
+// The mapping stays, so counting calls from threads that still run is harmless, and readers that have it mapped keep
+// their view of the counts.
+static void removeShared() {
+    unlink(sharedPath);
+}
+
+// Create and map the shared memory file.
+static bool createShared() {
+    snprintf(sharedPath, sizeof(sharedPath), "/dev/shm/coretorio-counters.%d", (int)getpid());
+    int fd = open(sharedPath, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        perror("Creating call counter file failed");
+        return false;
+    }
+    size_t blockSize    = MAX_COUNTERS * sizeof(uint64_t);
+    size_t namesOffset  = sizeof(CounterHeader);
+    size_t blocksOffset = namesOffset + MAX_COUNTERS * sizeof(CounterName);
+    size_t size         = blocksOffset + MAX_THREADS * blockSize;
+    void  *mem          = MAP_FAILED;
+    if (ftruncate(fd, size)) {
+        perror("Resizing call counter file failed");
+    } else if ((mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        perror("Mapping call counter file failed");
+    }
+    close(fd);
+    if (mem == MAP_FAILED) {
+        unlink(sharedPath);
+        return false;
+    }
+
+    shared               = (CounterHeader *)mem;
+    names                = (CounterName *)((uint8_t *)mem + namesOffset);
+    shared->maxCounters  = MAX_COUNTERS;
+    shared->maxThreads   = MAX_THREADS;
+    shared->namesOffset  = namesOffset;
+    shared->blocksOffset = blocksOffset;
+    shared->blockSize    = blockSize;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(shared->magic, COUNTERS_MAGIC, sizeof(COUNTERS_MAGIC));
+
+    counterIndex = new std::map<std::string, uint32_t>();
+    freeBlocks   = new std::vector<uint32_t>();
+    pthread_key_create(&blockKey, releaseBlock);
+    atexit(removeShared);
+    printf("Publishing call counters in %s\n", sharedPath);
+    return true;
+}
+
+// Count the calls to one of Factorio's functions.
+bool countCalls(std::string const &symbolName) {
+    auto symbol = object::findSymbol(symbolName);
+    if (!symbol) {
+        printf("Error: Can't count calls to non-existent symbol `%s`\n", symbolName.c_str());
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(countersMutex);
+    if (!shared && !createShared()) {
+        return false;
+    } else if (counterIndex->count(symbolName)) {
+        return true;
+    } else if (shared->counters >= MAX_COUNTERS) {
+        printf("Error: No call counter left for `%s`\n", symbolName.c_str());
+        return false;
+    }
+
+    uint32_t     index = shared->counters;
+    CounterName &entry = names[index];
+    entry.address      = (uint64_t)symbol->st_value_ptr;
+    strncpy(entry.name, symbolName.c_str(), sizeof(entry.name) - 1);
+    __atomic_store_n(&shared->counters, index + 1, __ATOMIC_RELEASE);
+    (*counterIndex)[symbolName] = index;
+
+    // Counting may have to give the thread a block, which can use any register.
+    injection::injectBefore(symbolName, injection::Injection((void *)&countCall, &entry));
+    return true;
+}
+
+// Get the number of calls to a function counted so far, summed over all threads.
+uint64_t getCallCount(std::string const &symbolName) {
+    std::lock_guard<std::mutex> lock(countersMutex);
+    if (!shared || !counterIndex->count(symbolName)) {
+        return 0;
+    }
+    uint32_t index = (*counterIndex)[symbolName];
+    uint64_t sum   = 0;
+    for (uint32_t i = 0; i < shared->threads; i++) {
+        sum += __atomic_load_n(&getBlock(i)[index], __ATOMIC_RELAXED);
+    }
+    return sum;
+}
+
+} // namespace coretorio::counters
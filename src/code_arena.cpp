@@ -0,0 +1,162 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+#include "code_arena.hpp"
+#include "memory_map.hpp"
+
+#include <algorithm>
+#include <stdio.h>
+#include <sys/mman.h>
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+
+
+namespace coretorio::injection {
+
+// Distance kept from the edges of the rel32 range, so that instructions anywhere in a chunk can reach any of the
+// target code with displacements measured from the end of the instruction.
+static constexpr size_t RANGE_MARGIN = 1 << 16;
+
+// Round up to a multiple of a power of two.
+static size_t alignUp(size_t value, size_t align) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+// Keep all memory within rel32 range of the code in [start, end).
+void CodeArena::setTarget(size_t start, size_t end) {
+    size_t range = ((size_t)1 << 31) - RANGE_MARGIN;
+    nearLow      = end > range ? end - range : 0;
+    nearHigh     = start + range < start ? SIZE_MAX : start + range;
+}
+
+// Reserve a chunk of at least `size` bytes, returns NULL on failure.
+// Tries the free gaps in the address space closest to the target code first.
+CodeArena::Chunk *CodeArena::reserve(size_t size) {
+    size = alignUp(size < CHUNK_SIZE ? CHUNK_SIZE : size, pageSize());
+
+    // Find the free gaps between the current mappings that fit a chunk near the target code.
+    struct Candidate {
+        size_t addr;
+        size_t distance;
+    };
+    std::vector<Candidate> candidates;
+    size_t                 target = nearLow / 2 + nearHigh / 2;
+    if (nearLow || nearHigh != SIZE_MAX) {
+        auto   mappings = readMemoryMap();
+        size_t gapStart = pageSize();
+        for (size_t i = 0; i <= mappings.size(); i++) {
+            size_t gapEnd = i < mappings.size() ? mappings[i].start : nearHigh;
+            // Clamp the gap to the allowed range and place the chunk in it as close to the target as possible.
+            size_t low    = alignUp(gapStart > nearLow ? gapStart : nearLow, pageSize());
+            size_t high   = gapEnd < nearHigh ? gapEnd : nearHigh;
+            if (high > low && high - low >= size) {
+                size_t addr = target & ~(pageSize() - 1);
+                addr        = addr < low ? low : addr;
+                addr        = addr > high - size ? (high - size) & ~(pageSize() - 1) : addr;
+                if (addr >= low) {
+                    candidates.push_back({addr, addr > target ? addr - target : target - addr});
+                }
+            }
+            if (i < mappings.size() && mappings[i].end > gapStart) {
+                gapStart = mappings[i].end;
+            }
+        }
+    }
+    std::sort(candidates.begin(), candidates.end(), [](Candidate const &a, Candidate const &b) {
+        return a.distance < b.distance;
+    });
+
+    // Another thread may map something in the meantime, so try the candidates in order.
+    void *mem = MAP_FAILED;
+    for (auto const &candidate : candidates) {
+        mem = mmap(
+            (void *)candidate.addr,
+            size,
+            PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE,
+            -1,
+            0
+        );
+        if (mem != MAP_FAILED && mem != (void *)candidate.addr) {
+            // Older kernels treat `MAP_FIXED_NOREPLACE` as a hint.
+            munmap(mem, size);
+            mem = MAP_FAILED;
+        }
+        if (mem != MAP_FAILED) {
+            break;
+        }
+    }
+    if (mem == MAP_FAILED) {
+        printf("Warning: No executable memory within range of the code, generated code may not link\n");
+        mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            perror("mmap() failed");
+            return NULL;
+        }
+    }
+
+    chunks.push_back(Chunk{(size_t)mem, size, 0, 0});
+    return &chunks.back();
+}
+
+// Allocate writable memory for code, returns 0 on failure.
+size_t CodeArena::alloc(size_t size) {
+    size = alignUp(size, ALIGN);
+    for (auto &chunk : chunks) {
+        if (chunk.size - chunk.used >= size) {
+            size_t addr  = chunk.addr + chunk.used;
+            chunk.used  += size;
+            return addr;
+        }
+    }
+    Chunk *chunk = reserve(size);
+    if (!chunk) {
+        return 0;
+    }
+    chunk->used = size;
+    return chunk->addr;
+}
+
+// Make all memory allocated since the last call executable.
+bool CodeArena::seal() {
+    for (auto &chunk : chunks) {
+        if (chunk.used == chunk.sealed) {
+            continue;
+        }
+        // The partially used last page is sealed too; the rest of it is not handed out anymore.
+        size_t end = alignUp(chunk.used, pageSize());
+        if (mprotect((void *)(chunk.addr + chunk.sealed), end - chunk.sealed, PROT_READ | PROT_EXEC)) {
+            perror("mprotect() failed");
+            return false;
+        }
+        chunk.used   = end;
+        chunk.sealed = end;
+    }
+    return true;
+}
+
+// Get the number of bytes used in each chunk, to roll back to later.
+std::vector<size_t> CodeArena::checkpoint() const {
+    std::vector<size_t> used;
+    for (auto const &chunk : chunks) {
+        used.push_back(chunk.used);
+    }
+    return used;
+}
+
+// Free all memory allocated since `checkpoint` was called that has not been sealed since.
+void CodeArena::rollback(std::vector<size_t> const &used) {
+    while (chunks.size() > used.size() && !chunks.back().sealed) {
+        munmap((void *)chunks.back().addr, chunks.back().size);
+        chunks.pop_back();
+    }
+    for (size_t i = 0; i < chunks.size(); i++) {
+        size_t keep    = i < used.size() ? used[i] : 0;
+        chunks[i].used = keep > chunks[i].sealed ? keep : chunks[i].sealed;
+    }
+}
+
+} // namespace coretorio::injection
@@ -0,0 +1,328 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+#include "coremod.hpp"
+#include "coremods.hpp"
+#include "parallel.hpp"
+#include "timings.hpp"
+
+#include <algorithm>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <map>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+
+
+namespace coretorio::coremods {
+
+// A coremod found in the coremod directory.
+struct Coremod {
+    // Path of the shared object.
+    std::string              path;
+    // Name from its declaration.
+    std::string              name;
+    // Names of the coremods it requires.
+    std::vector<std::string> dependencies;
+    // Names of the coremods it must come after if they are present.
+    std::vector<std::string> after;
+    // Why it is not loaded, or empty.
+    std::string              error;
+    // Time taken to read its declaration, which also reads the whole file into the page cache.
+    double                   scanMs = 0;
+    // Time taken by `dlopen`, including its static constructors.
+    double                   loadMs = 0;
+    // Time taken by its init function.
+    double                   initMs = 0;
+    // Whether it was loaded and initialized.
+    bool                     loaded = false;
+};
+
+// Split text into words separated by whitespace.
+static std::vector<std::string> splitWords(std::string_view text) {
+    std::vector<std::string> words;
+    size_t                   pos = 0;
+    while (true) {
+        pos = text.find_first_not_of(" \t", pos);
+        if (pos == std::string_view::npos) {
+            return words;
+        }
+        size_t end = std::min(text.find_first_of(" \t", pos), text.size());
+        words.emplace_back(text.substr(pos, end - pos));
+        pos = end;
+    }
+}
+
+// Parse the declaration made by `CORETORIO_COREMOD`.
+static bool parseDeclaration(std::string_view text, Coremod &mod) {
+    while (!text.empty()) {
+        size_t           end  = std::min(text.find('\n'), text.size());
+        std::string_view line = text.substr(0, end);
+        text.remove_prefix(std::min(end + 1, text.size()));
+        size_t           split = std::min(line.find(' '), line.size());
+        std::string_view key   = line.substr(0, split);
+        auto             words = splitWords(line.substr(split));
+        if (key == "name" && words.size() != 1) {
+            return false;
+        } else if (key == "name") {
+            mod.name = words[0];
+        } else if (key == "requires") {
+            mod.dependencies = std::move(words);
+        } else if (key == "after") {
+            mod.after = std::move(words);
+        }
+        // Other keys are left for later versions.
+    }
+    return !mod.name.empty();
+}
+
+// Read the declaration of a coremod from its file, without loading it.
+// The file is mapped with every page read in, so that loading it later doesn't wait for the disk.
+static void readDeclaration(Coremod &mod) {
+    int fd = open(mod.path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        mod.error = std::string("can't be opened: ") + strerror(errno);
+        return;
+    }
+    struct stat info;
+    if (fstat(fd, &info) || (size_t)info.st_size < sizeof(Elf64_Ehdr)) {
+        close(fd);
+        mod.error = "is not an ELF file";
+        return;
+    }
+    size_t size = info.st_size;
+    auto   file = (uint8_t const *)mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED) {
+        mod.error = std::string("can't be mapped: ") + strerror(errno);
+        return;
+    }
+
+    auto ehdr = (Elf64_Ehdr const *)file;
+    if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) || ehdr->e_ident[EI_CLASS] != ELFCLASS64
+        || ehdr->e_shentsize != sizeof(Elf64_Shdr) || ehdr->e_shstrndx >= ehdr->e_shnum
+        || ehdr->e_shoff > size || ehdr->e_shnum > (size - ehdr->e_shoff) / sizeof(Elf64_Shdr)) {
+        munmap((void *)file, size);
+        mod.error = "is not a 64-bit ELF file";
+        return;
+    }
+    auto             shdrs = (Elf64_Shdr const *)(file + ehdr->e_shoff);
+    Elf64_Shdr const names = shdrs[ehdr->e_shstrndx];
+    bool             found = false;
+    for (size_t i = 0; i < ehdr->e_shnum && names.sh_offset <= size && names.sh_size <= size - names.sh_offset; i++) {
+        Elf64_Shdr const &shdr = shdrs[i];
+        if (shdr.sh_name >= names.sh_size || shdr.sh_type != SHT_PROGBITS || shdr.sh_offset > size
+            || shdr.sh_size > size - shdr.sh_offset) {
+            continue;
+        }
+        auto             nameStart = (char const *)file + names.sh_offset + shdr.sh_name;
+        std::string_view name(nameStart, strnlen(nameStart, names.sh_size - shdr.sh_name));
+        if (name == CORETORIO_COREMOD_SECTION) {
+            // The declaration is a C string; anything after its terminator is padding.
+            std::string_view text((char const *)file + shdr.sh_offset, shdr.sh_size);
+            found = parseDeclaration(text.substr(0, std::min(text.find('\0'), text.size())), mod);
+            break;
+        }
+    }
+    munmap((void *)file, size);
+    if (!found) {
+        mod.error = "has no valid `CORETORIO_COREMOD` declaration";
+    }
+}
+
+// Find the shared objects in a directory, sorted by file name.
+static bool findFiles(std::string const &dir, std::vector<Coremod> &mods) {
+    DIR *handle = opendir(dir.c_str());
+    if (!handle) {
+        return false;
+    }
+    std::vector<std::string> files;
+    while (struct dirent *entry = readdir(handle)) {
+        std::string_view name = entry->d_name;
+        if (name.size() > 3 && name.substr(name.size() - 3) == ".so" && entry->d_type != DT_DIR) {
+            files.emplace_back(name);
+        }
+    }
+    closedir(handle);
+    std::sort(files.begin(), files.end());
+    for (auto &file : files) {
+        mods.emplace_back().path = dir + "/" + file;
+    }
+    return true;
+}
+
+// Decide the order to load coremods in: each after the ones it requires and the ones it must come after.
+// Where the order is free, coremods are loaded in order of file name. Coremods that can't be loaded are given an
+// error and left out.
+static std::vector<size_t> loadOrder(std::vector<Coremod> &mods) {
+    std::map<std::string_view, size_t> byName;
+    for (size_t i = 0; i < mods.size(); i++) {
+        if (mods[i].error.empty() && !byName.emplace(mods[i].name, i).second) {
+            mods[i].error = "has the same name as " + mods[byName[mods[i].name]].path;
+        }
+    }
+
+    // Coremods whose requirements are missing or can't be loaded can't be loaded either, and so on.
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (auto &mod : mods) {
+            for (size_t j = 0; j < mod.dependencies.size() && mod.error.empty(); j++) {
+                auto dependency = byName.find(mod.dependencies[j]);
+                if (dependency == byName.end() || !mods[dependency->second].error.empty()) {
+                    mod.error = "requires `" + mod.dependencies[j] + "`, which "
+                                + (dependency == byName.end() ? "is missing" : "can't be loaded");
+                    changed   = true;
+                }
+            }
+        }
+    }
+
+    // Sort topologically, taking the first coremod by file name whose predecessors are all loaded.
+    std::vector<std::vector<size_t>> successors(mods.size());
+    std::vector<size_t>              predecessors(mods.size());
+    for (size_t i = 0; i < mods.size(); i++) {
+        if (!mods[i].error.empty()) {
+            continue;
+        }
+        for (auto const *names : {&mods[i].dependencies, &mods[i].after}) {
+            for (auto &name : *names) {
+                auto other = byName.find(name);
+                if (other != byName.end() && mods[other->second].error.empty()) {
+                    successors[other->second].push_back(i);
+                    predecessors[i]++;
+                }
+            }
+        }
+    }
+    std::vector<size_t> order;
+    std::vector<bool>   placed(mods.size());
+    for (bool progress = true; progress;) {
+        progress = false;
+        for (size_t i = 0; i < mods.size(); i++) {
+            if (!placed[i] && !predecessors[i] && mods[i].error.empty()) {
+                placed[i] = progress = true;
+                order.push_back(i);
+                for (size_t next : successors[i]) {
+                    predecessors[next]--;
+                }
+                break;
+            }
+        }
+    }
+    for (size_t i = 0; i < mods.size(); i++) {
+        if (!placed[i] && mods[i].error.empty()) {
+            mods[i].error = "is part of or depends on a cycle of coremods that must come after each other";
+        }
+    }
+    return order;
+}
+
+// Load and initialize a coremod, if the ones it requires were.
+static void load(Coremod &mod, std::map<std::string_view, Coremod *> const &byName) {
+    for (auto &name : mod.dependencies) {
+        if (!byName.at(name)->loaded) {
+            mod.error = "requires `" + name + "`, which failed to load";
+            return;
+        }
+    }
+
+    auto  start  = std::chrono::steady_clock::now();
+    void *handle = dlopen(mod.path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    mod.loadMs   = timings::elapsedMs(start);
+    if (!handle) {
+        mod.error = std::string("can't be loaded: ") + dlerror();
+        return;
+    }
+    auto init = (void (*)())dlsym(handle, CORETORIO_COREMOD_INIT_SYMBOL);
+    if (!init) {
+        mod.error = "has no `CORETORIO_COREMOD_INIT` function";
+        dlclose(handle);
+        return;
+    }
+    start = std::chrono::steady_clock::now();
+    init();
+    mod.initMs = timings::elapsedMs(start);
+    mod.loaded = true;
+}
+
+// Get the directory coremods are loaded from.
+std::string directory() {
+    char const *dir = getenv("CORETORIO_COREMODS");
+    return dir && *dir ? dir : "coremods";
+}
+
+// Load every coremod in a directory and add their injections, without performing them.
+bool loadAll(std::string const &dir) {
+    auto                 start = std::chrono::steady_clock::now();
+    std::vector<Coremod> mods;
+    if (!findFiles(dir, mods)) {
+        printf("No coremod directory at %s\n", dir.c_str());
+        return true;
+    }
+
+    // Reading the files only needs system calls, so unlike `dlopen` it can be done on the workers.
+    parallel::forEach(mods.size(), [&](size_t i) {
+        auto modStart = std::chrono::steady_clock::now();
+        readDeclaration(mods[i]);
+        mods[i].scanMs = timings::elapsedMs(modStart);
+    });
+    timings::recordPhase("coremod_scan", timings::elapsedMs(start));
+
+    auto                                   loadStart = std::chrono::steady_clock::now();
+    std::vector<size_t>                    order     = loadOrder(mods);
+    std::map<std::string_view, Coremod *> byName;
+    for (size_t i : order) {
+        byName[mods[i].name] = &mods[i];
+    }
+    for (size_t i : order) {
+        load(mods[i], byName);
+        if (mods[i].loaded) {
+            timings::recordPhase(("coremod:" + mods[i].name).c_str(), mods[i].loadMs + mods[i].initMs);
+        }
+    }
+    timings::recordPhase("coremod_load", timings::elapsedMs(loadStart));
+
+    // Slowest first, so that they stand out.
+    std::vector<Coremod const *> loaded;
+    bool                         success = true;
+    for (auto &mod : mods) {
+        if (mod.loaded) {
+            loaded.push_back(&mod);
+        } else {
+            printf("Error: Coremod %s %s\n", mod.path.c_str(), mod.error.c_str());
+            success = false;
+        }
+    }
+    std::stable_sort(loaded.begin(), loaded.end(), [](Coremod const *a, Coremod const *b) {
+        return a->loadMs + a->initMs > b->loadMs + b->initMs;
+    });
+    printf(
+        "Loaded %zu of %zu coremods from %s in %.2f ms\n",
+        loaded.size(),
+        mods.size(),
+        dir.c_str(),
+        timings::elapsedMs(start)
+    );
+    for (auto mod : loaded) {
+        printf(
+            "  %-32s scan %7.2f ms  load %7.2f ms  init %7.2f ms\n",
+            mod->name.c_str(),
+            mod->scanMs,
+            mod->loadMs,
+            mod->initMs
+        );
+    }
+    return success;
+}
+
+} // namespace coretorio::coremods
@@ -1,10 +1,18 @@
 // Copyright © 2024, Julian Scheffers
 // SPDX-License-Identifier: MIT
 
+#include "code_arena.hpp"
 #include "injection_priv.hpp"
+#include "memory_map.hpp"
+#include "parallel.hpp"
+#include "patcher.hpp"
+#include "timings.hpp"
+#include "toggle.hpp"
 
-#include <map>
+#include <deque>
+#include <mutex>
 #include <string.h>
+#include <string_view>
 #include <sys/mman.h>
 
 
@@ -15,92 +23,450 @@ namespace coretorio::injection {
 static bool allowInjection;
 
 
-// Map of injection sites and the code to inject there.
-static std::map<std::string, InjectionSite> *injectionSites;
+// Number of injection sites allocated at once; they never move once allocated.
+static constexpr size_t SITE_CHUNK = 1024;
 
+// Injection sites and the code to inject there, allocated `SITE_CHUNK` at a time.
+static std::vector<std::unique_ptr<InjectionSite[]>> *siteChunks;
+// Number of sites used in `siteChunks`.
+static size_t                                         siteCount;
+// Open addressing hash table of the sites by the hash of their symbol name, NULL where empty.
+// A hash stands for one symbol, so two names with the same hash are refused rather than told apart.
+static std::vector<InjectionSite *>                  *siteTable;
+// Symbol names passed as strings, copied because sites only reference their names.
+static std::deque<std::string>                       *ownedNames;
+// Guards the sites, which may be changed after startup.
+static std::mutex                                     sitesMutex;
+// Executable memory for generated code, near Factorio's code.
+static CodeArena                                     *arena;
+// Whether a batch of injections was installed, after which the game may be running.
+static bool                                           installedBefore;
 
-// Initialize the injection sub-system.
-void init() {
-    injectionSites = new std::map<std::string, InjectionSite>();
-    allowInjection = true;
+
+// Merge per-site contexts into one, in order.
+// Each site's code starts on a new cache line of the output section.
+static void mergeContexts(InjectionCtx &ctx, std::vector<InjectionCtx> const &parts) {
+    for (auto &part : parts) {
+        size_t align = CodeArena::ALIGN;
+        ctx.generated.code.resize((ctx.generated.code.size() + align - 1) & ~(align - 1), 0xcc);
+        size_t codeBase  = ctx.generated.code.size();
+        size_t patchBase = ctx.patches.size();
+        ctx.generated.code.insert(ctx.generated.code.end(), part.generated.code.begin(), part.generated.code.end());
+        ctx.patches.insert(ctx.patches.end(), part.patches.begin(), part.patches.end());
+
+        // Point relocations at the merged sections.
+        auto remap = [&](SectionRef &ref, size_t &offset) {
+            if (ref == SECTION_GENERATED) {
+                offset += codeBase;
+            } else if (ref != SECTION_ABSOLUTE) {
+                ref += patchBase;
+            }
+        };
+        for (Reloc reloc : part.reloc) {
+            remap(reloc.target, reloc.targetOffset);
+            remap(reloc.reference, reloc.referenceOffset);
+            ctx.reloc.push_back(reloc);
+        }
+        for (Export exp : part.exports) {
+            exp.offset += codeBase;
+            ctx.exports.push_back(exp);
+        }
+        for (EntryPatch entry : part.entries) {
+            entry.patch    += patchBase;
+            entry.original += codeBase;
+            ctx.entries.push_back(std::move(entry));
+        }
+    }
 }
 
-// Inject the code now.
-bool performInjections() {
-    if (!allowInjection) {
+// Create the switch for a linked entry patch, from the code that is still in place.
+// It starts out disabled, like the code it was created from.
+static Toggle *createToggle(InjectionCtx &ctx, EntryPatch const &entry, std::vector<Mapping> const &mappings) {
+    Section const &patch  = ctx.patches[entry.patch];
+    Toggle        *toggle = new Toggle();
+    toggle->addr          = patch.addr;
+    toggle->length        = patch.code.size();
+    toggle->prot          = PROT_READ | PROT_EXEC;
+    for (auto &mapping : mappings) {
+        if (patch.addr >= mapping.start && patch.addr < mapping.end) {
+            toggle->prot = mapping.prot;
+        }
+    }
+    memcpy(toggle->disabledCode, (void const *)patch.addr, patch.code.size());
+    memcpy(toggle->enabledCode, patch.code.data(), patch.code.size());
+    int32_t rel;
+    memcpy(&rel, &patch.code[1], sizeof(rel));
+    toggle->target     = patch.addr + 5 + rel;
+    toggle->original   = ctx.generated.addr + entry.original;
+    toggle->boundaries = entry.boundaries;
+    toggle->enabled    = false;
+    return toggle;
+}
+
+// Resolve, generate and link a batch of sites, and place the code in executable memory.
+// Nothing is visible to the rest of the program yet, so a failed batch can be rolled back.
+static bool buildBatch(InjectionCtx &ctx, std::vector<InjectionSite *> const &sites) {
+    // Resolve all injection sites in one batched lookup by their hashes; the ones without a symbol may still have a
+    // signature.
+    std::vector<std::string_view> names(sites.size());
+    std::vector<uint64_t>         hashes(sites.size());
+    for (size_t i = 0; i < sites.size(); i++) {
+        names[i]  = sites[i]->id.name;
+        hashes[i] = sites[i]->id.hash;
+    }
+    std::vector<Symbol const *> symbols(sites.size());
+    size_t found = object::findSymbols(names.data(), hashes.data(), symbols.data(), names.size());
+    if (found < names.size()) {
+        found += resolveSignatures(names.data(), symbols.data(), names.size());
+    }
+    if (found != names.size()) {
+        for (size_t i = 0; i < names.size(); i++) {
+            if (!symbols[i]) {
+                printf("Error: Injection at non-existent symbol `%.*s`\n", (int)names[i].size(), names[i].data());
+            }
+        }
         return false;
     }
+    for (size_t i = 0; i < sites.size(); i++) {
+        sites[i]->symbol = symbols[i];
+    }
 
-    // Generate code.
-    InjectionCtx ctx;
+    // Generate code for each site into its own context on the worker pool.
     printf("Generating code\n");
+    auto                      codeGenStart = std::chrono::steady_clock::now();
+    std::vector<InjectionCtx> siteCtx(sites.size());
+    std::vector<uint8_t>      siteSuccess(sites.size());
+    parallel::forEach(sites.size(), [&](size_t i) { siteSuccess[i] = doCodeGen(siteCtx[i], *sites[i]); });
+    timings::recordPhase("codegen", timings::elapsedMs(codeGenStart));
     bool codeGenSuccess = true;
-    for (auto &pair : *injectionSites) {
-        if (!doCodeGen(ctx, pair.second)) {
-            printf("Injection code generation failed at %s\n", pair.second.symbol->st_name_str.c_str());
+    for (size_t i = 0; i < sites.size(); i++) {
+        if (!siteSuccess[i]) {
+            printf(
+                "Injection code generation failed at %.*s\n",
+                (int)sites[i]->symbol->st_name_str.size(),
+                sites[i]->symbol->st_name_str.data()
+            );
             codeGenSuccess = false;
         }
     }
     if (!codeGenSuccess) {
         return false;
     }
+    for (size_t i = 0; i < sites.size(); i++) {
+        for (auto &entry : siteCtx[i].entries) {
+            entry.site = sites[i];
+        }
+    }
+
+    // Lay out the sites in a fixed order, so the result does not depend on how the work was scheduled.
+    mergeContexts(ctx, siteCtx);
 
-    // Allocate memory for code.
-    printf("Allocating executable memory\n");
-    void *codeMem = mmap(NULL, ctx.generated.code.size(), PROT_READ | PROT_WRITE, MAP_ANONYMOUS, -1, 0);
-    if (!codeMem) {
-        perror("mmap() failed");
+    // Place the code and link it; it must be executable before anything jumps to it.
+    printf("Linking injections\n");
+    auto linkStart = std::chrono::steady_clock::now();
+    if (!link(ctx, *arena)) {
         return false;
     }
+    memcpy((void *)ctx.generated.addr, ctx.generated.code.data(), ctx.generated.code.size());
+    bool sealed = arena->seal();
+    timings::recordPhase("link", timings::elapsedMs(linkStart));
+    return sealed;
+}
 
-    // Link injections.
-    printf("Linking injections\n");
-    for (auto &reloc : ctx.reloc) {
-        reloc.apply();
+// Install the entry patches of a linked batch.
+// The first batch is written before the game runs. Later batches are written while it may be running, so their
+// patches are switched on the way toggles are, all at once.
+static bool installBatch(InjectionCtx &ctx) {
+    bool running    = installedBefore;
+    installedBefore = true;
+    for (auto &exp : ctx.exports) {
+        *exp.dest = (void *)(ctx.generated.addr + exp.offset);
+    }
+    auto                  mappings = readMemoryMap();
+    std::vector<Toggle *> toggles, toEnable;
+    for (auto &entry : ctx.entries) {
+        entry.site->toggle = createToggle(ctx, entry, mappings);
+        toggles.push_back(entry.site->toggle);
+        if (entry.site->enabled) {
+            toEnable.push_back(entry.site->toggle);
+        }
     }
 
-    // Install injections.
-    printf("Installing injections\n");
-    memcpy(codeMem, ctx.generated.code.data(), ctx.generated.code.size());
-    for (auto &section : ctx.patches) {
-        if (mprotect((void *)section.addr, section.code.size(), PROT_READ | PROT_WRITE)) {
-            perror("Making code writeable failed");
-            abort();
+    if (!running) {
+        // Sites that start out disabled are only made switchable; their code is left as it is.
+        for (auto &entry : ctx.entries) {
+            entry.site->toggle->enabled = entry.site->enabled;
+            if (!entry.site->enabled) {
+                ctx.patches[entry.patch].code.clear();
+            }
         }
-        memcpy((void *)section.addr, section.code.data(), section.code.size());
-        if (mprotect((void *)section.addr, section.code.size(), PROT_READ | PROT_EXEC)) {
-            perror("Making code executable again failed");
+        PatchStats stats;
+        if (!installPatches(ctx.patches, stats)) {
             abort();
         }
+        printf(
+            "Installed %zu patches on %zu pages with %zu mprotect calls in %.3f ms\n",
+            stats.patches,
+            stats.pages,
+            stats.syscalls,
+            stats.time
+        );
     }
 
-    // Make code executable.
-    printf("Making code executable\n");
-    if (mprotect(codeMem, ctx.generated.code.size(), PROT_READ | PROT_EXEC)) {
-        perror("mprotect() failed");
-        abort();
+    if (!registerToggles(toggles)) {
+        printf("Warning: Injections can't be switched on or off\n");
+        for (auto &entry : ctx.entries) {
+            entry.site->toggle = NULL;
+        }
+        // Without the signal handlers, patches can't be written while the game runs.
+        return !running || toEnable.empty();
+    }
+    if (running && !setToggles(toEnable, true)) {
+        printf("Error: Injections were placed but could not be switched on; setEnabled may switch them on later\n");
+        return false;
     }
+    return true;
+}
 
+// Find the slot of `siteTable` that holds the site with a hash, or the empty slot where it would go.
+static InjectionSite *&findSlot(uint64_t hash) {
+    size_t mask = siteTable->size() - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        InjectionSite *&slot = (*siteTable)[i];
+        if (!slot || slot->id.hash == hash) {
+            return slot;
+        }
+    }
+}
+
+// Whether a site is for a symbol; prints an error if it is for another one with the same hash.
+static bool isSiteOf(InjectionSite const *site, SymbolId symbol) {
+    if (site->id.name != symbol.name) {
+        printf(
+            "Error: `%.*s` has the same hash as `%.*s`, so it can't be injected at\n",
+            (int)symbol.name.size(),
+            symbol.name.data(),
+            (int)site->id.name.size(),
+            site->id.name.data()
+        );
+        return false;
+    }
     return true;
 }
 
+// Add a site to `siteTable`, doubling it first if it would become more than half full.
+static void insertSite(InjectionSite *site) {
+    if ((siteCount + 1) * 2 > siteTable->size()) {
+        std::vector<InjectionSite *> old(siteTable->size() * 2, NULL);
+        old.swap(*siteTable);
+        for (InjectionSite *existing : old) {
+            if (existing) {
+                findSlot(existing->id.hash) = existing;
+            }
+        }
+    }
+    findSlot(site->id.hash) = site;
+}
 
-// Inject code to run at one of Factorio's functions.
-void injectAt(std::string const &symbolName, Injection toInject, InjectionPoint point) {
-    auto symbol = object::findSymbol(symbolName);
-    if (!symbol) {
-        printf("Error: Injection at non-existent symbol `%s`\n", symbolName.c_str());
-        allowInjection = false;
-    } else if (allowInjection) {
-        if (injectionSites->find(symbolName) == injectionSites->end()) {
-            injectionSites->emplace(symbolName, InjectionSite{symbol});
+// Remove a site from `siteTable`, moving later sites of the same probe sequence up so that they stay reachable.
+static void removeSite(InjectionSite *site) {
+    size_t mask = siteTable->size() - 1;
+    size_t hole = &findSlot(site->id.hash) - siteTable->data();
+    for (size_t i = (hole + 1) & mask; (*siteTable)[i]; i = (i + 1) & mask) {
+        size_t home = (*siteTable)[i]->id.hash & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            (*siteTable)[hole] = (*siteTable)[i];
+            hole               = i;
         }
-        auto &site = injectionSites->find(symbolName)->second;
-        switch (point.type) {
-            case InjectionPoint::Type::BEFORE: site.before.emplace_back(toInject); break;
-            case InjectionPoint::Type::AFTER: site.after.emplace_back(toInject); break;
+    }
+    (*siteTable)[hole] = NULL;
+}
+
+// Forget the sites of a batch that could not be injected, so that later batches don't try them again.
+// Their memory is not reused; a failed batch is not expected to happen often.
+static void discardBatch(std::vector<InjectionSite *> const &sites) {
+    for (auto site : sites) {
+        removeSite(site);
+    }
+}
+
+
+// Initialize the injection sub-system.
+void init() {
+    siteChunks     = new std::vector<std::unique_ptr<InjectionSite[]>>();
+    siteTable      = new std::vector<InjectionSite *>(4 * SITE_CHUNK, NULL);
+    ownedNames     = new std::deque<std::string>();
+    arena          = new CodeArena();
+    allowInjection = true;
+    if (auto text = object::findSection(".text")) {
+        arena->setTarget((size_t)text->sh_addr_ptr, (size_t)text->sh_addr_ptr + text->sh_size);
+    } else {
+        printf("Warning: No .text section, generated code may not be in range of it\n");
+    }
+}
+
+// Inject the code added since the last call now.
+bool performInjections() {
+    if (!allowInjection) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(sitesMutex);
+    auto                        startTime = std::chrono::steady_clock::now();
+
+    // Installed sites are never generated again; only the ones added since are, in the order they were added.
+    std::vector<InjectionSite *> sites;
+    for (size_t i = 0; i < siteCount; i++) {
+        InjectionSite *site = &(*siteChunks)[i / SITE_CHUNK][i % SITE_CHUNK];
+        if (!site->installed && findSlot(site->id.hash) == site) {
+            sites.push_back(site);
         }
     }
+    if (sites.empty()) {
+        return true;
+    }
+
+    InjectionCtx ctx;
+    auto         checkpoint = arena->checkpoint();
+    if (!buildBatch(ctx, sites)) {
+        printf("Rolling back %zu injection sites\n", sites.size());
+        arena->rollback(checkpoint);
+        discardBatch(sites);
+        return false;
+    }
+
+    printf("Installing injections\n");
+    auto installStart = std::chrono::steady_clock::now();
+    bool success      = installBatch(ctx);
+    for (auto site : sites) {
+        site->installed = true;
+    }
+    timings::recordPhase("install", timings::elapsedMs(installStart));
+    timings::recordPhase("perform_injections", timings::elapsedMs(startTime));
+    printf("Injected %zu sites in %.3f ms\n", sites.size(), timings::elapsedMs(startTime));
+    return success;
+}
+
+
+// Call a `CapturingInjection`; this is what the generated code calls for them.
+static void callCapturing(void *func) {
+    (*(CapturingInjection *)func)();
+}
+
+// Create an injection that calls a `CapturingInjection`.
+Injection Injection::fromCapturing(CapturingInjection func) {
+    // The generated code may call it at any time, so it is never freed.
+    return Injection((void *)&callCapturing, new CapturingInjection(std::move(func)));
+}
+
+// Get the site to add injections to for a symbol, adding it if there is none yet.
+// Returns NULL if it was installed already or another symbol has the same hash. Names that may not outlive the call
+// are copied when a site is added for them. Must be called with `sitesMutex` held.
+static InjectionSite *getPendingSite(SymbolId symbol, bool copyName) {
+    InjectionSite *site = findSlot(symbol.hash);
+    if (site && !isSiteOf(site, symbol)) {
+        return NULL;
+    } else if (site && site->installed) {
+        printf(
+            "Error: `%.*s` is already injected into, no more injections can be added\n",
+            (int)symbol.name.size(),
+            symbol.name.data()
+        );
+        return NULL;
+    } else if (site) {
+        return site;
+    }
+
+    if (siteCount % SITE_CHUNK == 0) {
+        siteChunks->emplace_back(new InjectionSite[SITE_CHUNK]);
+    }
+    site     = &siteChunks->back()[siteCount % SITE_CHUNK];
+    site->id = copyName ? SymbolId(ownedNames->emplace_back(symbol.name)) : symbol;
+    insertSite(site);
+    siteCount++;
+    return site;
+}
+
+// Replace one of Factorio's functions.
+static void replaceAt(SymbolId symbol, void *replacement, void **original, bool copyName) {
+    if (!allowInjection) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(sitesMutex);
+    auto                        site = getPendingSite(symbol, copyName);
+    if (!site) {
+        return;
+    } else if (site->replacement) {
+        printf("Error: `%.*s` is already replaced\n", (int)symbol.name.size(), symbol.name.data());
+        return;
+    }
+    site->replacement = replacement;
+    site->original    = original;
+}
+
+// Replace one of Factorio's functions.
+void replaceAt(std::string const &symbolName, void *replacement, void **original) {
+    replaceAt(SymbolId(symbolName), replacement, original, true);
+}
+
+// Replace one of Factorio's functions, named by a `SymbolId`.
+void replaceAt(SymbolId symbol, void *replacement, void **original) {
+    replaceAt(symbol, replacement, original, false);
+}
+
+// Switch the injections and replacement on one of Factorio's functions on or off.
+bool setEnabled(std::string const &symbolName, bool enabled) {
+    return setEnabled(SymbolId(symbolName), enabled);
+}
+
+// Switch the injections and replacement on one of Factorio's functions, named by a `SymbolId`, on or off.
+bool setEnabled(SymbolId symbol, bool enabled) {
+    if (!allowInjection) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(sitesMutex);
+    auto                        site = findSlot(symbol.hash);
+    if (!site) {
+        printf("Error: No injections at `%.*s` to switch\n", (int)symbol.name.size(), symbol.name.data());
+        return false;
+    } else if (!isSiteOf(site, symbol)) {
+        return false;
+    }
+    if (site->toggle) {
+        return setToggle(*site->toggle, enabled);
+    } else if (site->installed) {
+        printf("Error: Injections at `%.*s` can't be switched\n", (int)symbol.name.size(), symbol.name.data());
+        return false;
+    }
+    // Not injected yet; this is the state it starts in.
+    site->enabled = enabled;
+    return true;
+}
+
+// Inject code to run at one of Factorio's functions.
+// The symbol is resolved later, together with all other sites, by `performInjections`.
+static void injectAt(SymbolId symbol, Injection toInject, InjectionPoint point, bool copyName) {
+    if (!allowInjection) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(sitesMutex);
+    auto                        site = getPendingSite(symbol, copyName);
+    if (!site) {
+        return;
+    }
+    switch (point.type) {
+        case InjectionPoint::Type::BEFORE: site->before.push_back(toInject); break;
+        case InjectionPoint::Type::AFTER: site->after.push_back(toInject); break;
+    }
+}
+
+// Inject code to run at one of Factorio's functions.
+void injectAt(std::string const &symbolName, Injection toInject, InjectionPoint point) {
+    injectAt(SymbolId(symbolName), toInject, point, true);
+}
+
+// Inject code to run at one of Factorio's functions, named by a `SymbolId`.
+void injectAt(SymbolId symbol, Injection toInject, InjectionPoint point) {
+    injectAt(symbol, toInject, point, false);
 }
 
 } // namespace coretorio::injection
@@ -4,6 +4,8 @@
 #include "injection_priv.hpp"
 
 #include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <Zydis/Zydis.h>
 
 
@@ -13,24 +15,79 @@ namespace coretorio::injection {
 using X64Insn  = CodeFlowInsn;
 using X64Graph = CodeFlowGraph<X64Insn>;
 
+// Get the shared instruction decoder.
+// It only decodes what code flow analysis needs; it is never modified after initialization,
+// so it can be used from multiple threads at once.
+static ZydisDecoder const &decoder() {
+    static ZydisDecoder const decoder = [] {
+        ZydisDecoder decoder;
+        ZydisDecoderInit(&decoder, ZYDIS_MACHINE_MODE_LONG_64, ZYDIS_STACK_WIDTH_64);
+        ZydisDecoderEnableMode(&decoder, ZYDIS_DECODER_MODE_MINIMAL, ZYAN_TRUE);
+        return decoder;
+    }();
+    return decoder;
+}
+
+// Get the shared instruction decoder that also decodes operands, for register liveness analysis.
+static ZydisDecoder const &fullDecoder() {
+    static ZydisDecoder const decoder = [] {
+        ZydisDecoder decoder;
+        ZydisDecoderInit(&decoder, ZYDIS_MACHINE_MODE_LONG_64, ZYDIS_STACK_WIDTH_64);
+        return decoder;
+    }();
+    return decoder;
+}
+
+// Whether to print the disassembly of analyzed code, set by the CORETORIO_DISASM environment variable.
+static bool traceDisasm() {
+    static bool const trace = getenv("CORETORIO_DISASM") != NULL;
+    return trace;
+}
+
+// Get the sign-extended value of a raw immediate.
+static int64_t rawImmediate(ZydisDecodedInstruction const &insn, int index) {
+    auto const &imm = insn.raw.imm[index];
+    switch (imm.size) {
+        case 8: return (int8_t)imm.value.u;
+        case 16: return (int16_t)imm.value.u;
+        case 32: return (int32_t)imm.value.u;
+        default: return (int64_t)imm.value.u;
+    }
+}
+
 // Analyze code and create a new node.
 template <> X64Graph::Node X64Graph::Node::analyze(size_t startAddress, size_t maxLength) {
-    // Disassemble an instruction.
-    ZydisDisassembledInstruction insn;
-    ZydisDisassembleIntel(ZYDIS_MACHINE_MODE_LONG_64, startAddress, (uint8_t *)startAddress, maxLength, &insn);
-    // printf("%p  ", (void *)startAddress);
-    // puts(insn.text);
-
-    // Copy the lengths into the node.
     X64Graph::Node node;
     node.addr   = startAddress;
-    node.length = insn.info.length;
+    node.branch = 0;
+
+    // Decode an instruction.
+    ZydisDecodedInstruction insn;
+    if (ZYAN_FAILED(ZydisDecoderDecodeInstruction(&decoder(), NULL, (uint8_t *)startAddress, maxLength, &insn))) {
+        node.type   = X64Insn::Type::INVALID;
+        node.length = 0;
+        node.next   = node.addr;
+        return node;
+    }
+    if (traceDisasm()) {
+        ZydisDisassembledInstruction text;
+        ZydisDisassembleIntel(ZYDIS_MACHINE_MODE_LONG_64, startAddress, (uint8_t *)startAddress, maxLength, &text);
+        printf("%p  %s\n", (void *)startAddress, text.text);
+    }
+
+    // Copy the lengths into the node.
+    node.length = insn.length;
     node.next   = node.addr + node.length;
 
-    if (insn.info.meta.branch_type) {
-        node.branch = node.next + insn.operands[0].imm.value.s;
+    // Direct branches, jumps and calls have their target as a relative immediate.
+    if (insn.raw.imm[0].is_relative) {
+        node.branch = node.next + rawImmediate(insn, 0);
     }
-    switch (insn.info.mnemonic) {
+    switch (insn.mnemonic) {
+        case ZYDIS_MNEMONIC_JB:
+        case ZYDIS_MNEMONIC_JBE:
+        case ZYDIS_MNEMONIC_JCXZ:
+        case ZYDIS_MNEMONIC_JECXZ:
         case ZYDIS_MNEMONIC_JL:
         case ZYDIS_MNEMONIC_JLE:
         case ZYDIS_MNEMONIC_JNB:
@@ -45,7 +102,10 @@ template <> X64Graph::Node X64Graph::Node::analyze(size_t startAddress, size_t m
         case ZYDIS_MNEMONIC_JP:
         case ZYDIS_MNEMONIC_JRCXZ:
         case ZYDIS_MNEMONIC_JS:
-        case ZYDIS_MNEMONIC_JZ: node.type = X64Insn::Type::BRANCH; break;
+        case ZYDIS_MNEMONIC_JZ:
+        case ZYDIS_MNEMONIC_LOOP:
+        case ZYDIS_MNEMONIC_LOOPE:
+        case ZYDIS_MNEMONIC_LOOPNE: node.type = X64Insn::Type::BRANCH; break;
 
         case ZYDIS_MNEMONIC_CALL: node.type = X64Insn::Type::CALL; break;
         case ZYDIS_MNEMONIC_JMP: node.type = X64Insn::Type::JUMP; break;
@@ -55,15 +115,616 @@ template <> X64Graph::Node X64Graph::Node::analyze(size_t startAddress, size_t m
     return node;
 }
 
-// Apply this relocation.
-void Reloc::apply() const {
+// Registers tracked by liveness analysis, as bits of a `uint64_t`:
+// the general-purpose registers in encoding order, then XMM0-15, then the status flags.
+static constexpr int      REG_XMM0      = 16;
+static constexpr int      REG_FLAGS     = 32;
+static constexpr uint64_t ALL_REGS      = (1ull << 33) - 1;
+// Mask of the general-purpose registers.
+static constexpr uint64_t GPR_MASK      = 0xffff;
+// Mask of the vector registers.
+static constexpr uint64_t XMM_MASK      = 0xffffull << REG_XMM0;
+// Mask of the status flags.
+static constexpr uint64_t FLAGS_MASK    = 1ull << REG_FLAGS;
+// State that a called function may change: rax, rcx, rdx, rsi, rdi, r8-r11, all vector registers and the flags.
+static constexpr uint64_t CALLER_SAVED  = 0x0fc7 | XMM_MASK | FLAGS_MASK;
+// Registers that may pass arguments: rdi, rsi, rdx, rcx, r8, r9, rax (vector count for varargs) and XMM0-7.
+static constexpr uint64_t ARGUMENT_REGS = 0x03c7 | 0xffull << REG_XMM0;
+// Registers that may hold return values: rax, rdx, XMM0 and XMM1.
+static constexpr uint64_t RETURN_REGS   = 0x0005 | 0x3ull << REG_XMM0;
+
+// Get the liveness bit of a register, or 0 if it is not tracked.
+static uint64_t regBit(ZydisRegister reg) {
+    switch (ZydisRegisterGetClass(reg)) {
+        case ZYDIS_REGCLASS_GPR8:
+        case ZYDIS_REGCLASS_GPR16:
+        case ZYDIS_REGCLASS_GPR32:
+        case ZYDIS_REGCLASS_GPR64:
+            return 1ull << ZydisRegisterGetId(ZydisRegisterGetLargestEnclosing(ZYDIS_MACHINE_MODE_LONG_64, reg));
+        case ZYDIS_REGCLASS_XMM:
+        case ZYDIS_REGCLASS_YMM:
+        case ZYDIS_REGCLASS_ZMM: {
+            int id = ZydisRegisterGetId(reg);
+            return id < 16 ? 1ull << (REG_XMM0 + id) : 0;
+        }
+        default: return 0;
+    }
+}
+
+// Whether an instruction sets its destination to zero regardless of its inputs, like `xor eax, eax`.
+static bool isZeroIdiom(ZydisDecodedInstruction const &insn, ZydisDecodedOperand const *operands) {
+    int first;
+    switch (insn.mnemonic) {
+        case ZYDIS_MNEMONIC_XOR:
+        case ZYDIS_MNEMONIC_SUB:
+        case ZYDIS_MNEMONIC_PXOR:
+        case ZYDIS_MNEMONIC_XORPS:
+        case ZYDIS_MNEMONIC_XORPD: first = 0; break;
+        case ZYDIS_MNEMONIC_VPXOR:
+        case ZYDIS_MNEMONIC_VXORPS:
+        case ZYDIS_MNEMONIC_VXORPD: first = 1; break;
+        default: return false;
+    }
+    return insn.operand_count_visible >= first + 2 && operands[first].type == ZYDIS_OPERAND_TYPE_REGISTER
+           && operands[first + 1].type == ZYDIS_OPERAND_TYPE_REGISTER
+           && operands[first].reg.value == operands[first + 1].reg.value;
+}
+
+// Whether writing a register operand replaces all of the state tracked for it.
+// Writes to 8- and 16-bit registers keep the rest of the register, and so do most legacy SSE instructions.
+static bool isFullWrite(
+    ZydisDecodedInstruction const &insn, ZydisDecodedOperand const *operands, ZydisDecodedOperand const &operand
+) {
+    switch (ZydisRegisterGetClass(operand.reg.value)) {
+        case ZYDIS_REGCLASS_GPR32:
+        case ZYDIS_REGCLASS_GPR64: return true;
+        case ZYDIS_REGCLASS_XMM:
+        case ZYDIS_REGCLASS_YMM:
+        case ZYDIS_REGCLASS_ZMM: break;
+        default: return false;
+    }
+    if (insn.encoding != ZYDIS_INSTRUCTION_ENCODING_LEGACY || isZeroIdiom(insn, operands)) {
+        // VEX and EVEX encoded instructions clear the rest of the register.
+        return true;
+    }
+    switch (insn.mnemonic) {
+        case ZYDIS_MNEMONIC_MOVAPS:
+        case ZYDIS_MNEMONIC_MOVUPS:
+        case ZYDIS_MNEMONIC_MOVAPD:
+        case ZYDIS_MNEMONIC_MOVUPD:
+        case ZYDIS_MNEMONIC_MOVDQA:
+        case ZYDIS_MNEMONIC_MOVDQU:
+        case ZYDIS_MNEMONIC_MOVD:
+        case ZYDIS_MNEMONIC_MOVQ:
+        case ZYDIS_MNEMONIC_LDDQU: return true;
+        case ZYDIS_MNEMONIC_MOVSS:
+        case ZYDIS_MNEMONIC_MOVSD:
+            // Loads clear the rest of the register, moves between registers don't.
+            return operands[1].type == ZYDIS_OPERAND_TYPE_MEMORY;
+        default: return false;
+    }
+}
+
+// Get the registers an instruction reads before writing them and the registers it overwrites.
+static void getRegUsage(X64Graph::Node const &node, uint64_t &use, uint64_t &def) {
+    ZydisDecodedInstruction insn;
+    ZydisDecodedOperand     operands[ZYDIS_MAX_OPERAND_COUNT];
+    if (ZYAN_FAILED(ZydisDecoderDecodeFull(&fullDecoder(), (void *)node.addr, node.length, &insn, operands))) {
+        use = ALL_REGS;
+        def = 0;
+        return;
+    }
+    use            = 0;
+    def            = 0;
+    bool zeroIdiom = isZeroIdiom(insn, operands);
+    for (int i = 0; i < insn.operand_count; i++) {
+        auto const &operand = operands[i];
+        if (operand.type == ZYDIS_OPERAND_TYPE_MEMORY) {
+            use |= regBit(operand.mem.base) | regBit(operand.mem.index);
+        } else if (operand.type == ZYDIS_OPERAND_TYPE_REGISTER) {
+            uint64_t bit = regBit(operand.reg.value);
+            if ((operand.actions & ZYDIS_OPERAND_ACTION_MASK_READ) && !zeroIdiom) {
+                use |= bit;
+            }
+            if ((operand.actions & ZYDIS_OPERAND_ACTION_WRITE) && isFullWrite(insn, operands, operand)) {
+                def |= bit;
+            } else if (operand.actions & ZYDIS_OPERAND_ACTION_MASK_WRITE) {
+                // The old value is partially kept.
+                use |= bit;
+            }
+        }
+    }
+
+    // The status flags are tracked as a whole.
+    ZydisCPUFlags status = ZYDIS_CPUFLAG_CF | ZYDIS_CPUFLAG_PF | ZYDIS_CPUFLAG_AF | ZYDIS_CPUFLAG_ZF
+                           | ZYDIS_CPUFLAG_SF | ZYDIS_CPUFLAG_OF;
+    if (insn.cpu_flags) {
+        auto          flags   = insn.cpu_flags;
+        ZydisCPUFlags written = flags->modified | flags->set_0 | flags->set_1 | flags->undefined;
+        if ((flags->tested & status) || ((written & status) && (written & status) != status)) {
+            use |= FLAGS_MASK;
+        }
+        if ((written & status) == status) {
+            def |= FLAGS_MASK;
+        }
+    }
+
+    // Calls read the argument registers and may change all caller-saved state.
+    if (node.type == X64Insn::Type::CALL) {
+        use |= ARGUMENT_REGS;
+        def |= CALLER_SAVED;
+    }
+}
+
+// Get the registers that are live at the start of a function.
+static uint64_t liveAtEntry(X64Graph const &graph) {
+    size_t count = graph.blocks.size();
+    if (!count) {
+        return ALL_REGS;
+    }
+    std::vector<uint64_t> use(count), def(count), exit(count);
+    for (size_t i = 0; i < count; i++) {
+        auto const &block = graph.blocks[i];
+        for (uint32_t j = block.insnCount; j-- > 0;) {
+            uint64_t insnUse, insnDef;
+            getRegUsage(graph.insns[block.firstInsn + j], insnUse, insnDef);
+            use[i]  = insnUse | (use[i] & ~insnDef);
+            def[i] |= insnDef;
+        }
+
+        // Registers that are live after the block, other than through its successors.
+        auto const &last = graph.insns[block.firstInsn + block.insnCount - 1];
+        switch (last.type) {
+            case X64Insn::Type::RETURN: exit[i] = RETURN_REGS; break;
+            case X64Insn::Type::TAILCALL: exit[i] = ARGUMENT_REGS; break;
+            case X64Insn::Type::JUMP:
+                // Indirect jumps can go anywhere; the targets of jump tables are not followed.
+                exit[i] = block.succ[1] == X64Graph::NONE ? ALL_REGS : 0;
+                break;
+            case X64Insn::Type::BRANCH:
+                if (block.succ[1] == X64Graph::NONE) {
+                    // A conditional tail call.
+                    exit[i] = graph.contains(last.branch) ? ALL_REGS : ARGUMENT_REGS;
+                }
+                if (block.succ[0] == X64Graph::NONE) {
+                    exit[i] = ALL_REGS;
+                }
+                break;
+            case X64Insn::Type::CALL:
+                // A call at the very end of the function does not return, like `__stack_chk_fail`.
+                if (block.succ[0] == X64Graph::NONE && graph.contains(last.next)) {
+                    exit[i] = ALL_REGS;
+                }
+                break;
+            default:
+                if (block.succ[0] == X64Graph::NONE) {
+                    exit[i] = ALL_REGS;
+                }
+                break;
+        }
+    }
+    return graph.liveness(use, def, exit)[0];
+}
+
+
+// Layout of the state an entry trampoline saves on the stack.
+struct SaveFrame {
+    // State to save, as liveness bits.
+    uint64_t regs;
+    // Offset of the first saved vector register from the stack pointer.
+    int32_t  xmmBase;
+    // Stack space for the vector registers, including padding to keep the stack 16-byte aligned.
+    int32_t  xmmSize;
+    // Distance from the stack pointer to the return address after saving.
+    int32_t  size;
+
+    SaveFrame(uint64_t regs) : regs(regs) {
+        // The stack is 8 bytes off alignment at the function entry.
+        int pushes = __builtin_popcountll(regs & (GPR_MASK | FLAGS_MASK));
+        xmmBase    = pushes % 2 ? 0 : 8;
+        xmmSize    = xmmBase + 16 * __builtin_popcountll(regs & XMM_MASK);
+        size       = 8 * pushes + xmmSize;
+    }
+};
+
+// Append bytes to a section.
+static void emit(Section &sect, std::initializer_list<uint8_t> bytes) {
+    sect.code.insert(sect.code.end(), bytes);
+}
+
+// Append a 32-bit little-endian value to a section.
+static void emit32(Section &sect, uint32_t value) {
+    emit(sect, {(uint8_t)value, (uint8_t)(value >> 8), (uint8_t)(value >> 16), (uint8_t)(value >> 24)});
+}
+
+// Append a 64-bit little-endian value to a section.
+static void emit64(Section &sect, uint64_t value) {
+    emit32(sect, value);
+    emit32(sect, value >> 32);
+}
+
+// Append a `movups [rsp+offset], xmm` or `movups xmm, [rsp+offset]` to a section.
+static void emitMovups(Section &sect, bool store, int xmm, int32_t offset) {
+    if (xmm >= 8) {
+        emit(sect, {0x44});
+    }
+    emit(sect, {0x0f, (uint8_t)(store ? 0x11 : 0x10), (uint8_t)(0x84 | (xmm & 7) << 3), 0x24});
+    emit32(sect, offset);
+}
+
+// Append a `mov [rsp+offset], reg` or `mov reg, [rsp+offset]` of a general-purpose register to a section.
+static void emitMovRsp(Section &sect, bool store, int reg, int32_t offset) {
+    uint8_t rex = reg >= 8 ? 0x4c : 0x48;
+    emit(sect, {rex, (uint8_t)(store ? 0x89 : 0x8b), (uint8_t)(0x84 | (reg & 7) << 3), 0x24});
+    emit32(sect, offset);
+}
+
+// Append a `sub rsp, size` or `add rsp, size` to a section.
+static void emitAdjustRsp(Section &sect, bool sub, int32_t size) {
+    emit(sect, {0x48, 0x81, (uint8_t)(sub ? 0xec : 0xc4)});
+    emit32(sect, size);
+}
+
+// Append a 32-bit PC-relative field to a section that refers to a location in another section.
+// The field must be the last part of its instruction.
+static void emitRel32(
+    InjectionCtx &ctx, SectionRef target, Reloc::Type type, SectionRef reference, size_t referenceOffset
+) {
+    Section &sect = ctx.getSection(target);
+    ctx.reloc.push_back(Reloc{type, -4, target, sect.code.size(), reference, referenceOffset});
+    emit32(sect, 0);
+}
+
+// Append a `push` (opcode 0x50) or `pop` (opcode 0x58) of a general-purpose register to a section.
+static void emitPushPop(Section &sect, uint8_t opcode, uint8_t reg) {
+    if (reg >= 8) {
+        emit(sect, {0x41});
+    }
+    emit(sect, {(uint8_t)(opcode + (reg & 7))});
+}
+
+// Encodings of the general-purpose registers in `CallRegisters::gpr`.
+static uint8_t const callRegistersGpr[] = {7 /* rdi */, 6 /* rsi */, 2 /* rdx */, 1 /* rcx */, 8, 9, 0 /* rax */};
+// Size of `CallRegisters` on the stack.
+static constexpr int32_t callRegistersSize = sizeof(CallRegisters);
+static_assert(callRegistersSize % 16 == 0, "CallRegisters must keep the stack aligned");
+static_assert(sizeof(callRegistersGpr) == sizeof(CallRegisters::gpr) / sizeof(uint64_t));
+
+// Append code that stores registers into a `CallRegisters` at the stack pointer, or loads them back.
+// For return values only rax, rdx and optionally xmm0 and xmm1 are stored.
+static void emitCallRegisters(Section &sect, bool store, bool arguments, bool vectors) {
+    for (size_t i = 0; i < sizeof(callRegistersGpr); i++) {
+        if (arguments || i == CallRegisters::RAX || i == CallRegisters::RDX) {
+            emitMovRsp(sect, store, callRegistersGpr[i], offsetof(CallRegisters, gpr) + 8 * i);
+        }
+    }
+    for (int i = 0; vectors && i < (arguments ? 8 : 2); i++) {
+        emitMovups(sect, store, i, offsetof(CallRegisters, xmm) + 16 * i);
+    }
+}
+
+// Append code that saves the state in a frame, leaving the stack 16-byte aligned.
+// Vector registers are saved as their low 128 bits; see `Injection::usesSimd`.
+static void emitSave(Section &sect, SaveFrame const &frame) {
+    if (frame.regs & FLAGS_MASK) {
+        emit(sect, {0x9c}); // pushfq
+    }
+    for (int reg = 0; reg < 16; reg++) {
+        if (frame.regs >> reg & 1) {
+            emitPushPop(sect, 0x50, reg);
+        }
+    }
+    if (frame.xmmSize) {
+        emitAdjustRsp(sect, true, frame.xmmSize);
+    }
+    int32_t offset = frame.xmmBase;
+    for (int i = 0; i < 16; i++) {
+        if (frame.regs >> (REG_XMM0 + i) & 1) {
+            emitMovups(sect, true, i, offset);
+            offset += 16;
+        }
+    }
+}
+
+// Append code that restores the state saved by `emitSave`.
+static void emitRestore(Section &sect, SaveFrame const &frame) {
+    int32_t offset = frame.xmmBase;
+    for (int i = 0; i < 16; i++) {
+        if (frame.regs >> (REG_XMM0 + i) & 1) {
+            emitMovups(sect, false, i, offset);
+            offset += 16;
+        }
+    }
+    if (frame.xmmSize) {
+        emitAdjustRsp(sect, false, frame.xmmSize);
+    }
+    for (int reg = 15; reg >= 0; reg--) {
+        if (frame.regs >> reg & 1) {
+            emitPushPop(sect, 0x58, reg);
+        }
+    }
+    if (frame.regs & FLAGS_MASK) {
+        emit(sect, {0x9d}); // popfq
+    }
+}
+
+// Estimate the number of cycles it takes to save and restore the state in a frame.
+static int estimateSaveCycles(SaveFrame const &frame) {
+    // Roughly one cycle per push, pop, store and load; `popfq` is microcoded and much slower.
+    int cycles = 2 * __builtin_popcountll(frame.regs & (GPR_MASK | XMM_MASK));
+    if (frame.regs & FLAGS_MASK) {
+        cycles += 3 + 9;
+    }
+    return cycles;
+}
+
+// Append a direct call to an injection.
+static void emitCall(InjectionCtx &ctx, Injection const &injection) {
+    Section &sect = ctx.generated;
+    if (injection.arg) {
+        emit(sect, {0x48, 0xbf}); // mov rdi, arg
+        emit64(sect, (uint64_t)injection.arg);
+    }
+    if (injection.passRegisters) {
+        emit(sect, {0x48, 0x89, 0xe6}); // mov rsi, rsp
+    }
+    emit(sect, {0xe8}); // call func
+    emitRel32(ctx, SECTION_GENERATED, Reloc::BRANCH32, SECTION_ABSOLUTE, (size_t)injection.func);
+}
+
+// Copy the instructions at the start of a function that will be overwritten by the entry jump,
+// adjusting anything that is relative to the instruction pointer, and record where each instruction went.
+// Returns the number of bytes to overwrite, or 0 if the prologue can't be moved.
+static size_t relocatePrologue(InjectionCtx &ctx, X64Graph const &graph, std::vector<Boundary> &boundaries) {
+    Section &code      = ctx.generated;
+    size_t   addr      = graph.startAddress;
+    size_t   start     = code.code.size();
+    bool     afterCall = false;
+    if (!graph.contains(addr + 4)) {
+        printf("Function too short to inject into\n");
+        return 0;
+    }
+    // Nothing may jump into the bytes that are replaced.
+    if (graph.blocks.size() > 1 && graph.blocks[1].start < addr + 5) {
+        printf("Branch target in function prologue\n");
+        return 0;
+    }
+    while (addr < graph.startAddress + 5) {
+        auto node = graph.getNodeAt(addr);
+        if (!node || node->type == X64Insn::Type::INVALID) {
+            printf("Function prologue could not be decoded\n");
+            return 0;
+        }
+        ZydisDecodedInstruction insn;
+        if (ZYAN_FAILED(ZydisDecoderDecodeInstruction(&decoder(), NULL, (uint8_t *)addr, node->length, &insn))) {
+            return 0;
+        }
+        boundaries.push_back(
+            Boundary{(uint32_t)(addr - graph.startAddress), (uint32_t)(code.code.size() - start), afterCall}
+        );
+        afterCall = node->type == X64Insn::Type::CALL;
+
+        if (node->type == X64Insn::Type::CALL && insn.raw.imm[0].is_relative) {
+            emit(code, {0xe8});
+            emitRel32(ctx, SECTION_GENERATED, Reloc::BRANCH32, SECTION_ABSOLUTE, node->branch);
+        } else if ((node->type == X64Insn::Type::JUMP || node->type == X64Insn::Type::TAILCALL)
+                   && insn.raw.imm[0].is_relative) {
+            emit(code, {0xe9});
+            emitRel32(ctx, SECTION_GENERATED, Reloc::BRANCH32, SECTION_ABSOLUTE, node->branch);
+        } else if (insn.raw.imm[0].is_relative || insn.raw.imm[1].is_relative) {
+            printf("Unsupported relative branch in function prologue\n");
+            return 0;
+        } else {
+            size_t pos = code.code.size();
+            code.code.insert(code.code.end(), (uint8_t *)addr, (uint8_t *)addr + node->length);
+            bool ripRelative = insn.raw.modrm.offset && insn.raw.modrm.mod == 0 && insn.raw.modrm.rm == 5;
+            if (ripRelative && insn.raw.disp.size == 32) {
+                // RIP-relative memory operand; the displacement is relative to the end of the instruction.
+                size_t target = node->next + (int32_t)insn.raw.disp.value;
+                ctx.reloc.push_back(Reloc{
+                    Reloc::REL32,
+                    -(int64_t)(node->length - insn.raw.disp.offset),
+                    SECTION_GENERATED,
+                    pos + insn.raw.disp.offset,
+                    SECTION_ABSOLUTE,
+                    target,
+                });
+            }
+        }
+
+        if (!node->fallsThrough()) {
+            // The rest of the replaced bytes are never reached.
+            return 5;
+        }
+        addr = node->next;
+    }
+
+    // Continue after the replaced instructions.
+    emit(code, {0xe9});
+    emitRel32(ctx, SECTION_GENERATED, Reloc::BRANCH32, SECTION_ABSOLUTE, addr);
+    return addr - graph.startAddress;
+}
+
+// Append the entry trampoline for the before- and after-injections on a site, which saves the caller-saved state
+// that is live at the function entry, calls the before-injections directly and restores the state.
+// If there are after-injections, it also swaps the function's return address for the return stub; the index of
+// the relocation that refers to the stub is stored in `stubRef`. If they are all sampled, the swap is skipped for
+// calls that no sampled before-injection sampled; their results are ORed into a byte on the stack.
+static void emitEntryTrampoline(InjectionCtx &ctx, InjectionSite const &site, X64Graph const &graph, size_t &stubRef) {
+    // Only save the state that is live at the function entry and may be changed by the calls.
+    // Injections that access the arguments get all argument registers in a `CallRegisters` instead.
+    bool usesSimd = false, passRegisters = false, sampledBefore = false, sampledAfter = site.after.size();
+    for (auto &injection : site.before) {
+        usesSimd      |= injection.usesSimd;
+        passRegisters |= injection.passRegisters;
+        sampledBefore |= injection.sampled;
+    }
+    for (auto &injection : site.after) {
+        sampledAfter &= injection.sampled;
+    }
+    bool     sampling  = sampledBefore && sampledAfter;
+    uint64_t clobbered = CALLER_SAVED & (usesSimd ? ALL_REGS : ~XMM_MASK);
+    if (passRegisters) {
+        clobbered &= ~ARGUMENT_REGS;
+    }
+    SaveFrame frame(liveAtEntry(graph) & clobbered);
+    SaveFrame fullFrame(CALLER_SAVED);
+    Section   fullSave{0, {}};
+    emitSave(fullSave, fullFrame);
+    emitRestore(fullSave, fullFrame);
+    // Stack space for the byte of sampled calls, which keeps the stack 16-byte aligned.
+    int32_t sampleSize   = sampling ? 16 : 0;
+    // Distance from the stack pointer to the byte of sampled calls while the injections run.
+    int32_t sampleOffset = passRegisters ? callRegistersSize : 0;
+    // Distance from the stack pointer to the return address while the injections run.
+    int32_t returnOffset = frame.size + sampleSize + (passRegisters ? callRegistersSize : 0);
+
+    Section &code  = ctx.generated;
+    size_t   entry = code.code.size();
+    emitSave(code, frame);
+    if (sampling) {
+        emitAdjustRsp(code, true, sampleSize);
+        emit(code, {0xc6, 0x04, 0x24, 0x00}); // mov byte [rsp], 0
+    }
+    if (passRegisters) {
+        emitAdjustRsp(code, true, callRegistersSize);
+        emitCallRegisters(code, true, true, true);
+        emit(code, {0x48, 0x8d, 0x84, 0x24}); // lea rax, [rsp+returnOffset+8]
+        emit32(code, returnOffset + 8);
+        emitMovRsp(code, true, 0, offsetof(CallRegisters, stack));
+    }
+    for (auto &injection : site.before) {
+        emitCall(ctx, injection);
+        if (sampling && injection.sampled) {
+            emit(code, {0x08, 0x84, 0x24}); // or [rsp+sampleOffset], al
+            emit32(code, sampleOffset);
+        }
+    }
+    if (site.after.size()) {
+        size_t skip = 0;
+        if (sampling) {
+            emit(code, {0x80, 0xbc, 0x24}); // cmp byte [rsp+sampleOffset], 0
+            emit32(code, sampleOffset);
+            emit(code, {0x00});
+            emit(code, {0x74, 0x00}); // je past the swap
+            skip = code.code.size();
+        }
+        emitMovRsp(code, false, 7, returnOffset); // mov rdi, [rsp+returnOffset]
+        emit(code, {0xe8});                       // call pushReturn
+        emitRel32(ctx, SECTION_GENERATED, Reloc::BRANCH32, SECTION_ABSOLUTE, (size_t)&pushReturn);
+        emit(code, {0x48, 0x8d, 0x05}); // lea rax, [rip+stub]
+        stubRef = ctx.reloc.size();
+        emitRel32(ctx, SECTION_GENERATED, Reloc::REL32, SECTION_GENERATED, 0);
+        emitMovRsp(code, true, 0, returnOffset); // mov [rsp+returnOffset], rax
+        if (sampling) {
+            code.code[skip - 1] = code.code.size() - skip;
+        }
+    }
+    if (passRegisters) {
+        emitCallRegisters(code, false, true, true);
+        emitAdjustRsp(code, false, callRegistersSize);
+    }
+    if (sampling) {
+        emitAdjustRsp(code, false, sampleSize);
+    }
+    emitRestore(code, frame);
+
+    size_t saveSize = code.code.size() - entry;
+    printf(
+        "Saving %d of %d registers: %zu bytes of trampoline and about %d cycles saved\n",
+        __builtin_popcountll(frame.regs),
+        __builtin_popcountll(fullFrame.regs),
+        fullSave.code.size() > saveSize ? fullSave.code.size() - saveSize : 0,
+        estimateSaveCycles(fullFrame) - estimateSaveCycles(frame)
+    );
+}
+
+// Append the return stub for after-injections, and point the relocation `stubRef` at it.
+// It is entered by the function's `ret` with the stack 16-byte aligned. The return values are live, and so is
+// nothing else that the injections may change; they are kept in a `CallRegisters` below a slot for the real
+// return address.
+static void emitReturnStub(InjectionCtx &ctx, InjectionSite const &site, size_t stubRef) {
+    Section &code      = ctx.generated;
+    bool     afterSimd = false;
+    for (auto &injection : site.after) {
+        afterSimd |= injection.usesSimd || injection.passRegisters;
+    }
+    ctx.reloc[stubRef].referenceOffset = code.code.size();
+    emit(code, {0x50}); // push rax (return address slot)
+    emitAdjustRsp(code, true, callRegistersSize + 8);
+    emitCallRegisters(code, true, false, afterSimd);
+    emit(code, {0x48, 0xc7, 0x84, 0x24}); // mov qword [rsp+stack], 0
+    emit32(code, offsetof(CallRegisters, stack));
+    emit32(code, 0);
+    for (auto &injection : site.after) {
+        emitCall(ctx, injection);
+    }
+    emit(code, {0xe8}); // call popReturn
+    emitRel32(ctx, SECTION_GENERATED, Reloc::BRANCH32, SECTION_ABSOLUTE, (size_t)&popReturn);
+    emitMovRsp(code, true, 0, callRegistersSize + 8); // mov [rsp+callRegistersSize+8], rax
+    emitCallRegisters(code, false, false, afterSimd);
+    emitAdjustRsp(code, false, callRegistersSize + 8);
+    emit(code, {0xc3}); // ret
 }
 
 // Generate code for all injections on a symbol.
+//
+// The first instructions of the function are replaced by a jump to the entry trampoline, which then runs the
+// replaced instructions and jumps back into the function. If the function is replaced, the entry jumps to the
+// replacement instead, directly if there are no other injections; the replaced instructions followed by the jump
+// back then form the original function, which the replacement can still call.
 bool doCodeGen(InjectionCtx &ctx, InjectionSite const &site) {
-    printf("Analyzing %s @ %p\n", site.symbol->st_name_str.c_str(), site.symbol->st_value_ptr);
     auto graph = X64Graph::analyze(*site.symbol);
-    return false;
+    printf(
+        "Analyzed %.*s @ %p: %zu bytes, %zu instructions in %zu blocks, %zu bytes of graph, %.1f us\n",
+        (int)site.symbol->st_name_str.size(),
+        site.symbol->st_name_str.data(),
+        site.symbol->st_value_ptr,
+        graph.length,
+        graph.insns.size(),
+        graph.blocks.size(),
+        graph.memoryUsage(),
+        graph.analysisTime
+    );
+    bool hasInjections = site.before.size() || site.after.size();
+    if (!hasInjections && !site.replacement) {
+        return true;
+    }
+
+    Section &code    = ctx.generated;
+    size_t   entry   = code.code.size();
+    size_t   stubRef = 0;
+    if (hasInjections) {
+        emitEntryTrampoline(ctx, site, graph, stubRef);
+        if (site.replacement) {
+            emit(code, {0xe9}); // jmp replacement
+            emitRel32(ctx, SECTION_GENERATED, Reloc::BRANCH32, SECTION_ABSOLUTE, (size_t)site.replacement);
+        }
+    }
+    SectionRef patch = ctx.patches.size();
+    EntryPatch entryPatch{NULL, patch, code.code.size(), {}};
+    size_t     patchLength = relocatePrologue(ctx, graph, entryPatch.boundaries);
+    if (!patchLength) {
+        return false;
+    }
+    if (site.original) {
+        ctx.exports.push_back(Export{site.original, entryPatch.original});
+    }
+    if (site.after.size()) {
+        emitReturnStub(ctx, site, stubRef);
+    }
+
+    // Replace the start of the function with a jump to the trampoline or the replacement.
+    ctx.patches.push_back(Section{(size_t)site.symbol->st_value_ptr, {0xe9}});
+    if (hasInjections) {
+        emitRel32(ctx, patch, Reloc::BRANCH32, SECTION_GENERATED, entry);
+    } else {
+        emitRel32(ctx, patch, Reloc::BRANCH32, SECTION_ABSOLUTE, (size_t)site.replacement);
+    }
+    ctx.patches[patch].code.resize(patchLength, 0xcc);
+    ctx.entries.push_back(std::move(entryPatch));
+
+    return true;
 }
 
 } // namespace coretorio::injection
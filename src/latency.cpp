@@ -0,0 +1,168 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+#include "injection_priv.hpp"
+#include "latency_priv.hpp"
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <vector>
+
+
+
+namespace coretorio::latency {
+
+// Histogram index of each probed symbol.
+static std::map<std::string, size_t> *probeIndex;
+// Sample interval of each probe, by histogram index.
+static uint32_t                       sampleIntervals[MAX_PROBES];
+// Guards `probeIndex`.
+static std::mutex                     probesMutex;
+
+// Add the counts of another histogram to this one.
+void Histogram::merge(Histogram const &other) {
+    for (size_t i = 0; i < BUCKETS; i++) {
+        counts[i] += other.counts[i];
+    }
+}
+
+// Get the number of values.
+uint64_t Histogram::total() const {
+    uint64_t total = 0;
+    for (size_t i = 0; i < BUCKETS; i++) {
+        total += counts[i];
+    }
+    return total;
+}
+
+// Get the lower bound of the bucket that the given fraction of values is at or below.
+uint64_t Histogram::percentile(double fraction) const {
+    uint64_t total = this->total();
+    if (!total) {
+        return 0;
+    }
+    uint64_t target = fraction * (total - 1);
+    uint64_t seen   = 0;
+    for (size_t i = 0; i < BUCKETS; i++) {
+        seen += counts[i];
+        if (seen > target) {
+            return lowerBound(i);
+        }
+    }
+    return lowerBound(BUCKETS - 1);
+}
+
+// Get an estimate of the sum of the values, from the lower bounds of their buckets.
+uint64_t Histogram::sum() const {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < BUCKETS; i++) {
+        sum += counts[i] * lowerBound(i);
+    }
+    return sum;
+}
+
+// Merge the histograms of one probe over all threads.
+static void mergeThreads(size_t index, Histogram &out) {
+    out = Histogram();
+    for (auto state = threadStates.load(std::memory_order_acquire); state; state = state->next) {
+        for (size_t i = 0; i < Histogram::BUCKETS; i++) {
+            out.counts[i] += __atomic_load_n(&state->histograms[index].counts[i], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Measure the time spent in one of Factorio's functions on a sample of its calls.
+bool probe(std::string const &symbolName, uint32_t sampleInterval) {
+    if (!object::findSymbol(symbolName)) {
+        printf("Error: Can't probe non-existent symbol `%s`\n", symbolName.c_str());
+        return false;
+    } else if (!sampleInterval || sampleInterval > 1u << 31) {
+        printf("Error: Sample interval of the probe for `%s` must be from 1 to 2^31\n", symbolName.c_str());
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(probesMutex);
+    if (!probeIndex) {
+        probeIndex = new std::map<std::string, size_t>();
+    }
+    if (probeIndex->count(symbolName)) {
+        return true;
+    } else if (probeIndex->size() >= MAX_PROBES) {
+        printf("Error: No probe left for `%s`\n", symbolName.c_str());
+        return false;
+    }
+    size_t index              = probeIndex->size();
+    (*probeIndex)[symbolName] = index;
+    sampleIntervals[index]    = sampleInterval;
+
+    // Calls that are not sampled only pay for the before-injection. The after-injection runs on every return of a
+    // sampled call, including through tail calls, because it replaces the return address; the depth of the return
+    // address stack pairs it up with the matching entry, also for recursive calls.
+    void *arg    = probeArgument(index, sampleInterval);
+    void *offset = (void *)(offsetof(ThreadLatency, histograms) + index * sizeof(Histogram));
+    injection::injectBefore(symbolName, injection::Injection((void *)&probeEnter, arg).withoutSimd().withSampling());
+    injection::injectAfter(symbolName, injection::Injection((void *)&probeExit, offset).withoutSimd().withSampling());
+    return true;
+}
+
+// Get the durations of the sampled calls to a probed function so far, merged over all threads.
+bool getHistogram(std::string const &symbolName, Histogram &out) {
+    std::lock_guard<std::mutex> lock(probesMutex);
+    if (!probeIndex || !probeIndex->count(symbolName)) {
+        return false;
+    }
+    mergeThreads((*probeIndex)[symbolName], out);
+    return true;
+}
+
+// Write a summary of the durations of every probed function, the most total time first.
+void dumpHistograms(FILE *to) {
+    std::lock_guard<std::mutex> lock(probesMutex);
+    if (!probeIndex) {
+        return;
+    }
+    struct Summary {
+        std::string_view name;
+        Histogram        histogram;
+        uint64_t         calls;
+        uint64_t         sum;
+    };
+    std::vector<Summary> summaries(probeIndex->size());
+    for (auto &pair : *probeIndex) {
+        Summary &summary = summaries[pair.second];
+        summary.name     = pair.first;
+        mergeThreads(pair.second, summary.histogram);
+        // Every sampled call stands for about as many calls as the sample interval.
+        summary.calls = summary.histogram.total() * sampleIntervals[pair.second];
+        summary.sum   = summary.histogram.sum() * sampleIntervals[pair.second];
+    }
+    std::sort(summaries.begin(), summaries.end(), [](Summary const &a, Summary const &b) { return a.sum > b.sum; });
+
+    fprintf(
+        to,
+        "%12s %14s %10s %10s %10s %10s  %s\n",
+        "calls",
+        "total cycles",
+        "p50",
+        "p90",
+        "p99",
+        "p99.9",
+        "function"
+    );
+    for (auto &summary : summaries) {
+        fprintf(
+            to,
+            "%12zu %14zu %10zu %10zu %10zu %10zu  %.*s\n",
+            (size_t)summary.calls,
+            (size_t)summary.sum,
+            (size_t)summary.histogram.percentile(0.5),
+            (size_t)summary.histogram.percentile(0.9),
+            (size_t)summary.histogram.percentile(0.99),
+            (size_t)summary.histogram.percentile(0.999),
+            (int)summary.name.size(),
+            summary.name.data()
+        );
+    }
+}
+
+} // namespace coretorio::latency
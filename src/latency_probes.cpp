@@ -0,0 +1,94 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+// The hot path of the latency probes, compiled with `-mgeneral-regs-only`.
+
+#include "injection_priv.hpp"
+#include "latency_priv.hpp"
+#include "thread_slots.hpp"
+
+
+
+namespace coretorio::latency {
+
+// All per-thread states, newest first; never freed.
+std::atomic<ThreadLatency *> threadStates;
+
+// This thread's state, NULL until it first enters a probed function.
+__attribute__((tls_model("initial-exec"))) static thread_local ThreadLatency *threadState;
+
+// Give this thread a state: one left by an exited thread, or a new one.
+// Returns NULL if there is no memory for it.
+static ThreadLatency *attachThread() {
+    ThreadLatency *state = threads::claimSlot(threadStates);
+    if (state) {
+        // The previous thread may have exited inside sampled calls; their entries are dropped. Any nonzero value will
+        // do as the seed of xorshift.
+        state->depth  = 0;
+        state->random = __builtin_ia32_rdtsc() | 1;
+        threadState   = state;
+    }
+    return state;
+}
+
+// Get a random number for spacing the samples.
+static uint32_t nextRandom(ThreadLatency *state) {
+    uint64_t value  = state->random;
+    value          ^= value << 13;
+    value          ^= value >> 7;
+    value          ^= value << 17;
+    state->random   = value;
+    return value >> 32;
+}
+
+// Decide whether to sample a call to a probed function, and if so record its entry time.
+bool probeEnter(void *probe) {
+    ThreadLatency *state = threadState;
+    if (__builtin_expect(!state, 0) && !(state = attachThread())) {
+        return false;
+    }
+    uint32_t &countdown = state->countdown[(uint32_t)(uintptr_t)probe];
+    if (__builtin_expect(countdown > 1, 1)) {
+        countdown--;
+        return false;
+    }
+    // The intervals between samples are random with the given mean, so that sampling doesn't fall into step with a
+    // repeating pattern of calls.
+    uint32_t interval = (uintptr_t)probe >> 32;
+    countdown         = 1 + ((uint64_t)nextRandom(state) * (2 * (uint64_t)interval - 1) >> 32);
+    if (state->depth >= ThreadLatency::STACK_SIZE) {
+        return false;
+    }
+    state->stack[state->depth++] = {__builtin_ia32_rdtsc(), injection::returnDepth};
+    return true;
+}
+
+// Record the duration of a sampled call to a probed function.
+void probeExit(void *histogram) {
+    // `lfence` waits for the function's instructions to finish first, and costs less than `rdtscp`.
+    uint32_t low, high;
+    asm volatile("lfence\n\trdtsc" : "=a"(low), "=d"(high));
+    uint64_t       now   = (uint64_t)high << 32 | low;
+    ThreadLatency *state = threadState;
+    if (!state) {
+        return;
+    }
+    // Calls that were left without returning, such as by `longjmp`, are dropped. The exit of a call that this probe
+    // did not sample has no entry; it runs if another injection on the function sampled the call.
+    size_t entryDepth = injection::returnDepth - 1;
+    size_t depth      = state->depth;
+    while (depth && state->stack[depth - 1].returnDepth > entryDepth) {
+        depth--;
+    }
+    if (!depth || state->stack[depth - 1].returnDepth != entryDepth) {
+        state->depth = depth;
+        return;
+    }
+    state->depth = --depth;
+    // Only this thread writes its histograms; the store is still a single one so that readers never see a torn count.
+    Histogram *hist  = (Histogram *)((uint8_t *)state + (size_t)histogram);
+    uint64_t  *count = &hist->counts[Histogram::bucketOf(now - state->stack[depth].time)];
+    __atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+}
+
+} // namespace coretorio::latency
@@ -0,0 +1,111 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+#include "code_arena.hpp"
+#include "injection_priv.hpp"
+
+#include <string.h>
+#include <unordered_map>
+
+
+
+namespace coretorio::injection {
+
+// Size of a veneer: `jmp [rip+0]` followed by the 64-bit destination, padded to 16 bytes.
+static constexpr size_t VENEER_SIZE = 16;
+
+// Whether a value fits in a signed integer of some number of bits.
+static bool fitsSigned(int64_t value, int bits) {
+    return value >= -((int64_t)1 << (bits - 1)) && value < ((int64_t)1 << (bits - 1));
+}
+
+// Whether a relocation is a branch to a fixed address, which can go through a veneer in the generated code.
+static bool mayUseVeneer(Reloc const &reloc) {
+    return reloc.type == Reloc::BRANCH32 && reloc.reference != SECTION_GENERATED;
+}
+
+// Apply this relocation with the referenced address `symbol`, returns false if the value does not fit.
+bool Reloc::apply(InjectionCtx &ctx, size_t symbol) const {
+    Section &sect  = ctx.getSection(target);
+    size_t   place = sect.addr + targetOffset;
+    int64_t  value = (int64_t)(symbol + addend);
+    if (type != ABS64) {
+        value -= (int64_t)place;
+    }
+    switch (type) {
+        case REL8: {
+            if (!fitsSigned(value, 8)) {
+                return false;
+            }
+            sect.code[targetOffset] = (uint8_t)value;
+            return true;
+        }
+        case BRANCH32:
+        case REL32: {
+            if (!fitsSigned(value, 32)) {
+                return false;
+            }
+            int32_t rel32 = (int32_t)value;
+            memcpy(&sect.code[targetOffset], &rel32, 4);
+            return true;
+        }
+        case ABS64: memcpy(&sect.code[targetOffset], &value, 8); return true;
+    }
+    return false;
+}
+
+// Place the generated code in executable memory, add veneers for branches that are out of range
+// and apply all relocations.
+//
+// Branches to a fixed address (Factorio's code, injected functions, replacements) may be out of rel32 range;
+// the code arena is placed near Factorio's code, but other libraries can be anywhere. Space for one veneer per
+// distinct destination is reserved after the code, so that veneers are always in range of the branches using them;
+// it is only filled if needed.
+bool link(InjectionCtx &ctx, CodeArena &arena) {
+    Section &code = ctx.generated;
+
+    // Find the destinations that may need a veneer; their addresses are known before layout.
+    std::unordered_map<size_t, size_t> veneers;
+    for (auto const &reloc : ctx.reloc) {
+        if (mayUseVeneer(reloc)) {
+            veneers.emplace(ctx.addressOf(reloc.reference, reloc.referenceOffset), 0);
+        }
+    }
+
+    // Lay out the generated code.
+    size_t veneerBase = (code.code.size() + VENEER_SIZE - 1) & ~(VENEER_SIZE - 1);
+    code.addr         = arena.alloc(veneerBase + veneers.size() * VENEER_SIZE);
+    if (!code.addr) {
+        return false;
+    }
+    code.code.resize(veneerBase, 0xcc);
+
+    // Apply all relocations in one pass, adding veneers as needed.
+    size_t veneerCount = 0;
+    for (auto const &reloc : ctx.reloc) {
+        size_t symbol = ctx.addressOf(reloc.reference, reloc.referenceOffset);
+        if (reloc.apply(ctx, symbol)) {
+            continue;
+        }
+        if (!mayUseVeneer(reloc)) {
+            printf("Relocation out of range at %p\n", (void *)(ctx.addressOf(reloc.target, reloc.targetOffset)));
+            return false;
+        }
+        size_t &veneer = veneers[symbol];
+        if (!veneer) {
+            veneer = code.addr + code.code.size();
+            code.code.insert(code.code.end(), {0xff, 0x25, 0, 0, 0, 0}); // jmp [rip+0]
+            code.code.insert(code.code.end(), (uint8_t *)&symbol, (uint8_t *)&symbol + 8);
+            code.code.resize(code.code.size() + VENEER_SIZE - 14, 0xcc);
+            veneerCount++;
+        }
+        if (!reloc.apply(ctx, veneer)) {
+            return false;
+        }
+    }
+
+    printf("Linked %zu relocations with %zu veneers\n", ctx.reloc.size(), veneerCount);
+    return true;
+}
+
+} // namespace coretorio::injection
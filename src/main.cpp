@@ -1,11 +1,13 @@
 // Copyright © 2024, Julian Scheffers
 // SPDX-License-Identifier: MIT
 
+#include "coremods.hpp"
 #include "injection_priv.hpp"
 #include "object.hpp"
 
-#include <sys/mman.h>
-#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #define CONSTRUCTOR __attribute__((constructor))
 #define CXX11       __attribute__((abi_tag("cxx11")))
@@ -13,8 +15,33 @@
 namespace coretorio::main {
 using object::Symbol;
 
-static void myInjectedFunction() {
-    printf("You opened the about GUI!\n");
+// Does nothing; injected to measure what injections cost.
+static void emptyInjection() {
+}
+
+// Inject `emptyInjection` into every symbol listed in a file, one per line.
+// Set by the CORETORIO_INJECT_EMPTY environment variable, for benchmarks; does nothing if it is not set.
+static void injectEmpty() {
+    char const *path = getenv("CORETORIO_INJECT_EMPTY");
+    if (!path) {
+        return;
+    }
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        perror("Opening CORETORIO_INJECT_EMPTY file failed");
+        return;
+    }
+    char   line[1024];
+    size_t count = 0;
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\r\n")] = 0;
+        if (*line) {
+            injection::injectBefore(line, injection::Injection((void *)&emptyInjection, NULL).withoutSimd());
+            count++;
+        }
+    }
+    fclose(file);
+    printf("Injecting into %zu symbols listed in %s\n", count, path);
 }
 
 // The primary entrypoint for CoreTorio.
@@ -26,21 +53,17 @@ CONSTRUCTOR static void entrypoint() {
     }
     injection::init();
     printf("Loading coremods...\n");
+    bool modsLoaded = coremods::loadAll(coremods::directory());
+    injectEmpty();
 
-    void *dummy = mmap(NULL, 1024, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_SHARED, -1, 0);
-    printf("%p\n", dummy);
-
-    // Test: Let's do something on the `AboutGui()` constructor.
-    injection::injectBefore("_ZN8AboutGuiC1Ev", myInjectedFunction);
-
-    // Perform the injections and see what happens.
-    if (injection::performInjections()) {
-        printf("CoreTorio finished.\n");
-    } else {
+    // The injections of all coremods are performed together.
+    if (!injection::performInjections()) {
         printf("CoreTorio failed, no mods were loaded.\n");
+    } else if (!modsLoaded) {
+        printf("CoreTorio finished, but not all coremods were loaded.\n");
+    } else {
+        printf("CoreTorio finished.\n");
     }
-
-    _exit(0);
 }
 
 } // namespace coretorio::main
@@ -0,0 +1,39 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+#include "memory_map.hpp"
+
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+
+
+namespace coretorio::injection {
+
+// Read the mappings of this process from /proc/self/maps, sorted by address.
+std::vector<Mapping> readMemoryMap() {
+    std::vector<Mapping> mappings;
+    FILE                *maps = fopen("/proc/self/maps", "r");
+    if (!maps) {
+        perror("Opening /proc/self/maps failed");
+        return mappings;
+    }
+    size_t start, end;
+    char   perms[5];
+    while (fscanf(maps, "%zx-%zx %4s%*[^\n]\n", &start, &end, perms) == 3) {
+        int prot = (perms[0] == 'r' ? PROT_READ : 0) | (perms[1] == 'w' ? PROT_WRITE : 0)
+                   | (perms[2] == 'x' ? PROT_EXEC : 0);
+        mappings.push_back(Mapping{start, end, prot});
+    }
+    fclose(maps);
+    return mappings;
+}
+
+// Get the page size.
+size_t pageSize() {
+    static size_t const size = sysconf(_SC_PAGESIZE);
+    return size;
+}
+
+} // namespace coretorio::injection
@@ -1,23 +1,42 @@
 // Copyright © 2024, Julian Scheffers
 // SPDX-License-Identifier: MIT
 
+#include "address_index.hpp"
 #include "object.hpp"
+#include "parallel.hpp"
+#include "symbol_cache.hpp"
+#include "symbol_index.hpp"
+#include "timings.hpp"
 
+#include <atomic>
+#include <chrono>
 #include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <link.h>
 #include <map>
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#include <vector>
 
 
 namespace coretorio::object {
 
 // Map of sections found in the Factorio executable.
-static std::map<std::string, Section> *sections;
-// Map of symbols found in the Factorio executable.
-static std::map<std::string, Symbol>  *symbols;
+static std::map<std::string_view, Section> *sections;
+// Index of symbols found in the Factorio executable.
+static SymbolIndex                         *symbols;
+// Index of function address ranges in the Factorio executable.
+static AddressIndex                        *functions;
+
+// Read-only mapping of the Factorio executable.
+static uint8_t const *image;
+// Size of the Factorio executable mapping.
+static size_t         image_size;
 
 // Set to true if CoreTorio successfully injected into Factorio.
 bool success;
@@ -46,9 +65,50 @@ static void fail(char const *fmt, ...) {
     _exit(1);
 }
 
-// Print failure message for out of memory.
-static void oom_fail(char const *purpose, size_t cap) {
-    fail("Out of memory (allocating %zu bytes for %s)", cap, purpose);
+// Whether a range of the executable file lies within the mapping.
+static bool in_image(size_t offset, size_t size) {
+    return offset <= image_size && size <= image_size - offset;
+}
+
+// Get a section's contents in the mapped executable, NULL if it has none or it is out of bounds.
+static void const *section_data(Elf64_Shdr const &shdr) {
+    if (shdr.sh_type == SHT_NOBITS || !shdr.sh_size || !in_image(shdr.sh_offset, shdr.sh_size)) {
+        return NULL;
+    }
+    return image + shdr.sh_offset;
+}
+
+// Ask the kernel to start reading in a section's contents.
+static void prefetch_image(Elf64_Shdr const &shdr) {
+    size_t page  = getpagesize();
+    size_t start = shdr.sh_offset & ~(page - 1);
+    madvise((void *)(image + start), shdr.sh_offset + shdr.sh_size - start, MADV_WILLNEED);
+}
+
+// Build the map of sections from a section header table.
+static bool read_sections(CachedSections const &table, size_t l_addr) {
+    if (!table.names || table.names[table.namesSize - 1]) {
+        fail("Invalid .shstrtab");
+        return false;
+    }
+    for (size_t i = 0; i < table.shnum; i++) {
+        if (table.shdrs[i].sh_name >= table.namesSize) {
+            fail("Section name out of bounds");
+            return false;
+        }
+        struct Section sect;
+        static_cast<Elf64_Shdr &>(sect) = table.shdrs[i];
+        sect.sh_name_str                = table.names + table.shdrs[i].sh_name;
+        sect.sh_addr_ptr                = table.shdrs[i].sh_addr ? (void *)(table.shdrs[i].sh_addr + l_addr) : 0;
+        sect.sh_data_ptr                = section_data(table.shdrs[i]);
+        sections->emplace(sect.sh_name_str, sect);
+    }
+    return true;
+}
+
+// Milliseconds elapsed since a point in time.
+static double elapsed_ms(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
 }
 
 // Find the game executable.
@@ -58,6 +118,8 @@ static char const *get_game_path() {
 
 // Interpret the ELF file and determine the locations of sections and symbols.
 bool interpret_elf() {
+    auto start = std::chrono::steady_clock::now();
+
     // Get game executable offset.
     void *game_handle = dlopen(NULL, RTLD_NOW | RTLD_NOLOAD);
     if (!game_handle) {
@@ -73,96 +135,97 @@ bool interpret_elf() {
 
 
     // Allocate memory.
-    sections = new std::map<std::string, struct Section>();
-    symbols  = new std::map<std::string, struct Symbol>();
+    sections  = new std::map<std::string_view, struct Section>();
+    symbols   = new SymbolIndex();
+    functions = new AddressIndex();
 
 
-    // Open the executable file and read the header.
+    // Map the executable file read-only; everything below is a view into it.
     char const *game_path = get_game_path();
     if (!game_path) {
         fail("Finding game executable failed");
         return false;
     }
-    FILE *game_fd = fopen(game_path, "r");
-    if (!game_fd) {
+    int game_fd = open(game_path, O_RDONLY | O_CLOEXEC);
+    if (game_fd < 0) {
         fail("Opening game executable failed");
         return false;
     }
-    Elf64_Ehdr header;
-    if (fread(&header, 1, sizeof(Elf64_Ehdr), game_fd) != sizeof(Elf64_Ehdr)) {
-        fail("Reading ELF header failed");
+    struct stat game_stat;
+    if (fstat(game_fd, &game_stat)) {
+        fail("Reading game executable size failed");
+        return false;
+    } else if ((size_t)game_stat.st_size < sizeof(Elf64_Ehdr)) {
+        fail("Game executable too small");
+        return false;
+    }
+    image_size = game_stat.st_size;
+    image      = (uint8_t const *)mmap(NULL, image_size, PROT_READ, MAP_PRIVATE, game_fd, 0);
+    close(game_fd);
+    if (image == MAP_FAILED) {
+        image = NULL;
+        fail("Mapping game executable failed");
         return false;
     }
 
-    if (memcmp(header.e_ident, ELFMAG, 4)) {
+    auto header = (Elf64_Ehdr const *)image;
+    if (memcmp(header->e_ident, ELFMAG, 4)) {
         fail("Invalid ELF magic");
         return false;
-    } else if (header.e_ident[EI_CLASS] != 2) {
+    } else if (header->e_ident[EI_CLASS] != 2) {
         fail("Invalid ELF class");
         return false;
-    } else if (header.e_ident[EI_DATA] != 1) {
+    } else if (header->e_ident[EI_DATA] != 1) {
         fail("Invalid ELF endianness");
         return false;
-    } else if (header.e_ident[EI_VERSION] != 1) {
+    } else if (header->e_ident[EI_VERSION] != 1) {
         fail("Invalid ELF version");
         return false;
     }
 
 
+    // Load the sections and symbols from the symbol cache if it matches this executable.
+    CacheKey cache_key;
+    getCacheKey(cache_key, image, image_size, game_stat);
+    CachedSections cached_sections;
+    if (loadSymbolCache(cache_key, game_link->l_addr, cached_sections, *symbols, *functions)) {
+        if (!read_sections(cached_sections, game_link->l_addr)) {
+            return false;
+        }
+        printf("Loaded %zu symbols from cache in %.2f ms (warm start)\n", symbols->count, elapsed_ms(start));
+        timings::recordPhase("interpret_elf", elapsed_ms(start));
+        return true;
+    }
+
+
     // Build the map of sections.
-    if (header.e_shstrndx == SHN_UNDEF) {
+    if (header->e_shstrndx == SHN_UNDEF) {
         fail("No .shstrtab");
         return false;
-    } else if (header.e_shentsize != sizeof(Elf64_Shdr)) {
+    } else if (header->e_shentsize != sizeof(Elf64_Shdr)) {
         fail("Section header entry size invalid");
         return false;
-    } else if (header.e_shnum == 0) {
+    } else if (header->e_shnum == 0) {
         fail("No section headers");
         return false;
-    }
-
-    // Read section header table.
-    auto shdrs = (Elf64_Shdr *)malloc(sizeof(Elf64_Shdr) * header.e_shnum);
-    fseek(game_fd, header.e_shoff, SEEK_SET);
-    if (!shdrs) {
-        oom_fail("section headers", sizeof(Elf64_Shdr) * header.e_shnum);
+    } else if (!in_image(header->e_shoff, sizeof(Elf64_Shdr) * header->e_shnum)) {
+        fail("Section headers out of bounds");
         return false;
-    } else if (fread(shdrs, 1, sizeof(Elf64_Shdr) * header.e_shnum, game_fd) != sizeof(Elf64_Shdr) * header.e_shnum) {
-        fail("Reading section headers failed");
+    } else if (header->e_shstrndx >= header->e_shnum) {
+        fail("Invalid .shstrtab index");
         return false;
     }
 
-    // Read section header string table.
-    auto shdr_names = (char *)malloc(shdrs[header.e_shstrndx].sh_size);
-    fseek(game_fd, shdrs[header.e_shstrndx].sh_offset, SEEK_SET);
-    if (!shdr_names) {
-        oom_fail("section header names", shdrs[header.e_shstrndx].sh_size);
-        return false;
-    } else if (fread(shdr_names, 1, shdrs[header.e_shstrndx].sh_size, game_fd) != shdrs[header.e_shstrndx].sh_size) {
-        fail("Reading section header names failed");
+    // Section header table and section header string table.
+    CachedSections sect_table;
+    sect_table.shdrs     = (Elf64_Shdr const *)(image + header->e_shoff);
+    sect_table.shnum     = header->e_shnum;
+    sect_table.names     = (char const *)section_data(sect_table.shdrs[header->e_shstrndx]);
+    sect_table.namesSize = sect_table.shdrs[header->e_shstrndx].sh_size;
+    if (!read_sections(sect_table, game_link->l_addr)) {
         return false;
     }
 
-    // Read section table.
-    for (Elf64_Half i = 0; i < header.e_shnum; i++) {
-        struct Section sect;
-        sect.sh_name_str  = shdr_names + shdrs[i].sh_name;
-        sect.sh_addr_ptr  = shdrs[i].sh_addr ? (void *)(shdrs[i].sh_addr + game_link->l_addr) : 0;
-        sect.sh_name      = shdrs[i].sh_name;
-        sect.sh_type      = shdrs[i].sh_type;
-        sect.sh_flags     = shdrs[i].sh_flags;
-        sect.sh_addr      = shdrs[i].sh_addr;
-        sect.sh_offset    = shdrs[i].sh_offset;
-        sect.sh_size      = shdrs[i].sh_size;
-        sect.sh_link      = shdrs[i].sh_link;
-        sect.sh_info      = shdrs[i].sh_info;
-        sect.sh_addralign = shdrs[i].sh_addralign;
-        sect.sh_entsize   = shdrs[i].sh_entsize;
-        sections->emplace(sect.sh_name_str, sect);
-    }
-    free(shdr_names);
-    free(shdrs);
-
 
     // Build the map of symbols.
     if (sections->find(".strtab") == sections->end()) {
@@ -177,59 +240,132 @@ bool interpret_elf() {
     auto &&strtab = (*sections)[".strtab"];
     if (symtab.sh_entsize != sizeof(Elf64_Sym)) {
         fail("Invalid .symtab entry size");
+        return false;
     }
 
-
-    // Read symbol header table.
-    auto syms = (Elf64_Sym *)malloc(symtab.sh_size);
-    fseek(game_fd, symtab.sh_offset, SEEK_SET);
+    auto syms      = (Elf64_Sym const *)symtab.sh_data_ptr;
+    auto sym_names = (char const *)strtab.sh_data_ptr;
     if (!syms) {
-        oom_fail("symbol table", symtab.sh_size);
+        fail("Symbol table out of bounds");
         return false;
-    } else if (fread(syms, 1, symtab.sh_size, game_fd) != symtab.sh_size) {
-        fail("Reading symbol table failed");
+    } else if (!sym_names || sym_names[strtab.sh_size - 1]) {
+        fail("Invalid .strtab");
         return false;
     }
 
-    // Read symbol header string table.
-    auto sym_names = (char *)malloc(strtab.sh_size);
-    fseek(game_fd, strtab.sh_offset, SEEK_SET);
-    if (!sym_names) {
-        oom_fail("symbol names", strtab.sh_size);
+    // Start reading in the symbol and string tables before they are walked.
+    prefetch_image(symtab);
+    prefetch_image(strtab);
+
+    // Read symbol table in chunks on the worker pool.
+    // Each chunk is counted first, so every symbol's position in the final table is known up front
+    // and the result does not depend on the order the chunks are processed in.
+    constexpr size_t      chunk_size = 16384;
+    size_t                sym_count  = symtab.sh_size / symtab.sh_entsize;
+    size_t                chunks     = (sym_count + chunk_size - 1) / chunk_size;
+    std::vector<uint32_t> chunk_pos(chunks + 1);
+    std::atomic_bool      bad_name{false};
+    parallel::forEach(chunks, [&](size_t chunk) {
+        size_t end   = chunk * chunk_size + chunk_size < sym_count ? chunk * chunk_size + chunk_size : sym_count;
+        size_t named = 0;
+        for (size_t i = chunk * chunk_size; i < end; i++) {
+            if (syms[i].st_name >= strtab.sh_size) {
+                bad_name = true;
+            }
+            named += syms[i].st_name != 0;
+        }
+        chunk_pos[chunk + 1] = named;
+    });
+    if (bad_name) {
+        fail("Symbol name out of bounds");
         return false;
-    } else if (fread(sym_names, 1, strtab.sh_size, game_fd) != strtab.sh_size) {
-        fail("Reading symbol names failed");
+    }
+    for (size_t chunk = 0; chunk < chunks; chunk++) {
+        chunk_pos[chunk + 1] += chunk_pos[chunk];
+    }
+    if (chunk_pos[chunks] >= SymbolIndex::EMPTY) {
+        fail("Too many symbols");
         return false;
     }
 
-    // Read symbol table.
-    for (Elf64_Word i = 0; i < symtab.sh_size / symtab.sh_entsize; i++) {
-        struct Symbol sym;
-        sym.st_name_str  = sym_names + syms[i].st_name;
-        sym.st_value_ptr = syms[i].st_value ? (void *)(syms[i].st_value + game_link->l_addr) : 0;
-        sym.st_name      = syms[i].st_name;
-        sym.st_info      = syms[i].st_info;
-        sym.st_other     = syms[i].st_other;
-        sym.st_shndx     = syms[i].st_shndx;
-        sym.st_value     = syms[i].st_value;
-        sym.st_size      = syms[i].st_size;
-        symbols->emplace(sym.st_name_str, sym);
+    // Convert the symbols and hash their names.
+    std::vector<Symbol>   sym_list(chunk_pos[chunks]);
+    std::vector<uint64_t> sym_hashes(chunk_pos[chunks]);
+    size_t                l_addr = game_link->l_addr;
+    parallel::forEach(chunks, [&](size_t chunk) {
+        size_t end = chunk * chunk_size + chunk_size < sym_count ? chunk * chunk_size + chunk_size : sym_count;
+        size_t pos = chunk_pos[chunk];
+        for (size_t i = chunk * chunk_size; i < end; i++) {
+            if (!syms[i].st_name) {
+                continue;
+            }
+            struct Symbol &sym            = sym_list[pos];
+            static_cast<Elf64_Sym &>(sym) = syms[i];
+            sym.st_name_str               = sym_names + syms[i].st_name;
+            sym.st_value_ptr              = syms[i].st_value ? (void *)(syms[i].st_value + l_addr) : 0;
+            sym_hashes[pos++]             = hashName(sym.st_name_str);
+        }
+    });
+
+    // Build the symbol indices.
+    auto index_start = std::chrono::steady_clock::now();
+    symbols->build(std::move(sym_list), sym_hashes);
+    functions->build(symbols->symbols, symbols->count);
+    timings::recordPhase("index_build", elapsed_ms(index_start));
+    printf(
+        "Parsed %zu symbols in %.2f ms using %zu threads (cold start)\n",
+        symbols->count,
+        elapsed_ms(start),
+        parallel::threadCount()
+    );
+
+    // Save them for the next start.
+    auto cache_start = std::chrono::steady_clock::now();
+    if (saveSymbolCache(cache_key, game_link->l_addr, sect_table, {sym_names, strtab.sh_size}, *symbols, *functions)) {
+        printf("Wrote symbol cache in %.2f ms\n", elapsed_ms(cache_start));
+    } else {
+        printf("Writing symbol cache failed\n");
     }
-    free(syms);
-    free(sym_names);
-    fclose(game_fd);
+    timings::recordPhase("symbol_cache_save", elapsed_ms(cache_start));
+    timings::recordPhase("interpret_elf", elapsed_ms(start));
 
     return true;
 }
 
 
-// Find a symbol.
-Symbol *findSymbol(std::string const &name) {
-    auto res = symbols->find(name);
-    if (res == symbols->end()) {
+// Find a section.
+Section *findSection(std::string_view name) {
+    auto res = sections->find(name);
+    if (res == sections->end()) {
         return NULL;
     }
     return &res->second;
 }
 
+// Find a symbol.
+Symbol const *findSymbol(std::string_view name) {
+    return symbols->find(name);
+}
+
+// Find the function containing an address.
+Symbol const *findSymbolByAddress(void const *addr) {
+    ptrdiff_t index = functions->find((uint64_t)addr);
+    return index < 0 ? NULL : &symbols->symbols[index];
+}
+
+// Find the start of the first function after an address.
+void *findNextFunction(void const *addr) {
+    return (void *)functions->findNextStart((uint64_t)addr);
+}
+
+// Find many symbols in one pass.
+size_t findSymbols(std::string_view const *names, Symbol const **out, size_t count) {
+    return symbols->findMany(names, out, count);
+}
+
+// Find many symbols with precomputed hashes in one pass.
+size_t findSymbols(std::string_view const *names, uint64_t const *hashes, Symbol const **out, size_t count) {
+    return symbols->findMany(names, hashes, out, count);
+}
+
 } // namespace coretorio::object
@@ -0,0 +1,57 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+#include "parallel.hpp"
+
+#include <atomic>
+#include <stdlib.h>
+#include <thread>
+#include <vector>
+
+
+
+namespace coretorio::parallel {
+
+// Number of threads to use for parallel work.
+size_t threadCount() {
+    static size_t count = [] {
+        if (char const *env = getenv("CORETORIO_THREADS")) {
+            long value = strtol(env, NULL, 0);
+            if (value > 0) {
+                return (size_t)value;
+            }
+        }
+        size_t cpus = std::thread::hardware_concurrency();
+        return cpus < 1 ? 1 : cpus > 8 ? 8 : cpus;
+    }();
+    return count;
+}
+
+// Run `func(i)` for every `i` in [0, count) on a pool of worker threads and wait for all of them to finish.
+void forEach(size_t count, std::function<void(size_t)> const &func) {
+    size_t threads = threadCount() < count ? threadCount() : count;
+    if (threads <= 1) {
+        for (size_t i = 0; i < count; i++) {
+            func(i);
+        }
+        return;
+    }
+
+    std::atomic_size_t next{0};
+    auto               worker = [&] {
+        for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < count;) {
+            func(i);
+        }
+    };
+    std::vector<std::thread> pool;
+    pool.reserve(threads - 1);
+    for (size_t i = 0; i < threads - 1; i++) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (auto &thread : pool) {
+        thread.join();
+    }
+}
+
+} // namespace coretorio::parallel
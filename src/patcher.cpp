@@ -0,0 +1,118 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+#include "memory_map.hpp"
+#include "patcher.hpp"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+
+
+
+namespace coretorio::injection {
+
+// A range of pages that share a protection.
+struct PageRange {
+    // Start address, page aligned.
+    size_t start;
+    // End address, page aligned.
+    size_t end;
+    // Protection before patching.
+    int    prot;
+};
+
+// Get the page ranges covered by the patches, merged and split by their current protection.
+static std::vector<PageRange> getPageRanges(std::vector<Section const *> const &sorted) {
+    size_t                 page = pageSize();
+    std::vector<PageRange> ranges;
+    for (auto patch : sorted) {
+        size_t start = patch->addr & ~(page - 1);
+        size_t end   = (patch->addr + patch->code.size() + page - 1) & ~(page - 1);
+        if (ranges.size() && start <= ranges.back().end) {
+            ranges.back().end = end > ranges.back().end ? end : ranges.back().end;
+        } else {
+            ranges.push_back(PageRange{start, end, 0});
+        }
+    }
+
+    // Split the ranges where the mappings they are in have a different protection.
+    auto                   mappings = readMemoryMap();
+    std::vector<PageRange> split;
+    auto                   mapping  = mappings.begin();
+    for (auto const &range : ranges) {
+        size_t addr = range.start;
+        while (addr < range.end) {
+            while (mapping != mappings.end() && mapping->end <= addr) {
+                ++mapping;
+            }
+            if (mapping == mappings.end() || mapping->start > addr) {
+                // Not in the map; assume it is ordinary code.
+                size_t end = mapping == mappings.end() || mapping->start > range.end ? range.end : mapping->start;
+                split.push_back(PageRange{addr, end, PROT_READ | PROT_EXEC});
+                addr = end;
+                continue;
+            }
+            size_t end = mapping->end < range.end ? mapping->end : range.end;
+            if (split.size() && split.back().end == addr && split.back().prot == mapping->prot) {
+                split.back().end = end;
+            } else {
+                split.push_back(PageRange{addr, end, mapping->prot});
+            }
+            addr = end;
+        }
+    }
+    return split;
+}
+
+// Write patches into existing code.
+bool installPatches(std::vector<Section> const &patches, PatchStats &stats) {
+    auto startTime = std::chrono::steady_clock::now();
+    stats          = PatchStats();
+    stats.patches  = patches.size();
+
+    std::vector<Section const *> sorted;
+    sorted.reserve(patches.size());
+    for (auto &patch : patches) {
+        if (patch.code.size()) {
+            sorted.push_back(&patch);
+        }
+    }
+    std::sort(sorted.begin(), sorted.end(), [](Section const *a, Section const *b) { return a->addr < b->addr; });
+    auto ranges = getPageRanges(sorted);
+
+    // Make all touched pages writable, write the patches and restore the protection.
+    bool success = true;
+    for (auto &range : ranges) {
+        stats.pages += (range.end - range.start) / pageSize();
+        stats.syscalls++;
+        // Keep the pages executable if the system allows it, so code that shares a page with a patch keeps running.
+        int  prot = PROT_READ | PROT_WRITE | (range.prot & PROT_EXEC);
+        bool fail = mprotect((void *)range.start, range.end - range.start, prot);
+        if (fail && errno == EACCES && (prot & PROT_EXEC)) {
+            stats.syscalls++;
+            fail = mprotect((void *)range.start, range.end - range.start, PROT_READ | PROT_WRITE);
+        }
+        if (fail) {
+            perror("Making code writeable failed");
+            success = false;
+        }
+    }
+    if (success) {
+        for (auto patch : sorted) {
+            memcpy((void *)patch->addr, patch->code.data(), patch->code.size());
+        }
+    }
+    for (auto &range : ranges) {
+        stats.syscalls++;
+        if (mprotect((void *)range.start, range.end - range.start, range.prot)) {
+            perror("Restoring code protection failed");
+            success = false;
+        }
+    }
+
+    stats.time = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+    return success;
+}
+
+} // namespace coretorio::injection
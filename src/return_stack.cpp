@@ -0,0 +1,38 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+// The per-thread stack of return addresses used by after-injections, compiled with `-mgeneral-regs-only`.
+
+#include "injection_priv.hpp"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+
+
+namespace coretorio::injection {
+
+// Size of the per-thread stack of return addresses.
+static constexpr size_t returnStackSize = 1024;
+// Per-thread stack of the real return addresses of running functions with after-injections.
+__attribute__((tls_model("initial-exec"))) static thread_local void  *returnStack[returnStackSize];
+// Number of entries in `returnStack`.
+__attribute__((tls_model("initial-exec"))) thread_local size_t        returnDepth;
+
+// Remember the real return address of a function with after-injections; called from generated code.
+void pushReturn(void *addr) {
+    if (returnDepth >= returnStackSize) {
+        // `write` is only a system call, unlike stdio which may use vector registers.
+        static char const message[] = "CoreTorio: Injection return stack overflow\n";
+        write(STDERR_FILENO, message, sizeof(message) - 1);
+        abort();
+    }
+    returnStack[returnDepth++] = addr;
+}
+
+// Get back the real return address of a function with after-injections; called from generated code.
+void *popReturn() {
+    return returnStack[--returnDepth];
+}
+
+} // namespace coretorio::injection
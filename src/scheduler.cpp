@@ -0,0 +1,503 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+#include "scheduler.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <immintrin.h>
+#include <mutex>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string_view>
+#include <thread>
+
+
+
+namespace coretorio::scheduler {
+using detail::Task;
+using Clock = std::chrono::steady_clock;
+
+// How long an idle worker keeps looking for work before it goes to sleep.
+static constexpr auto   SPIN_TIME = std::chrono::microseconds(50);
+// Most tasks a worker moves from the shared queue to its own at once, for the other workers to steal.
+static constexpr size_t BATCH     = 16;
+
+// Queue of tasks owned by one worker, which pushes and pops at the bottom while other threads steal from the top
+// (Chase-Lev, with the memory orders of Lê et al., "Correct and Efficient Work-Stealing for Weak Memory Models").
+// It does not grow; tasks that do not fit go on the shared queue.
+struct WorkDeque {
+    // Number of tasks that fit.
+    static constexpr int64_t CAPACITY = 4096;
+
+    // Index of the oldest task; only increases.
+    alignas(64) std::atomic_int64_t top{0};
+    // Index past the newest task.
+    alignas(64) std::atomic_int64_t bottom{0};
+    // Tasks by index modulo `CAPACITY`.
+    std::atomic<Task *>             buffer[CAPACITY];
+
+    // Add a task at the bottom; owner only. Returns false if the queue is full.
+    bool push(Task *task) {
+        int64_t b = bottom.load(std::memory_order_relaxed);
+        int64_t t = top.load(std::memory_order_acquire);
+        if (b - t >= CAPACITY) {
+            return false;
+        }
+        buffer[b % CAPACITY].store(task, std::memory_order_relaxed);
+        bottom.store(b + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Take the newest task; owner only.
+    Task *pop() {
+        int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = top.load(std::memory_order_relaxed);
+        if (t > b) {
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return NULL;
+        }
+        Task *task = buffer[b % CAPACITY].load(std::memory_order_relaxed);
+        if (t == b) {
+            // The last task; a thief may be taking it at the same time.
+            if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                task = NULL;
+            }
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return task;
+    }
+
+    // Take the oldest task; any thread. Returns NULL if the queue is empty or another thread got the task first.
+    Task *steal() {
+        int64_t t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = bottom.load(std::memory_order_acquire);
+        if (t >= b) {
+            return NULL;
+        }
+        Task *task = buffer[t % CAPACITY].load(std::memory_order_relaxed);
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            return NULL;
+        }
+        return task;
+    }
+
+    // Whether there may be tasks to take.
+    bool mayHaveTasks() const {
+        return bottom.load(std::memory_order_relaxed) > top.load(std::memory_order_relaxed);
+    }
+};
+
+// A worker thread and its queue.
+// The statistics are only written by the worker itself and read by anyone.
+struct Worker {
+    // Tasks of this worker.
+    WorkDeque            deque;
+    // Index in `workers`.
+    size_t               index;
+    // CPU the worker is pinned to, or -1.
+    int                  cpu;
+    // State of the random number generator for picking workers to steal from.
+    uint64_t             rng;
+    // Number of tasks run.
+    std::atomic_uint64_t tasks{0};
+    // Number of tasks stolen.
+    std::atomic_uint64_t steals{0};
+    // Number of attempts to steal that got nothing.
+    std::atomic_uint64_t failedSteals{0};
+    // Number of times gone to sleep.
+    std::atomic_uint64_t sleeps{0};
+    // Nanoseconds spent without work.
+    std::atomic_uint64_t idleNs{0};
+};
+
+// The workers; allocated once and never freed, so they can still be used while the process exits.
+static Worker             **workers;
+// Number of workers, set before they start.
+static size_t               workerCount;
+// Set once the workers have started.
+static std::atomic_bool     started{false};
+// Set if starting the workers on demand failed, after which tasks run when they are submitted.
+static bool                 startFailed;
+// Guards starting the workers.
+static std::mutex           startMutex;
+// Worker that is the current thread, or NULL.
+static thread_local Worker *currentWorker;
+
+// Shared queue and sleeping of the workers.
+// Like the workers, it is allocated once and never freed: workers may still be waiting on it while static objects
+// are destroyed at exit, and destroying a condition variable with waiters blocks.
+struct Pool {
+    // Tasks submitted from threads other than the workers.
+    std::deque<Task *>      shared;
+    // Guards `shared`.
+    std::mutex              sharedMutex;
+    // Guards sleeping and waking.
+    std::mutex              sleepMutex;
+    // Wakes sleeping workers.
+    std::condition_variable sleepCond;
+};
+
+// The shared queue and sleeping, allocated with the workers.
+static Pool                *pool;
+// Number of tasks in the shared queue, so that it can be checked without the lock.
+static std::atomic_size_t   sharedCount{0};
+// Incremented whenever a task is submitted, so that a worker going to sleep notices tasks submitted meanwhile.
+static std::atomic_uint32_t wakeEpoch{0};
+// Number of workers that are or are about to go to sleep.
+static std::atomic_uint32_t sleepers{0};
+
+// Number of tasks submitted.
+static std::atomic_uint64_t submitted{0};
+// Number of tasks run by threads other than the workers.
+static std::atomic_uint64_t helped{0};
+
+// Add to a statistic that only the calling thread writes.
+static inline void bump(std::atomic_uint64_t &stat, uint64_t amount = 1) {
+    stat.store(stat.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+// Get the next random number of a worker (xorshift64).
+static inline uint64_t nextRandom(uint64_t &state) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+// Parse a list of CPUs such as `0-3,8`.
+static bool parseCpus(std::string_view text, std::vector<int> &out) {
+    while (!text.empty()) {
+        size_t           end  = std::min(text.find(','), text.size());
+        std::string_view item = text.substr(0, end);
+        text.remove_prefix(std::min(end + 1, text.size()));
+        std::string first(item.substr(0, item.find('-')));
+        std::string last(item.find('-') == std::string_view::npos ? first : item.substr(item.find('-') + 1));
+        char       *firstEnd, *lastEnd;
+        long        from = strtol(first.c_str(), &firstEnd, 10);
+        long        to   = strtol(last.c_str(), &lastEnd, 10);
+        if (first.empty() || last.empty() || *firstEnd || *lastEnd || from < 0 || to < from || to >= CPU_SETSIZE) {
+            return false;
+        }
+        for (long cpu = from; cpu <= to; cpu++) {
+            out.push_back(cpu);
+        }
+    }
+    return true;
+}
+
+// Wake a sleeping worker, if any, after a task was submitted.
+static void wake() {
+    wakeEpoch.fetch_add(1, std::memory_order_seq_cst);
+    if (sleepers.load(std::memory_order_seq_cst)) {
+        // Taking the lock ensures that a worker that saw the old epoch is waiting before it is notified.
+        { std::lock_guard<std::mutex> lock(pool->sleepMutex); }
+        pool->sleepCond.notify_one();
+    }
+}
+
+// Whether any queue may have tasks.
+static bool mayHaveWork() {
+    if (sharedCount.load(std::memory_order_acquire)) {
+        return true;
+    }
+    for (size_t i = 0; i < workerCount; i++) {
+        if (workers[i]->deque.mayHaveTasks()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Take a task from the shared queue. A worker moves some more into its own queue, for others to steal.
+static Task *takeShared(Worker *self) {
+    if (!sharedCount.load(std::memory_order_acquire)) {
+        return NULL;
+    }
+    std::lock_guard<std::mutex> lock(pool->sharedMutex);
+    auto                       &shared = pool->shared;
+    if (shared.empty()) {
+        return NULL;
+    }
+    Task *task = shared.front();
+    shared.pop_front();
+    size_t moved = 0;
+    if (self) {
+        size_t share = shared.size() / workerCount;
+        while (moved < share && moved < BATCH && self->deque.push(shared.front())) {
+            shared.pop_front();
+            moved++;
+        }
+    }
+    sharedCount.store(shared.size(), std::memory_order_release);
+    if (moved) {
+        wake();
+    }
+    return task;
+}
+
+// Steal a task from another worker, starting at a random one.
+static Task *stealTask(Worker *self) {
+    thread_local uint64_t helperRng = 0x9e3779b97f4a7c15 ^ (uint64_t)&helperRng;
+    size_t                start     = nextRandom(self ? self->rng : helperRng) % workerCount;
+    for (size_t i = 0; i < workerCount; i++) {
+        Worker *victim = workers[(start + i) % workerCount];
+        if (victim == self || !victim->deque.mayHaveTasks()) {
+            continue;
+        }
+        Task *task = victim->deque.steal();
+        if (self) {
+            bump(task ? self->steals : self->failedSteals);
+        }
+        if (task) {
+            return task;
+        }
+    }
+    return NULL;
+}
+
+// Find a task to run: the newest of the thread's own, one from the shared queue, or one stolen from another worker.
+static Task *findTask(Worker *self) {
+    if (!started.load(std::memory_order_acquire)) {
+        return NULL;
+    }
+    Task *task = self ? self->deque.pop() : NULL;
+    if (!task) {
+        task = takeShared(self);
+    }
+    if (!task) {
+        task = stealTask(self);
+    }
+    return task;
+}
+
+// Run a task and release it.
+static void execute(Task *task) {
+    task->run();
+    std::shared_ptr<Task> keep  = std::move(task->self);
+    TickGroup            *group = task->group;
+    task->done.store(true, std::memory_order_release);
+    // The waiting thread may destroy the group once this reaches zero.
+    if (group) {
+        group->pending.fetch_sub(1, std::memory_order_release);
+    }
+}
+
+// Sleep until a task is submitted; returns early if there may be tasks already.
+static void sleepUntilWoken(Worker *self) {
+    uint32_t epoch = wakeEpoch.load(std::memory_order_seq_cst);
+    sleepers.fetch_add(1, std::memory_order_seq_cst);
+    if (!mayHaveWork()) {
+        bump(self->sleeps);
+        std::unique_lock<std::mutex> lock(pool->sleepMutex);
+        pool->sleepCond.wait(lock, [&] { return wakeEpoch.load(std::memory_order_seq_cst) != epoch; });
+    }
+    sleepers.fetch_sub(1, std::memory_order_seq_cst);
+}
+
+// Main loop of a worker thread.
+static void workerMain(Worker *self) {
+    currentWorker = self;
+    char name[16];
+    snprintf(name, sizeof(name), "coretorio-w%zu", self->index);
+    pthread_setname_np(pthread_self(), name);
+    if (self->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(self->cpu, &set);
+        if (int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+            printf(
+                "Error: Scheduler worker %zu can't be pinned to CPU %d: %s\n",
+                self->index,
+                self->cpu,
+                strerror(error)
+            );
+        }
+    }
+
+    while (true) {
+        if (Task *task = findTask(self)) {
+            execute(task);
+            bump(self->tasks);
+            continue;
+        }
+        auto  idleStart = Clock::now();
+        Task *task;
+        while (!(task = findTask(self))) {
+            if (Clock::now() - idleStart < SPIN_TIME) {
+                _mm_pause();
+            } else {
+                sleepUntilWoken(self);
+            }
+        }
+        bump(self->idleNs, std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - idleStart).count());
+        execute(task);
+        bump(self->tasks);
+    }
+}
+
+// Start the worker threads; `startMutex` must be held.
+static bool startWorkers(Config const &config) {
+    size_t count = config.workers;
+    if (char const *env = getenv("CORETORIO_SCHED_WORKERS"); !count && env) {
+        long value = strtol(env, NULL, 0);
+        if (value <= 0) {
+            printf("Error: Invalid CORETORIO_SCHED_WORKERS: %s\n", env);
+            return false;
+        }
+        count = value;
+    }
+    if (!count) {
+        count = std::max(std::thread::hardware_concurrency() / 2, 1u);
+    }
+    std::vector<int> cpus = config.cpus;
+    if (char const *env = getenv("CORETORIO_SCHED_CPUS"); cpus.empty() && env && !parseCpus(env, cpus)) {
+        printf("Error: Invalid CORETORIO_SCHED_CPUS: %s\n", env);
+        return false;
+    }
+    for (int cpu : cpus) {
+        if (cpu < 0 || cpu >= CPU_SETSIZE) {
+            printf("Error: Invalid scheduler CPU: %d\n", cpu);
+            return false;
+        }
+    }
+
+    pool        = new Pool();
+    workers     = new Worker *[count];
+    workerCount = count;
+    for (size_t i = 0; i < count; i++) {
+        workers[i]        = new Worker();
+        workers[i]->index = i;
+        workers[i]->cpu   = cpus.empty() ? -1 : cpus[i % cpus.size()];
+        workers[i]->rng   = 0x9e3779b97f4a7c15 * (i + 1);
+    }
+    // Workers find each other through `workers`, so all of them exist before any starts.
+    for (size_t i = 0; i < count; i++) {
+        std::thread(workerMain, workers[i]).detach();
+    }
+    started.store(true, std::memory_order_release);
+    return true;
+}
+
+// Start the worker threads; they run until the process exits.
+bool start(Config const &config) {
+    std::lock_guard<std::mutex> lock(startMutex);
+    if (started.load(std::memory_order_relaxed)) {
+        printf("Error: Scheduler workers are already running\n");
+        return false;
+    }
+    return startWorkers(config);
+}
+
+// Get the statistics of the scheduler.
+Stats getStats() {
+    Stats stats{};
+    if (!started.load(std::memory_order_acquire)) {
+        return stats;
+    }
+    for (size_t i = 0; i < workerCount; i++) {
+        Worker const &worker = *workers[i];
+        stats.workers.push_back({
+            worker.cpu,
+            worker.tasks.load(std::memory_order_relaxed),
+            worker.steals.load(std::memory_order_relaxed),
+            worker.failedSteals.load(std::memory_order_relaxed),
+            worker.sleeps.load(std::memory_order_relaxed),
+            worker.idleNs.load(std::memory_order_relaxed) / 1e6,
+        });
+    }
+    stats.submitted = submitted.load(std::memory_order_relaxed);
+    stats.helped    = helped.load(std::memory_order_relaxed);
+    return stats;
+}
+
+// Write the statistics of every worker.
+void dumpStats(FILE *to) {
+    Stats stats = getStats();
+    fprintf(
+        to,
+        "Scheduler: %zu workers, %llu tasks submitted, %llu run by waiting threads\n",
+        stats.workers.size(),
+        (unsigned long long)stats.submitted,
+        (unsigned long long)stats.helped
+    );
+    fprintf(to, "  worker  cpu        tasks       steals  failed steals   sleeps      idle ms\n");
+    for (size_t i = 0; i < stats.workers.size(); i++) {
+        WorkerStats const &worker = stats.workers[i];
+        fprintf(
+            to,
+            "  %6zu  %3d %12llu %12llu %14llu %8llu %12.2f\n",
+            i,
+            worker.cpu,
+            (unsigned long long)worker.tasks,
+            (unsigned long long)worker.steals,
+            (unsigned long long)worker.failedSteals,
+            (unsigned long long)worker.sleeps,
+            worker.idleMs
+        );
+    }
+}
+
+namespace detail {
+
+// Queue a task, starting the workers if they are not running yet.
+void enqueue(std::shared_ptr<Task> task) {
+    if (!started.load(std::memory_order_acquire)) {
+        std::unique_lock<std::mutex> lock(startMutex);
+        if (!started.load(std::memory_order_relaxed) && (startFailed || !(startFailed = !startWorkers(Config())))) {
+            lock.unlock();
+            // Without workers, the task runs right away rather than never.
+            Task *raw = task.get();
+            raw->self = std::move(task);
+            execute(raw);
+            return;
+        }
+    }
+    submitted.fetch_add(1, std::memory_order_relaxed);
+    Task *raw = task.get();
+    raw->self = std::move(task);
+    if (!currentWorker || !currentWorker->deque.push(raw)) {
+        std::lock_guard<std::mutex> lock(pool->sharedMutex);
+        pool->shared.push_back(raw);
+        sharedCount.store(pool->shared.size(), std::memory_order_release);
+    }
+    wake();
+}
+
+// Run queued tasks on the calling thread until `isDone(arg)` returns true.
+void helpUntil(bool (*isDone)(void *), void *arg) {
+    Worker *self  = currentWorker;
+    size_t  spins = 0;
+    while (!isDone(arg)) {
+        if (Task *task = findTask(self)) {
+            execute(task);
+            if (self) {
+                bump(self->tasks);
+            } else {
+                helped.fetch_add(1, std::memory_order_relaxed);
+            }
+            spins = 0;
+        } else if (++spins < 1024) {
+            // The last tasks are running on other threads; they are usually short.
+            _mm_pause();
+        } else {
+            std::this_thread::yield();
+        }
+    }
+}
+
+// Wait for a `TickGroup`; what `waitAt` injects.
+void waitForGroup(void *group) {
+    ((TickGroup *)group)->wait();
+}
+
+} // namespace detail
+
+} // namespace coretorio::scheduler
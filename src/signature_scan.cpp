@@ -0,0 +1,366 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+#include "signature_scan.hpp"
+
+#include <algorithm>
+#include <immintrin.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+
+namespace coretorio::signature {
+
+// Number of buckets patterns are spread over; one bit each in the lookup tables.
+static constexpr size_t BUCKETS = 16;
+
+// Set of buckets, one bit each.
+using BucketBits = uint16_t;
+
+// Lookup tables for finding candidate matches of a set of patterns.
+// For byte `k` of the anchors, `lo[half][k]` and `hi[half][k]` hold for each value of the low and high nibble which
+// of buckets `8 * half` to `8 * half + 7` have a pattern whose anchor byte `k` has that nibble; `exact[k]` holds the
+// same for each whole byte value and all buckets, and `pairs` for each value of the first two bytes together.
+// Buckets with a pattern whose anchor has no byte `k` pass for any value of it.
+struct Matcher {
+    // Patterns being searched for.
+    std::vector<Pattern> const       &patterns;
+    // Where to add the matches, by pattern.
+    std::vector<std::vector<size_t>> &matches;
+    // Size of the data.
+    size_t                            size;
+    // Indices of the patterns in each bucket.
+    std::vector<uint32_t>             buckets[BUCKETS];
+    // Buckets by value of the first two anchor bytes, the first in the low byte of the index.
+    std::vector<BucketBits>           pairs;
+    // Buckets by low nibble of each anchor byte, in two halves of 8 buckets.
+    alignas(16) uint8_t lo[2][MAX_ANCHOR][16] = {};
+    // Buckets by high nibble of each anchor byte, in two halves of 8 buckets.
+    alignas(16) uint8_t hi[2][MAX_ANCHOR][16] = {};
+    // Buckets by value of each anchor byte.
+    BucketBits          exact[MAX_ANCHOR][256] = {};
+
+    Matcher(std::vector<Pattern> const &patterns, std::vector<std::vector<size_t>> &matches, size_t size)
+        : patterns(patterns), matches(matches), size(size), pairs(65536) {
+        // Patterns with similar anchors share a bucket, so that the nibbles of a bucket combine into few other bytes.
+        std::vector<uint32_t> order(patterns.size());
+        for (size_t i = 0; i < order.size(); i++) {
+            order[i] = i;
+        }
+        std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+            Pattern const &first  = patterns[a];
+            Pattern const &second = patterns[b];
+            return std::lexicographical_compare(
+                first.bytes.begin() + first.anchor,
+                first.bytes.begin() + first.anchor + first.anchorLength,
+                second.bytes.begin() + second.anchor,
+                second.bytes.begin() + second.anchor + second.anchorLength
+            );
+        });
+
+        for (size_t rank = 0; rank < order.size(); rank++) {
+            Pattern const &pattern = patterns[order[rank]];
+            size_t         bucket  = rank * BUCKETS / order.size();
+            buckets[bucket].push_back(order[rank]);
+            for (uint32_t k = 0; k < MAX_ANCHOR; k++) {
+                for (size_t value = 0; value < 256; value++) {
+                    if (k >= pattern.anchorLength || value == pattern.bytes[pattern.anchor + k]) {
+                        lo[bucket / 8][k][value % 16] |= 1 << bucket % 8;
+                        hi[bucket / 8][k][value / 16] |= 1 << bucket % 8;
+                        exact[k][value]               |= 1 << bucket;
+                    }
+                }
+            }
+            for (size_t value = 0; value < 256; value++) {
+                if (pattern.anchorLength < 2 || value == pattern.bytes[pattern.anchor + 1]) {
+                    pairs[pattern.bytes[pattern.anchor] | value << 8] |= 1 << bucket;
+                }
+            }
+        }
+    }
+
+    // Get the buckets with a pattern whose whole anchor may be at a position with at least `MAX_ANCHOR` bytes.
+    BucketBits anchoredBuckets(uint8_t const *data, size_t pos) const {
+        static_assert(MAX_ANCHOR == 3);
+        return pairs[data[pos] | data[pos + 1] << 8] & exact[2][data[pos + 2]];
+    }
+
+    // Compare the patterns of some buckets in full, for an anchor found at a position.
+    void verifyBuckets(uint8_t const *data, size_t pos, BucketBits bits) {
+        for (; bits; bits &= bits - 1) {
+            for (uint32_t index : buckets[__builtin_ctz(bits)]) {
+                Pattern const &pattern = patterns[index];
+                size_t         start   = pos - pattern.anchor;
+                if (pos < pattern.anchor || start + pattern.bytes.size() > size) {
+                    continue;
+                }
+                // Other patterns in the bucket have other anchors, so this one's is compared before the rest.
+                bool anchored = true;
+                for (uint32_t k = 0; k < pattern.anchorLength; k++) {
+                    anchored &= data[pos + k] == pattern.bytes[pattern.anchor + k];
+                }
+                if (anchored && pattern.matches(data + start)) {
+                    matches[index].push_back(start);
+                }
+            }
+        }
+    }
+
+    // Compare the patterns of some buckets in full, for a candidate found by nibbles.
+    // The nibble lookups pass any combination of the nibbles in a bucket, so the whole bytes are checked first.
+    void verify(uint8_t const *data, size_t pos, BucketBits bits) {
+        bits &= anchoredBuckets(data, pos);
+        if (bits) {
+            verifyBuckets(data, pos, bits);
+        }
+    }
+
+    // Find the matches with their anchor at a range of positions, one at a time.
+    void scanScalar(uint8_t const *data, size_t pos, size_t end) {
+        for (; pos < end && pos + MAX_ANCHOR <= size; pos++) {
+            BucketBits bits = anchoredBuckets(data, pos);
+            if (bits) {
+                verifyBuckets(data, pos, bits);
+            }
+        }
+        // Near the end, bytes past the data pass; the full comparison rejects patterns that do not fit.
+        for (; pos < end; pos++) {
+            BucketBits bits = UINT16_MAX;
+            for (uint32_t k = 0; pos + k < size; k++) {
+                bits &= exact[k][data[pos + k]];
+            }
+            if (bits) {
+                verifyBuckets(data, pos, bits);
+            }
+        }
+    }
+
+    // Find the matches with their anchor at any position, 16 at a time.
+    __attribute__((target("sse4.2"))) void scanSse42(uint8_t const *data) {
+        __m128i nibble = _mm_set1_epi8(0x0f);
+        __m128i loTables[2][MAX_ANCHOR];
+        __m128i hiTables[2][MAX_ANCHOR];
+        for (uint32_t half = 0; half < 2; half++) {
+            for (uint32_t k = 0; k < MAX_ANCHOR; k++) {
+                loTables[half][k] = _mm_load_si128((__m128i const *)lo[half][k]);
+                hiTables[half][k] = _mm_load_si128((__m128i const *)hi[half][k]);
+            }
+        }
+        size_t pos = 0;
+        for (; pos + 16 + MAX_ANCHOR - 1 <= size; pos += 16) {
+            __m128i bits[2] = {_mm_set1_epi8(-1), _mm_set1_epi8(-1)};
+            for (uint32_t k = 0; k < MAX_ANCHOR; k++) {
+                __m128i bytes = _mm_loadu_si128((__m128i const *)(data + pos + k));
+                __m128i low   = _mm_and_si128(bytes, nibble);
+                __m128i high  = _mm_and_si128(_mm_srli_epi16(bytes, 4), nibble);
+                for (uint32_t half = 0; half < 2; half++) {
+                    bits[half] = _mm_and_si128(
+                        bits[half],
+                        _mm_and_si128(
+                            _mm_shuffle_epi8(loTables[half][k], low), _mm_shuffle_epi8(hiTables[half][k], high)
+                        )
+                    );
+                }
+            }
+            __m128i  any        = _mm_or_si128(bits[0], bits[1]);
+            uint32_t candidates = ~_mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) & 0xffff;
+            if (candidates) {
+                alignas(16) uint8_t lanes[2][16];
+                _mm_store_si128((__m128i *)lanes[0], bits[0]);
+                _mm_store_si128((__m128i *)lanes[1], bits[1]);
+                for (; candidates; candidates &= candidates - 1) {
+                    size_t lane = __builtin_ctz(candidates);
+                    verify(data, pos + lane, lanes[0][lane] | lanes[1][lane] << 8);
+                }
+            }
+        }
+        scanScalar(data, pos, size);
+    }
+
+    // Find the matches with their anchor at any position, 32 at a time.
+    __attribute__((target("avx2"))) void scanAvx2(uint8_t const *data) {
+        __m256i nibble = _mm256_set1_epi8(0x0f);
+        __m256i loTables[2][MAX_ANCHOR];
+        __m256i hiTables[2][MAX_ANCHOR];
+        for (uint32_t half = 0; half < 2; half++) {
+            for (uint32_t k = 0; k < MAX_ANCHOR; k++) {
+                loTables[half][k] = _mm256_broadcastsi128_si256(_mm_load_si128((__m128i const *)lo[half][k]));
+                hiTables[half][k] = _mm256_broadcastsi128_si256(_mm_load_si128((__m128i const *)hi[half][k]));
+            }
+        }
+        size_t pos = 0;
+        for (; pos + 32 + MAX_ANCHOR - 1 <= size; pos += 32) {
+            __m256i bits[2] = {_mm256_set1_epi8(-1), _mm256_set1_epi8(-1)};
+            for (uint32_t k = 0; k < MAX_ANCHOR; k++) {
+                __m256i bytes = _mm256_loadu_si256((__m256i const *)(data + pos + k));
+                __m256i low   = _mm256_and_si256(bytes, nibble);
+                __m256i high  = _mm256_and_si256(_mm256_srli_epi16(bytes, 4), nibble);
+                for (uint32_t half = 0; half < 2; half++) {
+                    bits[half] = _mm256_and_si256(
+                        bits[half],
+                        _mm256_and_si256(
+                            _mm256_shuffle_epi8(loTables[half][k], low), _mm256_shuffle_epi8(hiTables[half][k], high)
+                        )
+                    );
+                }
+            }
+            __m256i  any        = _mm256_or_si256(bits[0], bits[1]);
+            uint32_t candidates = ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(any, _mm256_setzero_si256()));
+            if (candidates) {
+                alignas(32) uint8_t lanes[2][32];
+                _mm256_store_si256((__m256i *)lanes[0], bits[0]);
+                _mm256_store_si256((__m256i *)lanes[1], bits[1]);
+                for (; candidates; candidates &= candidates - 1) {
+                    size_t lane = __builtin_ctz(candidates);
+                    verify(data, pos + lane, lanes[0][lane] | lanes[1][lane] << 8);
+                }
+            }
+        }
+        scanScalar(data, pos, size);
+    }
+};
+
+// Get how common a byte is at an arbitrary position in x86-64 code, from 0 (rare) to 3 (very common).
+static int commonness(uint8_t value) {
+    switch (value) {
+        case 0x00:
+        case 0xff:
+        case 0xcc: return 3;
+        case 0x48:
+        case 0x89:
+        case 0x8b:
+        case 0x0f:
+        case 0xe8:
+        case 0x24:
+        case 0x4c:
+        case 0x41:
+        case 0x85:
+        case 0x8d: return 2;
+        case 0x01:
+        case 0x44:
+        case 0x45:
+        case 0x49:
+        case 0x74:
+        case 0x75:
+        case 0x83:
+        case 0xc0:
+        case 0xc3:
+        case 0xeb: return 1;
+        default: return 0;
+    }
+}
+
+// Parse a pattern from hexadecimal bytes separated by spaces.
+bool Pattern::parse(std::string_view text, Pattern &out) {
+    out = Pattern();
+
+    size_t pos = 0;
+    while (pos < text.size()) {
+        if (text[pos] == ' ') {
+            pos++;
+            continue;
+        }
+        size_t end   = text.find(' ', pos);
+        end          = end == std::string_view::npos ? text.size() : end;
+        auto   token = text.substr(pos, end - pos);
+        pos          = end;
+        if (token == "?" || token == "??") {
+            out.bytes.push_back(0);
+            out.mask.push_back(0);
+            continue;
+        }
+        char  hex[3] = {0};
+        char *parsed;
+        if (token.size() != 2) {
+            return false;
+        }
+        memcpy(hex, token.data(), 2);
+        long value = strtol(hex, &parsed, 16);
+        if (parsed != hex + 2) {
+            return false;
+        }
+        out.bytes.push_back(value);
+        out.mask.push_back(0xff);
+    }
+
+    // Anchor on the longest run of up to `MAX_ANCHOR` bytes that must match, the rarest of those, the earliest on ties.
+    int bestLength = 0;
+    int bestScore  = 0;
+    for (size_t i = 0; i < out.bytes.size(); i++) {
+        int length = 0;
+        int score  = 0;
+        while (length < (int)MAX_ANCHOR && i + length < out.bytes.size() && out.mask[i + length]) {
+            score += commonness(out.bytes[i + length]);
+            length++;
+        }
+        if (length > bestLength || (length == bestLength && score < bestScore)) {
+            out.anchor = i;
+            bestLength = length;
+            bestScore  = score;
+        }
+    }
+    if (!bestLength) {
+        return false;
+    }
+    out.anchorLength = bestLength;
+    return true;
+}
+
+// Get the best instruction set the CPU supports.
+ScanLevel bestScanLevel() {
+    static ScanLevel level = [] {
+        ScanLevel best = __builtin_cpu_supports("avx2")     ? ScanLevel::AVX2
+                         : __builtin_cpu_supports("sse4.2") ? ScanLevel::SSE42
+                                                            : ScanLevel::SCALAR;
+        char const *env = getenv("CORETORIO_SCAN");
+        if (!env || !*env) {
+            return best;
+        }
+        for (ScanLevel level : {ScanLevel::SCALAR, ScanLevel::SSE42, ScanLevel::AVX2}) {
+            if (strcmp(env, scanLevelName(level))) {
+                continue;
+            } else if (level > best) {
+                printf("Error: CORETORIO_SCAN=%s is not supported by this CPU, using %s\n", env, scanLevelName(best));
+                return best;
+            }
+            return level;
+        }
+        printf("Error: Invalid CORETORIO_SCAN: %s, using %s\n", env, scanLevelName(best));
+        return best;
+    }();
+    return level;
+}
+
+// Get the name of an instruction set.
+char const *scanLevelName(ScanLevel level) {
+    switch (level) {
+        case ScanLevel::SCALAR: return "scalar";
+        case ScanLevel::SSE42: return "sse4.2";
+        case ScanLevel::AVX2: return "avx2";
+    }
+    return "?";
+}
+
+// Find all matches of all patterns in one pass over some data.
+void scan(
+    uint8_t const                    *data,
+    size_t                            size,
+    std::vector<Pattern> const       &patterns,
+    std::vector<std::vector<size_t>> &matches,
+    ScanLevel                         level
+) {
+    matches.assign(patterns.size(), {});
+    if (patterns.empty()) {
+        return;
+    }
+    Matcher matcher(patterns, matches, size);
+    switch (level) {
+        case ScanLevel::SCALAR: matcher.scanScalar(data, 0, size); break;
+        case ScanLevel::SSE42: matcher.scanSse42(data); break;
+        case ScanLevel::AVX2: matcher.scanAvx2(data); break;
+    }
+}
+
+} // namespace coretorio::signature
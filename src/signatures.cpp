@@ -0,0 +1,165 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+#include "injection_priv.hpp"
+#include "signature_scan.hpp"
+#include "timings.hpp"
+
+#include <algorithm>
+#include <deque>
+#include <elf.h>
+#include <map>
+#include <mutex>
+
+
+
+namespace coretorio::injection {
+
+// A function to find by a pattern of its code.
+struct Signature {
+    // Pattern of the code.
+    signature::Pattern pattern;
+    // Offset from the start of a match to the start of the function.
+    ptrdiff_t          offset;
+    // Whether `.text` has been searched for the pattern.
+    bool               searched = false;
+    // The function found, or NULL if the pattern did not match exactly once.
+    Symbol const      *symbol   = NULL;
+};
+
+// Signatures of functions, by the symbol name they stand in for.
+static std::map<std::string, Signature, std::less<>> *signatures;
+// Largest size given to a made-up symbol, so that code flow analysis of a function without a symbol stays near it
+// when the functions after it have none either.
+static constexpr size_t MAX_MADE_UP_SIZE = 16 << 10;
+
+// Symbols made up for functions that are found by signature and have none.
+static std::deque<Symbol>                             *madeUpSymbols;
+// Guards `signatures` and `madeUpSymbols`.
+static std::mutex                                      signaturesMutex;
+
+// Find one of Factorio's functions by a pattern of its code.
+bool defineSignature(std::string const &symbolName, std::string const &pattern, ptrdiff_t offset) {
+    Signature signature;
+    if (!signature::Pattern::parse(pattern, signature.pattern)) {
+        printf("Error: Invalid signature for `%s`: `%s`\n", symbolName.c_str(), pattern.c_str());
+        return false;
+    }
+    signature.offset = offset;
+
+    std::lock_guard<std::mutex> lock(signaturesMutex);
+    if (!signatures) {
+        signatures    = new std::map<std::string, Signature, std::less<>>();
+        madeUpSymbols = new std::deque<Symbol>();
+    }
+    auto existing = signatures->find(symbolName);
+    if (existing != signatures->end() && existing->second.searched) {
+        printf("Error: `%s` was already searched for by signature\n", symbolName.c_str());
+        return false;
+    }
+    (*signatures)[symbolName] = std::move(signature);
+    return true;
+}
+
+// Get the symbol of a function found by signature.
+// Functions without a symbol get one made up, which reaches to the next function that has one, the end of `.text`
+// or `MAX_MADE_UP_SIZE` bytes, whichever is first, so that jumps past it are taken as tail calls.
+static Symbol const *symbolAt(std::string_view name, uint8_t *addr, object::Section const &text) {
+    uint8_t *textEnd = (uint8_t *)text.sh_addr_ptr + text.sh_size;
+    auto     known   = object::findSymbolByAddress(addr);
+    if (addr < text.sh_addr_ptr || addr >= textEnd) {
+        printf("Error: Signature of `%.*s` points outside of .text\n", (int)name.size(), name.data());
+        return NULL;
+    } else if (known && known->st_value_ptr == addr) {
+        return known;
+    } else if (known) {
+        printf(
+            "Error: Signature of `%.*s` matches inside `%.*s`, not at the start of a function\n",
+            (int)name.size(),
+            name.data(),
+            (int)known->st_name_str.size(),
+            known->st_name_str.data()
+        );
+        return NULL;
+    }
+    uint8_t *end  = std::min(textEnd, addr + MAX_MADE_UP_SIZE);
+    auto     next = (uint8_t *)object::findNextFunction(addr);
+    if (next && next < end) {
+        end = next;
+    }
+    Symbol &symbol      = madeUpSymbols->emplace_back();
+    symbol.st_info      = ELF64_ST_INFO(STB_LOCAL, STT_FUNC);
+    symbol.st_size      = end - addr;
+    symbol.st_name_str  = name;
+    symbol.st_value_ptr = addr;
+    return &symbol;
+}
+
+// Find the functions that have no symbol by their signatures, in one pass over `.text`.
+size_t resolveSignatures(std::string_view const *names, Symbol const **out, size_t count) {
+    std::lock_guard<std::mutex> lock(signaturesMutex);
+    if (!signatures) {
+        return 0;
+    }
+
+    // Gather the signatures that are needed and have not been searched for yet.
+    std::vector<Signature *>        pending;
+    std::vector<std::string_view>   pendingNames;
+    std::vector<signature::Pattern> patterns;
+    for (size_t i = 0; i < count; i++) {
+        auto signature = signatures->find(names[i]);
+        if (!out[i] && signature != signatures->end() && !signature->second.searched) {
+            pending.push_back(&signature->second);
+            pendingNames.push_back(signature->first);
+            patterns.push_back(signature->second.pattern);
+        }
+    }
+
+    // Search the file's copy of the code, which is never patched, and translate the matches to loaded addresses.
+    auto text = object::findSection(".text");
+    if (!pending.empty() && (!text || !text->sh_data_ptr || !text->sh_addr_ptr)) {
+        printf("Error: No .text section to search for signatures\n");
+    } else if (!pending.empty()) {
+        auto                             start = std::chrono::steady_clock::now();
+        std::vector<std::vector<size_t>> matches;
+        signature::scan((uint8_t const *)text->sh_data_ptr, text->sh_size, patterns, matches);
+        double ms = timings::elapsedMs(start);
+        timings::recordPhase("signature_scan", ms);
+        printf(
+            "Searched %.1f MiB of code for %zu signatures in %.2f ms (%.2f GB/s, %s)\n",
+            text->sh_size / 1048576.0,
+            patterns.size(),
+            ms,
+            text->sh_size / ms / 1e6,
+            signature::scanLevelName(signature::bestScanLevel())
+        );
+
+        for (size_t i = 0; i < pending.size(); i++) {
+            pending[i]->searched = true;
+            if (matches[i].size() != 1) {
+                printf(
+                    "Error: Signature of `%.*s` matches %zu times instead of once\n",
+                    (int)pendingNames[i].size(),
+                    pendingNames[i].data(),
+                    matches[i].size()
+                );
+                continue;
+            }
+            uint8_t *addr      = (uint8_t *)text->sh_addr_ptr + matches[i][0] + pending[i]->offset;
+            pending[i]->symbol = symbolAt(pendingNames[i], addr, *text);
+        }
+    }
+
+    // Fill in every site that has a signature, including ones found by earlier batches.
+    size_t found = 0;
+    for (size_t i = 0; i < count; i++) {
+        auto signature = signatures->find(names[i]);
+        if (!out[i] && signature != signatures->end() && signature->second.symbol) {
+            out[i] = signature->second.symbol;
+            found++;
+        }
+    }
+    return found;
+}
+
+} // namespace coretorio::injection
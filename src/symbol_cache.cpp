@@ -0,0 +1,393 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+#include "symbol_cache.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+
+
+namespace coretorio::object {
+
+// Symbol cache file header.
+// The cache is a snapshot of the in-memory indices: it contains pointers that are valid when the file is mapped
+// at `base` in a process where the executable's load bias is `loadBias`, so that in the common case loading it
+// is just mapping the file. Otherwise the pointers are relocated once after mapping.
+struct CacheHeader {
+    // Identifies the file as a CoreTorio symbol cache.
+    char     magic[8];
+    // Format version, bumped whenever the layout of the file or of `Symbol` changes.
+    uint32_t version;
+    // Size of `Symbol` when the cache was written.
+    uint32_t symbolSize;
+    // Size of `SymbolIndex::Slot` when the cache was written.
+    uint32_t slotSize;
+    // Number of valid bytes in `key`.
+    uint32_t keyLength;
+    // Key of the executable the cache was generated from.
+    uint8_t  key[64];
+    // Total size of the cache file.
+    uint64_t fileSize;
+    // Address the cache was mapped at when it was written.
+    uint64_t base;
+    // Load bias of the executable when the cache was written.
+    uint64_t loadBias;
+
+    // Section headers.
+    uint64_t shnum, shdrOffset;
+    // Section header string table.
+    uint64_t shstrtabSize, shstrtabOffset;
+    // Symbol string table.
+    uint64_t strtabSize, strtabOffset;
+    // `SymbolIndex` symbols.
+    uint64_t symbolCount, symbolOffset;
+    // `SymbolIndex` slots, split into `shardCount` shards.
+    uint64_t slotCount, shardCount, slotOffset;
+    // `AddressIndex` arrays, which each have `functionCount + 1` entries.
+    uint64_t functionCount, keyOffset, sizeOffset, indexOffset;
+};
+
+// Symbol cache file magic.
+static constexpr char     cacheMagic[8] = {'C', 'T', 'S', 'Y', 'M', 'C', 'H', 'E'};
+// Symbol cache file format version.
+static constexpr uint32_t cacheVersion  = 2;
+
+
+
+// Get the directory the symbol cache is stored in, or an empty string if there is none.
+static std::string cacheDir() {
+    if (char const *dir = getenv("CORETORIO_CACHE_DIR")) {
+        return dir;
+    } else if (char const *dir = getenv("XDG_CACHE_HOME")) {
+        return std::string(dir) + "/coretorio";
+    } else if (char const *dir = getenv("HOME")) {
+        return std::string(dir) + "/.cache/coretorio";
+    }
+    return "";
+}
+
+// Create a directory and its parents.
+static bool makeDirs(std::string const &path) {
+    for (size_t i = 1; i <= path.size(); i++) {
+        if (i == path.size() || path[i] == '/') {
+            if (mkdir(path.substr(0, i).c_str(), 0755) && errno != EEXIST) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Reserve a cache line aligned region in the cache file.
+static uint64_t place(uint64_t &cursor, uint64_t size) {
+    uint64_t offset = (cursor + 63) & ~(uint64_t)63;
+    cursor          = offset + size;
+    return offset;
+}
+
+// Whether a region lies within the cache file.
+static bool inFile(CacheHeader const &header, uint64_t offset, uint64_t count, uint64_t size) {
+    return offset <= header.fileSize && count <= (header.fileSize - offset) / size;
+}
+
+// Whether everything the section table and indices of a mapped cache refer to lies within it, so that a damaged
+// file can't make lookups read outside of it or probe forever.
+static bool validContents(CacheHeader const &header, uint8_t const *mem) {
+    // Section names.
+    auto shdrs = (Elf64_Shdr const *)(mem + header.shdrOffset);
+    auto names = (char const *)(mem + header.shstrtabOffset);
+    if (header.shnum && (!header.shstrtabSize || names[header.shstrtabSize - 1])) {
+        return false;
+    }
+    for (size_t i = 0; i < header.shnum; i++) {
+        if (shdrs[i].sh_name >= header.shstrtabSize) {
+            return false;
+        }
+    }
+
+    // Symbol names, which point into the string table where the file was written.
+    auto syms = (Symbol const *)(mem + header.symbolOffset);
+    for (size_t i = 0; i < header.symbolCount; i++) {
+        size_t name = (size_t)syms[i].st_name_str.data() - header.base - header.strtabOffset;
+        if (name > header.strtabSize || syms[i].st_name_str.size() > header.strtabSize - name) {
+            return false;
+        }
+    }
+
+    // Hash table slots; every shard needs an empty slot to end lookups of missing names.
+    auto   slots     = (SymbolIndex::Slot const *)(mem + header.slotOffset);
+    size_t shardSize = header.slotCount / header.shardCount;
+    for (size_t shard = 0; shard < header.shardCount; shard++) {
+        bool hasEmpty = false;
+        for (size_t i = shard * shardSize; i < (shard + 1) * shardSize; i++) {
+            if (slots[i].index == SymbolIndex::EMPTY) {
+                hasEmpty = true;
+            } else if (slots[i].index >= header.symbolCount) {
+                return false;
+            }
+        }
+        if (!hasEmpty) {
+            return false;
+        }
+    }
+
+    // Address index entries.
+    auto indices = (uint32_t const *)(mem + header.indexOffset);
+    for (size_t i = 1; i <= header.functionCount; i++) {
+        if (indices[i] >= header.symbolCount) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+
+// Determine the cache key of the mapped game executable.
+void getCacheKey(CacheKey &key, uint8_t const *image, size_t imageSize, struct stat const &imageStat) {
+    // Look for the GNU build ID in the PT_NOTE segments.
+    auto ehdr = (Elf64_Ehdr const *)image;
+    if (ehdr->e_phentsize == sizeof(Elf64_Phdr) && ehdr->e_phoff <= imageSize
+        && ehdr->e_phnum <= (imageSize - ehdr->e_phoff) / sizeof(Elf64_Phdr)) {
+        auto phdrs = (Elf64_Phdr const *)(image + ehdr->e_phoff);
+        for (Elf64_Half i = 0; i < ehdr->e_phnum; i++) {
+            if (phdrs[i].p_type != PT_NOTE || phdrs[i].p_offset > imageSize
+                || phdrs[i].p_filesz > imageSize - phdrs[i].p_offset) {
+                continue;
+            }
+            size_t pos = phdrs[i].p_offset;
+            size_t end = phdrs[i].p_offset + phdrs[i].p_filesz;
+            while (end - pos >= sizeof(Elf64_Nhdr)) {
+                auto   note = (Elf64_Nhdr const *)(image + pos);
+                size_t name = pos + sizeof(Elf64_Nhdr);
+                size_t desc = name + ((note->n_namesz + 3) & ~3);
+                pos         = desc + ((note->n_descsz + 3) & ~3);
+                if (pos > end) {
+                    break;
+                } else if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 && !memcmp(image + name, "GNU", 4)
+                           && note->n_descsz && note->n_descsz <= sizeof(key.data)) {
+                    memcpy(key.data, image + desc, note->n_descsz);
+                    key.length = note->n_descsz;
+                    return;
+                }
+            }
+        }
+    }
+
+    // No build ID; fall back to the identity, size and modification time of the file.
+    uint64_t fallback[6] = {
+        (uint64_t)imageStat.st_dev,
+        (uint64_t)imageStat.st_ino,
+        (uint64_t)imageStat.st_size,
+        (uint64_t)imageStat.st_mtim.tv_sec,
+        (uint64_t)imageStat.st_mtim.tv_nsec,
+        0x6b6361626c6c6166, // Distinguishes this from a build ID.
+    };
+    memcpy(key.data, fallback, sizeof(fallback));
+    key.length = sizeof(fallback);
+}
+
+// Try to load the section table and symbol indices from the symbol cache.
+bool loadSymbolCache(
+    CacheKey const &key, size_t loadBias, CachedSections &sections, SymbolIndex &symbols, AddressIndex &functions
+) {
+    std::string dir = cacheDir();
+    if (dir.empty()) {
+        return false;
+    }
+    int fd = open((dir + "/symbols.bin").c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    // Validate the header before mapping anything, and the rest before using any of it.
+    CacheHeader header;
+    struct stat st;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || fstat(fd, &st)
+        || memcmp(header.magic, cacheMagic, sizeof(cacheMagic)) || header.version != cacheVersion
+        || header.symbolSize != sizeof(Symbol) || header.slotSize != sizeof(SymbolIndex::Slot)
+        || header.keyLength != key.length || memcmp(header.key, key.data, key.length)
+        || header.fileSize != (uint64_t)st.st_size) {
+        printf("Symbol cache is stale\n");
+        close(fd);
+        return false;
+    } else if (!inFile(header, header.shdrOffset, header.shnum, sizeof(Elf64_Shdr))
+               || !inFile(header, header.shstrtabOffset, header.shstrtabSize, 1)
+               || !inFile(header, header.strtabOffset, header.strtabSize, 1)
+               || !inFile(header, header.symbolOffset, header.symbolCount, sizeof(Symbol))
+               || !inFile(header, header.slotOffset, header.slotCount, sizeof(SymbolIndex::Slot))
+               || !inFile(header, header.keyOffset, header.functionCount + 1, sizeof(uint64_t))
+               || !inFile(header, header.sizeOffset, header.functionCount + 1, sizeof(uint32_t))
+               || !inFile(header, header.indexOffset, header.functionCount + 1, sizeof(uint32_t))
+               || header.symbolCount >= SymbolIndex::EMPTY || header.slotCount <= header.symbolCount
+               || !header.shardCount || header.shardCount > header.slotCount
+               || (header.slotCount & (header.slotCount - 1)) || (header.shardCount & (header.shardCount - 1))) {
+        printf("Symbol cache is corrupt\n");
+        close(fd);
+        return false;
+    }
+
+    // Map it where it was written if possible, so that none of the pointers in it need relocating.
+    auto mem = (uint8_t *)
+        mmap((void *)header.base, header.fileSize, PROT_READ, MAP_PRIVATE | MAP_FIXED_NOREPLACE, fd, 0);
+    if (mem != MAP_FAILED && mem != (uint8_t *)header.base) {
+        munmap(mem, header.fileSize);
+        mem = (uint8_t *)MAP_FAILED;
+    }
+    bool relocate = mem == MAP_FAILED || loadBias != header.loadBias;
+    if (mem == MAP_FAILED) {
+        mem = (uint8_t *)mmap(NULL, header.fileSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    } else if (relocate && mprotect(mem, header.fileSize, PROT_READ | PROT_WRITE)) {
+        munmap(mem, header.fileSize);
+        mem = (uint8_t *)MAP_FAILED;
+    }
+    close(fd);
+    if (mem == MAP_FAILED) {
+        perror("Mapping symbol cache failed");
+        return false;
+    } else if (!validContents(header, mem)) {
+        printf("Symbol cache is corrupt\n");
+        munmap(mem, header.fileSize);
+        return false;
+    }
+
+    // Relocate symbol names and addresses.
+    // The private mapping is copy-on-write, so this does not modify the file.
+    if (relocate) {
+        size_t nameDelta = (size_t)mem - header.base;
+        size_t biasDelta = loadBias - header.loadBias;
+        auto   syms      = (Symbol *)(mem + header.symbolOffset);
+        for (size_t i = 0; i < header.symbolCount; i++) {
+            syms[i].st_name_str = std::string_view(syms[i].st_name_str.data() + nameDelta, syms[i].st_name_str.size());
+            if (syms[i].st_value_ptr) {
+                syms[i].st_value_ptr = (void *)((size_t)syms[i].st_value_ptr + biasDelta);
+            }
+        }
+        auto keys = (uint64_t *)(mem + header.keyOffset);
+        for (size_t i = 1; i <= header.functionCount; i++) {
+            keys[i] += biasDelta;
+        }
+        mprotect(mem, header.fileSize, PROT_READ);
+    }
+
+    sections.shdrs     = (Elf64_Shdr const *)(mem + header.shdrOffset);
+    sections.shnum     = header.shnum;
+    sections.names     = (char const *)(mem + header.shstrtabOffset);
+    sections.namesSize = header.shstrtabSize;
+
+    symbols.symbols    = (Symbol const *)(mem + header.symbolOffset);
+    symbols.count      = header.symbolCount;
+    symbols.slots      = (SymbolIndex::Slot const *)(mem + header.slotOffset);
+    symbols.mask       = header.slotCount / header.shardCount - 1;
+    symbols.shardMask  = header.shardCount - 1;
+    symbols.shardShift = __builtin_ctzl(header.slotCount / header.shardCount);
+
+    functions.keys    = (uint64_t const *)(mem + header.keyOffset);
+    functions.sizes   = (uint32_t const *)(mem + header.sizeOffset);
+    functions.indices = (uint32_t const *)(mem + header.indexOffset);
+    functions.count   = header.functionCount;
+
+    return true;
+}
+
+// Write the section table and symbol indices to the symbol cache, replacing any previous cache.
+bool saveSymbolCache(
+    CacheKey const       &key,
+    size_t                loadBias,
+    CachedSections const &sections,
+    std::string_view      strtab,
+    SymbolIndex const    &symbols,
+    AddressIndex const   &functions
+) {
+    std::string dir = cacheDir();
+    if (dir.empty() || !makeDirs(dir)) {
+        return false;
+    }
+    std::string path = dir + "/symbols.bin";
+    std::string temp = path + "." + std::to_string(getpid());
+
+    // Lay out the file.
+    CacheHeader header = {};
+    uint64_t    cursor = sizeof(CacheHeader);
+    memcpy(header.magic, cacheMagic, sizeof(cacheMagic));
+    header.version        = cacheVersion;
+    header.symbolSize     = sizeof(Symbol);
+    header.slotSize       = sizeof(SymbolIndex::Slot);
+    header.keyLength      = key.length;
+    header.loadBias       = loadBias;
+    header.shnum          = sections.shnum;
+    header.shdrOffset     = place(cursor, sections.shnum * sizeof(Elf64_Shdr));
+    header.shstrtabSize   = sections.namesSize;
+    header.shstrtabOffset = place(cursor, sections.namesSize);
+    header.strtabSize     = strtab.size();
+    header.strtabOffset   = place(cursor, strtab.size());
+    header.symbolCount    = symbols.count;
+    header.symbolOffset   = place(cursor, symbols.count * sizeof(Symbol));
+    header.slotCount      = (symbols.shardMask + 1) * (symbols.mask + 1);
+    header.shardCount     = symbols.shardMask + 1;
+    header.slotOffset     = place(cursor, header.slotCount * sizeof(SymbolIndex::Slot));
+    header.functionCount  = functions.count;
+    header.keyOffset      = place(cursor, (functions.count + 1) * sizeof(uint64_t));
+    header.sizeOffset     = place(cursor, (functions.count + 1) * sizeof(uint32_t));
+    header.indexOffset    = place(cursor, (functions.count + 1) * sizeof(uint32_t));
+    header.fileSize       = cursor;
+    memcpy(header.key, key.data, key.length);
+
+    // Write it through a shared mapping, so the pointers in it can be made valid at the address it is mapped at.
+    int fd = open(temp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    } else if (ftruncate(fd, header.fileSize)) {
+        close(fd);
+        unlink(temp.c_str());
+        return false;
+    }
+    auto mem = (uint8_t *)mmap(NULL, header.fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        unlink(temp.c_str());
+        return false;
+    }
+    header.base = (uint64_t)mem;
+
+    memcpy(mem, &header, sizeof(header));
+    memcpy(mem + header.shdrOffset, sections.shdrs, sections.shnum * sizeof(Elf64_Shdr));
+    memcpy(mem + header.shstrtabOffset, sections.names, sections.namesSize);
+    memcpy(mem + header.strtabOffset, strtab.data(), strtab.size());
+    auto syms = (Symbol *)(mem + header.symbolOffset);
+    for (size_t i = 0; i < symbols.count; i++) {
+        Symbol sym  = symbols.symbols[i];
+        size_t name = sym.st_name_str.data() - strtab.data();
+        if (name > strtab.size() || sym.st_name_str.size() > strtab.size() - name) {
+            munmap(mem, header.fileSize);
+            unlink(temp.c_str());
+            return false;
+        }
+        sym.st_name_str = std::string_view((char const *)mem + header.strtabOffset + name, sym.st_name_str.size());
+        memcpy(&syms[i], &sym, sizeof(Symbol));
+    }
+    memcpy(mem + header.slotOffset, symbols.slots, header.slotCount * sizeof(SymbolIndex::Slot));
+    memcpy(mem + header.keyOffset, functions.keys, (functions.count + 1) * sizeof(uint64_t));
+    memcpy(mem + header.sizeOffset, functions.sizes, (functions.count + 1) * sizeof(uint32_t));
+    memcpy(mem + header.indexOffset, functions.indices, (functions.count + 1) * sizeof(uint32_t));
+
+    munmap(mem, header.fileSize);
+    if (rename(temp.c_str(), path.c_str())) {
+        unlink(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+} // namespace coretorio::object
@@ -0,0 +1,133 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+#include "parallel.hpp"
+#include "symbol_index.hpp"
+
+
+
+namespace coretorio::object {
+
+// Build the index, taking ownership of the symbols.
+void SymbolIndex::build(std::vector<Symbol> &&symbols) {
+    std::vector<uint64_t> hashes(symbols.size());
+    for (size_t i = 0; i < symbols.size(); i++) {
+        hashes[i] = hashName(symbols[i].st_name_str);
+    }
+    build(std::move(symbols), hashes);
+}
+
+// Build the index from symbols with precomputed name hashes, taking ownership of the symbols.
+void SymbolIndex::build(std::vector<Symbol> &&symbols, std::vector<uint64_t> const &hashes) {
+    symbolStorage = std::move(symbols);
+    this->symbols = symbolStorage.data();
+    count         = symbolStorage.size();
+
+    // Small tables are not worth splitting.
+    size_t shards = count < 65536 ? 1 : 64;
+    shardMask     = shards - 1;
+
+    // Sort the symbols by shard, keeping them in order within each shard.
+    // Chunks of symbols are counted and scattered in parallel; their offsets come from a serial prefix sum.
+    constexpr size_t      chunkSize = 65536;
+    size_t                chunks    = (count + chunkSize - 1) / chunkSize;
+    std::vector<uint32_t> histogram(chunks * shards);
+    parallel::forEach(chunks, [&](size_t chunk) {
+        size_t end = chunk * chunkSize + chunkSize < count ? chunk * chunkSize + chunkSize : count;
+        for (size_t i = chunk * chunkSize; i < end; i++) {
+            histogram[chunk * shards + ((hashes[i] >> SHARD_BITS) & shardMask)]++;
+        }
+    });
+    std::vector<uint32_t> shardStart(shards + 1);
+    size_t                largest = 0;
+    for (size_t shard = 0, pos = 0; shard < shards; shard++) {
+        shardStart[shard] = pos;
+        for (size_t chunk = 0; chunk < chunks; chunk++) {
+            uint32_t n                          = histogram[chunk * shards + shard];
+            histogram[chunk * shards + shard]   = pos;
+            pos                                += n;
+        }
+        largest = pos - shardStart[shard] > largest ? pos - shardStart[shard] : largest;
+    }
+    shardStart[shards] = count;
+    std::vector<uint32_t> order(count);
+    parallel::forEach(chunks, [&](size_t chunk) {
+        size_t end = chunk * chunkSize + chunkSize < count ? chunk * chunkSize + chunkSize : count;
+        for (size_t i = chunk * chunkSize; i < end; i++) {
+            order[histogram[chunk * shards + ((hashes[i] >> SHARD_BITS) & shardMask)]++] = i;
+        }
+    });
+
+    // Keep the load factor of the fullest shard at or below 50% so probe sequences stay short.
+    size_t cap = 16;
+    shardShift = 4;
+    while (cap < largest * 2) {
+        cap <<= 1;
+        shardShift++;
+    }
+    mask = cap - 1;
+    slotStorage.assign(cap * shards, Slot{0, EMPTY});
+    slots = slotStorage.data();
+
+    // Fill the shards in parallel.
+    parallel::forEach(shards, [&](size_t shardIndex) {
+        Slot *shard = slotStorage.data() + (shardIndex << shardShift);
+        for (size_t k = shardStart[shardIndex]; k < shardStart[shardIndex + 1]; k++) {
+            uint32_t         i    = order[k];
+            std::string_view name = symbolStorage[i].st_name_str;
+            uint32_t         tag  = hashes[i] >> 32;
+            for (size_t j = hashes[i] & mask;; j = (j + 1) & mask) {
+                if (shard[j].index == EMPTY) {
+                    shard[j] = Slot{tag, i};
+                    break;
+                } else if (shard[j].tag == tag && symbolStorage[shard[j].index].st_name_str == name) {
+                    // Duplicate name; the first one wins.
+                    break;
+                }
+            }
+        }
+    });
+}
+
+// Find many symbols in one pass, setting missing ones to NULL.
+size_t SymbolIndex::findMany(std::string_view const *names, Symbol const **out, size_t count) const {
+    // Names are hashed a group at a time, so no buffer as large as the input is needed.
+    constexpr size_t group = 16;
+    uint64_t         hashes[group];
+    size_t           found = 0;
+
+    for (size_t base = 0; base < count; base += group) {
+        size_t n = count - base < group ? count - base : group;
+        for (size_t i = 0; i < n; i++) {
+            hashes[i] = hashName(names[base + i]);
+        }
+        found += findMany(names + base, hashes, out + base, n);
+    }
+
+    return found;
+}
+
+// Find many symbols with precomputed name hashes in one pass, setting missing ones to NULL.
+size_t SymbolIndex::findMany(
+    std::string_view const *names, uint64_t const *hashes, Symbol const **out, size_t count
+) const {
+    // Lookups are done in groups: prefetch the whole group's home slots first,
+    // so the cache misses overlap instead of being paid one after another.
+    constexpr size_t group = 16;
+    size_t           found = 0;
+
+    for (size_t base = 0; base < count; base += group) {
+        size_t n = count - base < group ? count - base : group;
+        for (size_t i = base; i < base + n; i++) {
+            __builtin_prefetch(&slots[(((hashes[i] >> SHARD_BITS) & shardMask) << shardShift) + (hashes[i] & mask)]);
+        }
+        for (size_t i = base; i < base + n; i++) {
+            out[i]  = find(names[i], hashes[i]);
+            found  += out[i] != NULL;
+        }
+    }
+
+    return found;
+}
+
+} // namespace coretorio::object
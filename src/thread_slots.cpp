@@ -0,0 +1,36 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+#include "thread_slots.hpp"
+
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+
+
+namespace coretorio::threads {
+
+// Get the thread ID of the calling thread.
+pid_t currentThread() {
+    return syscall(SYS_gettid);
+}
+
+// Take over a slot for a thread if the slot's owner has exited.
+// Signal 0 only checks that the owner exists. A new thread that got the owner's thread ID is the one asking, since it
+// has no slot yet, and if another thread got it, the slot is only taken over once that thread exits too.
+bool takeOver(std::atomic<pid_t> &owner, pid_t self) {
+    pid_t current = owner.load(std::memory_order_relaxed);
+    bool  exited  = current == self || (syscall(SYS_tgkill, getpid(), current, 0) && errno == ESRCH);
+    return exited && owner.compare_exchange_strong(current, self);
+}
+
+// Map zeroed memory for a new slot.
+// Anonymous memory comes zeroed; `mmap` is only a system call, unlike `calloc` which may use vector registers.
+void *mapSlot(size_t size) {
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return mem == MAP_FAILED ? NULL : mem;
+}
+
+} // namespace coretorio::threads
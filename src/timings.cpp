@@ -0,0 +1,43 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+#include "timings.hpp"
+
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+
+
+namespace coretorio::timings {
+
+// Milliseconds elapsed since a point in time.
+double elapsedMs(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Record how long a phase of CoreTorio's startup or injection took.
+void recordPhase(char const *phase, double ms) {
+    static std::mutex mutex;
+    static FILE      *file = [] {
+        char const *path = getenv("CORETORIO_TIMINGS");
+        if (!path) {
+            return (FILE *)NULL;
+        }
+        // Appended to, so that several runs and the program being measured can share one file.
+        FILE *file = fopen(path, "a");
+        if (!file) {
+            perror("Opening timings file failed");
+        }
+        return file;
+    }();
+    if (!file) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    fprintf(file, "{\"pid\": %d, \"phase\": \"%s\", \"ms\": %.3f}\n", (int)getpid(), phase, ms);
+    fflush(file);
+}
+
+} // namespace coretorio::timings
@@ -0,0 +1,398 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+#include "memory_map.hpp"
+#include "toggle.hpp"
+
+#include <chrono>
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <linux/membarrier.h>
+#include <mutex>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+
+
+namespace coretorio::injection {
+
+// How long to wait for other threads to respond to a broadcast.
+static constexpr std::chrono::milliseconds BROADCAST_TIMEOUT{500};
+// How much CPU time a thread may spend blocking the broadcast signal before a broadcast fails, for threads that only
+// block it for a moment, as while running a signal handler or starting or exiting. Time spent waiting for a CPU is
+// not counted, since the thread can't run any code meanwhile.
+static constexpr std::chrono::milliseconds BLOCKED_TIMEOUT{2};
+
+// Toggles known to the signal handlers. Replaced as a whole when toggles are added and never freed, because a
+// handler may still be reading an older list.
+static std::atomic<std::vector<Toggle *> const *> registry;
+// Serializes changes to the registry and to the state of toggles.
+static std::mutex                                 toggleMutex;
+// Toggles whose state is being changed, or NULL.
+static std::atomic<std::vector<Toggle *> *>       changing;
+// Set by the broadcast handler if a thread stopped inside a patch that is being changed could not be moved out.
+static std::atomic<bool>                          sweepFailed;
+// Sequence number of the current broadcast in the upper 32 bits, and the number of threads that have
+// acknowledged it in the lower 32 bits.
+static std::atomic<uint64_t>                      broadcastState;
+// Futex incremented on every acknowledgement, to wake the thread waiting for them.
+static std::atomic<uint32_t>                      broadcastFutex;
+// Whether cores can be serialized with `membarrier`.
+static bool                                       haveMembarrier;
+// `SIGTRAP` handler that was installed before ours.
+static struct sigaction                           prevTrapAction;
+
+// Signal used to interrupt the other threads of the process.
+static int broadcastSignal() {
+    return SIGRTMAX - 3;
+}
+
+// Handles the `int3` placed at a patch while it is being changed, by sending the thread to where the patch leads.
+static void trapHandler(int sig, siginfo_t *info, void *ucontextPtr) {
+    auto   uc   = (ucontext_t *)ucontextPtr;
+    size_t addr = uc->uc_mcontext.gregs[REG_RIP] - 1;
+    if (auto toggles = registry.load(std::memory_order_acquire)) {
+        for (auto toggle : *toggles) {
+            if (toggle->addr == addr) {
+                uc->uc_mcontext.gregs[REG_RIP] = toggle->enabled ? toggle->target : toggle->original;
+                return;
+            }
+        }
+    }
+
+    // Not ours.
+    if (prevTrapAction.sa_flags & SA_SIGINFO) {
+        prevTrapAction.sa_sigaction(sig, info, ucontextPtr);
+    } else if (prevTrapAction.sa_handler != SIG_DFL && prevTrapAction.sa_handler != SIG_IGN) {
+        prevTrapAction.sa_handler(sig);
+    } else {
+        signal(SIGTRAP, SIG_DFL);
+        raise(SIGTRAP);
+    }
+}
+
+// Handles a broadcast: moves the thread out of the patches being changed and acknowledges it.
+// Being interrupted by a signal serializes the thread's instruction stream.
+static void broadcastHandler(int, siginfo_t *info, void *ucontextPtr) {
+    uint64_t state = broadcastState.load();
+    if (info->si_code != SI_QUEUE || (uint32_t)info->si_value.sival_int != state >> 32) {
+        return;
+    }
+    auto   toggles = changing.load();
+    auto   uc      = (ucontext_t *)ucontextPtr;
+    size_t rip     = uc->uc_mcontext.gregs[REG_RIP];
+    for (size_t i = 0; toggles && i < toggles->size(); i++) {
+        Toggle *toggle = (*toggles)[i];
+        if (rip <= toggle->addr || rip >= toggle->addr + toggle->length) {
+            continue;
+        }
+        bool moved = false;
+        for (auto &boundary : toggle->boundaries) {
+            if (rip == toggle->addr + boundary.offset) {
+                uc->uc_mcontext.gregs[REG_RIP] = toggle->original + boundary.relocated;
+                moved                          = true;
+            }
+        }
+        if (!moved) {
+            sweepFailed = true;
+        }
+    }
+    // Only count towards the broadcast that this signal was sent for.
+    uint32_t sequence = info->si_value.sival_int;
+    while (state >> 32 == sequence && !broadcastState.compare_exchange_weak(state, state + 1)) {
+    }
+    broadcastFutex++;
+    syscall(SYS_futex, &broadcastFutex, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+// Read a file of a thread of the process from /proc into a buffer, as a string.
+// Returns false if the file could not be read, as when the thread has exited.
+static bool readTaskFile(pid_t tid, char const *name, char *buffer, size_t size) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/task/%d/%s", tid, name);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    ssize_t length = read(fd, buffer, size - 1);
+    close(fd);
+    buffer[length > 0 ? length : 0] = 0;
+    return length > 0;
+}
+
+// Whether a thread blocks the broadcast signal, so that it can't run the broadcast handler.
+static bool blocksBroadcast(pid_t tid) {
+    char        status[4096];
+    char const *mask = readTaskFile(tid, "status", status, sizeof(status)) ? strstr(status, "SigBlk:") : NULL;
+    return mask && strtoull(mask + 7, NULL, 16) >> (broadcastSignal() - 1) & 1;
+}
+
+// Whether a thread is stopped in the kernel outside of the patches being changed, from where it will only run them
+// after returning to user mode, which `membarrier` serializes.
+static bool stoppedOutsidePatches(pid_t tid) {
+    // Holds the system call number, its arguments, the stack pointer and the instruction pointer, or `running`.
+    char syscallInfo[256];
+    if (!readTaskFile(tid, "syscall", syscallInfo, sizeof(syscallInfo)) || !strncmp(syscallInfo, "running", 7)) {
+        return false;
+    }
+    char const *last    = strrchr(syscallInfo, ' ');
+    size_t      rip     = last ? strtoull(last + 1, NULL, 16) : 0;
+    auto        toggles = changing.load();
+    for (size_t i = 0; rip && toggles && i < toggles->size(); i++) {
+        Toggle *toggle = (*toggles)[i];
+        if (rip > toggle->addr && rip < toggle->addr + toggle->length) {
+            return false;
+        }
+    }
+    return rip != 0;
+}
+
+// Get the CPU time a thread of the process has used, or 0 if it has exited.
+static std::chrono::nanoseconds threadCpuTime(pid_t tid) {
+    // The clock ID of a thread's scheduler CPU clock, as glibc's `pthread_getcpuclockid` makes it.
+    clockid_t       clock = (~(clockid_t)tid << 3) | 6;
+    struct timespec time;
+    if (clock_gettime(clock, &time)) {
+        return std::chrono::nanoseconds(0);
+    }
+    return std::chrono::seconds(time.tv_sec) + std::chrono::nanoseconds(time.tv_nsec);
+}
+
+// Whether a thread needs to run the broadcast handler. Threads that block the signal are left alone if they are
+// stopped outside of the patches being changed and cores can be serialized with `membarrier`. Returns false with
+// `failed` set if a thread keeps blocking the signal while running.
+static bool needsBroadcast(pid_t tid, bool &failed) {
+    auto start    = threadCpuTime(tid);
+    auto deadline = std::chrono::steady_clock::now() + BROADCAST_TIMEOUT;
+    while (blocksBroadcast(tid)) {
+        if (haveMembarrier && stoppedOutsidePatches(tid)) {
+            return false;
+        } else if (threadCpuTime(tid) - start >= BLOCKED_TIMEOUT || std::chrono::steady_clock::now() >= deadline) {
+            char name[32];
+            if (!readTaskFile(tid, "comm", name, sizeof(name))) {
+                // It exited meanwhile.
+                return false;
+            }
+            name[strcspn(name, "\n")] = 0;
+            printf(
+                "Error: Thread %d (%s) blocks signals and may be running code that is being changed%s\n",
+                tid,
+                name,
+                haveMembarrier ? "" : ", and membarrier is not available"
+            );
+            failed = true;
+            return false;
+        }
+        sched_yield();
+    }
+    return true;
+}
+
+// Interrupt all other threads of the process that need it and wait until they have run the broadcast handler.
+// Fails right away if a thread can't be interrupted.
+static bool broadcast() {
+    static uint32_t sequence;
+    sequence++;
+    broadcastState = (uint64_t)sequence << 32;
+
+    DIR *dir = opendir("/proc/self/task");
+    if (!dir) {
+        perror("Opening /proc/self/task failed");
+        return false;
+    }
+    std::vector<pid_t> tids;
+    pid_t              self    = syscall(SYS_gettid);
+    bool               skipped = false;
+    bool               failed  = false;
+    while (auto entry = readdir(dir)) {
+        pid_t tid = atoi(entry->d_name);
+        if (tid <= 0 || tid == self) {
+            continue;
+        } else if (needsBroadcast(tid, failed)) {
+            tids.push_back(tid);
+        } else if (failed) {
+            closedir(dir);
+            return false;
+        } else {
+            skipped = true;
+        }
+    }
+    closedir(dir);
+    // The threads left alone are serialized when they return to user mode.
+    if (skipped && syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE, 0, 0)) {
+        perror("Serializing cores failed");
+        return false;
+    }
+
+    pid_t  pid  = getpid();
+    size_t sent = 0;
+    for (pid_t tid : tids) {
+        siginfo_t info;
+        memset(&info, 0, sizeof(info));
+        info.si_signo           = broadcastSignal();
+        info.si_code            = SI_QUEUE;
+        info.si_pid             = pid;
+        info.si_uid             = getuid();
+        info.si_value.sival_int = (int)sequence;
+        // Threads that exited meanwhile fail with `ESRCH` and are not waited for.
+        if (!syscall(SYS_rt_tgsigqueueinfo, pid, tid, info.si_signo, &info)) {
+            sent++;
+        }
+    }
+
+    // Sleep until the acknowledgements are in; the threads may have to be scheduled first.
+    auto deadline = std::chrono::steady_clock::now() + BROADCAST_TIMEOUT;
+    while (true) {
+        uint32_t futex = broadcastFutex;
+        if ((uint32_t)broadcastState.load() >= sent) {
+            return true;
+        }
+        auto remaining = deadline - std::chrono::steady_clock::now();
+        if (remaining.count() <= 0) {
+            break;
+        }
+        struct timespec timeout = {0, std::chrono::duration_cast<std::chrono::nanoseconds>(remaining).count()};
+        syscall(SYS_futex, &broadcastFutex, FUTEX_WAIT_PRIVATE, futex, &timeout, NULL, 0);
+    }
+    printf(
+        "Error: Only %u of %zu threads responded to a broadcast\n",
+        (uint32_t)broadcastState.load(),
+        sent
+    );
+    return false;
+}
+
+// Make sure all threads see the code as it is now before they run it.
+static bool syncCores() {
+    if (haveMembarrier && !syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE, 0, 0)) {
+        return true;
+    }
+    return broadcast();
+}
+
+// Make toggles known to the signal handlers, which are installed on the first call.
+bool registerToggles(std::vector<Toggle *> const &toggles) {
+    std::lock_guard<std::mutex> lock(toggleMutex);
+    auto                        old = registry.load();
+    if (!old) {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = trapHandler;
+        action.sa_flags     = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        if (sigaction(SIGTRAP, &action, &prevTrapAction)) {
+            perror("Installing SIGTRAP handler failed");
+            return false;
+        }
+        action.sa_sigaction = broadcastHandler;
+        if (sigaction(broadcastSignal(), &action, NULL)) {
+            perror("Installing broadcast handler failed");
+            return false;
+        }
+        haveMembarrier = !syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_SYNC_CORE, 0, 0);
+    }
+
+    auto list = new std::vector<Toggle *>();
+    if (old) {
+        *list = *old;
+    }
+    list->insert(list->end(), toggles.begin(), toggles.end());
+    registry.store(list, std::memory_order_release);
+    return true;
+}
+
+// Change the protection of the pages that a patch covers.
+static bool protectPatch(Toggle const &toggle, int prot) {
+    size_t page  = pageSize();
+    size_t start = toggle.addr & ~(page - 1);
+    size_t end   = (toggle.addr + toggle.length + page - 1) & ~(page - 1);
+    return !mprotect((void *)start, end - start, prot);
+}
+
+// Switch entry patches on or off together while other threads may run them.
+bool setToggles(std::vector<Toggle *> const &toggles, bool enabled) {
+    std::lock_guard<std::mutex> lock(toggleMutex);
+    std::vector<Toggle *>       toChange;
+    for (auto toggle : toggles) {
+        if (toggle->enabled == enabled) {
+            continue;
+        }
+        for (auto &boundary : toggle->boundaries) {
+            if (enabled && boundary.afterCall) {
+                // A thread may return into the middle of the patch at any time.
+                printf(
+                    "Error: Function at %p calls out of its entry patch, can't switch it on\n",
+                    (void *)toggle->addr
+                );
+                return false;
+            }
+        }
+        toChange.push_back(toggle);
+    }
+    if (toChange.empty()) {
+        return true;
+    }
+
+    for (size_t i = 0; i < toChange.size(); i++) {
+        if (!protectPatch(*toChange[i], toChange[i]->prot | PROT_WRITE)) {
+            perror("Making code writeable failed");
+            for (size_t j = 0; j <= i; j++) {
+                protectPatch(*toChange[j], toChange[j]->prot);
+            }
+            return false;
+        }
+    }
+
+    // Stop threads from entering the patches and move the ones inside them out, then rewrite them behind the `int3`.
+    changing    = &toChange;
+    sweepFailed = false;
+    for (auto toggle : toChange) {
+        toggle->enabled                   = enabled;
+        *(volatile uint8_t *)toggle->addr = 0xcc;
+    }
+    bool success = broadcast() && !sweepFailed;
+    if (success) {
+        for (auto toggle : toChange) {
+            uint8_t const *code = enabled ? toggle->enabledCode : toggle->disabledCode;
+            for (size_t i = 1; i < toggle->length; i++) {
+                ((volatile uint8_t *)toggle->addr)[i] = code[i];
+            }
+        }
+        syncCores();
+        for (auto toggle : toChange) {
+            *(volatile uint8_t *)toggle->addr = enabled ? toggle->enabledCode[0] : toggle->disabledCode[0];
+        }
+        syncCores();
+    } else {
+        // Nothing but the `int3`s were written, and they send threads the old way again once `enabled` is restored.
+        for (auto toggle : toChange) {
+            toggle->enabled                   = !enabled;
+            *(volatile uint8_t *)toggle->addr = enabled ? toggle->disabledCode[0] : toggle->enabledCode[0];
+        }
+        syncCores();
+    }
+    changing = NULL;
+
+    for (auto toggle : toChange) {
+        if (!protectPatch(*toggle, toggle->prot)) {
+            perror("Restoring code protection failed");
+        }
+    }
+    return success;
+}
+
+// Switch an entry patch on or off while other threads may run it.
+bool setToggle(Toggle &toggle, bool enabled) {
+    return setToggles({&toggle}, enabled);
+}
+
+} // namespace coretorio::injection
@@ -0,0 +1,131 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+// Conversion of trace files to other formats.
+// This file only depends on the file format, so that tools can use it without the rest of CoreTorio.
+
+#include "tracing.hpp"
+
+#include <algorithm>
+#include <cxxabi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+
+
+namespace coretorio::tracing {
+
+// Number of events read from the trace at a time.
+static constexpr size_t READ_EVENTS = 4096;
+
+// Get a symbol name as a JSON string, demangled if possible.
+static std::string jsonName(char const *name) {
+    int         status;
+    char       *demangled = abi::__cxa_demangle(name, NULL, NULL, &status);
+    char const *raw       = demangled ? demangled : name;
+
+    std::string out = "\"";
+    for (; *raw; raw++) {
+        if (*raw == '"' || *raw == '\\') {
+            out += '\\';
+            out += *raw;
+        } else if ((unsigned char)*raw < 0x20) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", *raw);
+            out += escape;
+        } else {
+            out += *raw;
+        }
+    }
+    out += '"';
+    free(demangled);
+    return out;
+}
+
+// Write the events of a trace as Chrome trace JSON.
+static bool writeChromeJson(FILE *in, TraceHeader const &header, std::vector<std::string> const &names, FILE *out) {
+    if (fseek(in, header.eventsOffset, SEEK_SET)) {
+        perror("Seeking to trace events failed");
+        return false;
+    }
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    std::vector<TraceEvent> events(READ_EVENTS);
+    double                  usPerTick = 1e6 / header.tscFrequency;
+    uint64_t                remaining = header.events;
+    char const             *separator = "\n";
+    while (remaining) {
+        size_t count = fread(events.data(), sizeof(TraceEvent), std::min<uint64_t>(remaining, READ_EVENTS), in);
+        if (!count) {
+            printf("Error: Trace ends %zu events early\n", (size_t)remaining);
+            return false;
+        }
+        for (size_t i = 0; i < count; i++) {
+            uint32_t index = events[i].symbol & ~TRACE_EXIT;
+            fprintf(
+                out,
+                "%s{\"name\":%s,\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%u,\"tid\":%u}",
+                separator,
+                index < names.size() ? names[index].c_str() : "\"?\"",
+                events[i].symbol & TRACE_EXIT ? 'E' : 'B',
+                (double)(int64_t)(events[i].time - header.startTime) * usPerTick,
+                header.pid,
+                events[i].thread
+            );
+            separator = ",\n";
+        }
+        remaining -= count;
+    }
+    fprintf(out, "\n]}\n");
+    return true;
+}
+
+// Convert a trace file to the JSON format of Chrome's trace viewer.
+bool convertToChromeJson(std::string const &tracePath, std::string const &jsonPath) {
+    FILE *in = fopen(tracePath.c_str(), "rb");
+    if (!in) {
+        perror("Opening trace file failed");
+        return false;
+    }
+    TraceHeader header;
+    if (fread(&header, sizeof(header), 1, in) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC))) {
+        printf("Error: %s is not a trace file\n", tracePath.c_str());
+        fclose(in);
+        return false;
+    } else if (!header.tscFrequency) {
+        printf("Error: %s was stopped before its timing was known\n", tracePath.c_str());
+        fclose(in);
+        return false;
+    }
+
+    std::vector<TraceSymbol> symbols(header.symbols);
+    if (fread(symbols.data(), sizeof(TraceSymbol), symbols.size(), in) != symbols.size()) {
+        printf("Error: %s has an incomplete symbol table\n", tracePath.c_str());
+        fclose(in);
+        return false;
+    }
+    std::vector<std::string> names;
+    for (auto &symbol : symbols) {
+        symbol.name[sizeof(symbol.name) - 1] = 0;
+        names.push_back(jsonName(symbol.name));
+    }
+
+    FILE *out = fopen(jsonPath.c_str(), "w");
+    if (!out) {
+        perror("Creating JSON file failed");
+        fclose(in);
+        return false;
+    }
+    bool success = writeChromeJson(in, header, names, out);
+    if (ferror(out)) {
+        perror("Writing JSON file failed");
+        success = false;
+    }
+    fclose(out);
+    fclose(in);
+    return success;
+}
+
+} // namespace coretorio::tracing
@@ -0,0 +1,59 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+// The hot path of tracing, compiled with `-mgeneral-regs-only`.
+
+#include "thread_slots.hpp"
+#include "tracing_priv.hpp"
+
+
+
+namespace coretorio::tracing {
+
+// All ring buffers, newest first; never freed.
+std::atomic<ThreadTrace *> threadTraces;
+// Whether events are recorded.
+std::atomic<bool>          recording;
+
+// This thread's ring buffer, NULL until it first records an event.
+__attribute__((tls_model("initial-exec"))) static thread_local ThreadTrace *threadTrace;
+
+// Give this thread a ring buffer: one left by an exited thread, or a new one.
+// Returns NULL if there is no memory for it.
+static ThreadTrace *attachThread() {
+    ThreadTrace *trace = threads::claimSlot(threadTraces);
+    if (trace) {
+        // Events the previous thread left are still drained; they carry its thread ID.
+        trace->thread = trace->owner;
+        threadTrace   = trace;
+    }
+    return trace;
+}
+
+// Push an event.
+void traceEvent(void *symbol) {
+    uint64_t now = __builtin_ia32_rdtsc();
+    if (!recording.load(std::memory_order_relaxed)) {
+        return;
+    }
+    ThreadTrace *trace = threadTrace;
+    if (__builtin_expect(!trace, 0) && !(trace = attachThread())) {
+        return;
+    }
+    uint64_t head = trace->head.load(std::memory_order_relaxed);
+    if (head - trace->cachedTail >= ThreadTrace::RING_SIZE) {
+        trace->cachedTail = trace->tail.load(std::memory_order_acquire);
+        if (head - trace->cachedTail >= ThreadTrace::RING_SIZE) {
+            // Never wait for the flusher; only this thread writes the count, so no atomic add is needed.
+            trace->dropped.store(trace->dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return;
+        }
+    }
+    TraceEvent &event = trace->events[head % ThreadTrace::RING_SIZE];
+    event.time        = now;
+    event.thread      = trace->thread;
+    event.symbol      = (uint32_t)(uintptr_t)symbol;
+    trace->head.store(head + 1, std::memory_order_release);
+}
+
+} // namespace coretorio::tracing
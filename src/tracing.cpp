@@ -0,0 +1,305 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+#include "injection_priv.hpp"
+#include "tracing_priv.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <fcntl.h>
+#include <map>
+#include <mutex>
+#include <string.h>
+#include <sys/mman.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+
+
+namespace coretorio::tracing {
+
+// Number of bytes of events mapped at a time; the file grows by this much.
+static constexpr size_t   CHUNK_SIZE       = 16 << 20;
+// Number of events mapped at a time.
+static constexpr uint64_t CHUNK_EVENTS     = CHUNK_SIZE / sizeof(TraceEvent);
+// How long the flusher sleeps when there were no events to drain.
+static constexpr auto     FLUSH_INTERVAL   = std::chrono::milliseconds(1);
+// How long to wait before the first measurement of the time stamp counter frequency, unless the trace stops sooner.
+static constexpr uint64_t MIN_CALIBRATE_NS = 1000000;
+
+// The trace file being written.
+struct TraceFile {
+    // File descriptor, -1 if no trace is being written.
+    int          fd = -1;
+    // Path of the file.
+    std::string  path;
+    // Mapped header and symbol table.
+    TraceHeader *header;
+    // Mapped chunk of events that the flusher writes to.
+    TraceEvent  *chunk;
+    // Index of the chunk in the file.
+    uint64_t     chunkIndex;
+    // Number of events written.
+    uint64_t     written;
+    // Number of events that could not be written because the file could not grow.
+    uint64_t     lost;
+    // Sum of the dropped counts of the ring buffers when the trace started.
+    uint64_t     droppedBefore;
+    // Monotonic time in nanoseconds when the trace started.
+    uint64_t     startNs;
+};
+
+// Index of each traced symbol.
+static std::map<std::string, uint32_t> *symbolIndex;
+// Symbol table entries, by index.
+static std::vector<TraceSymbol>        *symbols;
+// Guards the symbols, the trace file and starting and stopping traces.
+static std::mutex                       traceMutex;
+// The trace file being written.
+static TraceFile                        file;
+// Background thread that drains the ring buffers into `file`.
+static std::thread                      flusher;
+// Tells `flusher` to drain one last time and exit.
+static std::atomic<bool>                stopping;
+// Counts of the last trace, once it has been stopped.
+static TraceStats                       lastStats;
+
+// Create the symbol tables, if not done already.
+static void init() {
+    if (!symbolIndex) {
+        symbolIndex = new std::map<std::string, uint32_t>();
+        symbols     = new std::vector<TraceSymbol>();
+    }
+}
+
+// Get the monotonic time in nanoseconds.
+static uint64_t monotonicNs() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// Write an entry of the symbol table to the trace file.
+static void writeSymbol(uint32_t index) {
+    TraceSymbol *table = (TraceSymbol *)(file.header + 1);
+    table[index]       = (*symbols)[index];
+    __atomic_store_n(&file.header->symbols, index + 1, __ATOMIC_RELEASE);
+}
+
+// Grow the trace file and map its next chunk of events.
+static bool mapNextChunk() {
+    if (file.chunk) {
+        munmap(file.chunk, CHUNK_SIZE);
+        file.chunk = NULL;
+        file.chunkIndex++;
+    }
+    uint64_t offset = file.header->eventsOffset + file.chunkIndex * CHUNK_SIZE;
+    if (ftruncate(file.fd, offset + CHUNK_SIZE)) {
+        perror("Growing trace file failed");
+        return false;
+    }
+    void *mem = mmap(NULL, CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, file.fd, offset);
+    if (mem == MAP_FAILED) {
+        perror("Mapping trace file failed");
+        return false;
+    }
+    file.chunk = (TraceEvent *)mem;
+    return true;
+}
+
+// Move the events in all ring buffers to the trace file and update its header.
+// Returns the number of events drained.
+static uint64_t drain() {
+    uint64_t drained = 0;
+    uint64_t dropped = 0;
+    for (auto trace = threadTraces.load(std::memory_order_acquire); trace; trace = trace->next) {
+        uint64_t tail = trace->tail.load(std::memory_order_relaxed);
+        uint64_t head = trace->head.load(std::memory_order_acquire);
+        while (tail < head) {
+            uint64_t inChunk = file.written - file.chunkIndex * CHUNK_EVENTS;
+            if (!file.chunk || inChunk == CHUNK_EVENTS) {
+                if (!mapNextChunk()) {
+                    file.lost += head - tail;
+                    tail       = head;
+                    break;
+                }
+                inChunk = 0;
+            }
+            // Copy up to the end of the chunk or the end of the ring buffer, whichever comes first.
+            uint64_t count = head - tail;
+            count          = std::min(count, CHUNK_EVENTS - inChunk);
+            count          = std::min(count, ThreadTrace::RING_SIZE - tail % ThreadTrace::RING_SIZE);
+            memcpy(file.chunk + inChunk, &trace->events[tail % ThreadTrace::RING_SIZE], count * sizeof(TraceEvent));
+            tail         += count;
+            file.written += count;
+            drained      += count;
+        }
+        trace->tail.store(tail, std::memory_order_release);
+        dropped += trace->dropped.load(std::memory_order_relaxed);
+    }
+
+    // The events must be in the file before the header says they are.
+    __atomic_store_n(&file.header->events, file.written, __ATOMIC_RELEASE);
+    __atomic_store_n(&file.header->dropped, dropped - file.droppedBefore + file.lost, __ATOMIC_RELAXED);
+    uint64_t elapsed = monotonicNs() - file.startNs;
+    if (elapsed >= MIN_CALIBRATE_NS || stopping.load(std::memory_order_relaxed)) {
+        double frequency = (double)(__builtin_ia32_rdtsc() - file.header->startTime) * 1e9 / elapsed;
+        __atomic_store_n(&file.header->tscFrequency, (uint64_t)frequency, __ATOMIC_RELAXED);
+    }
+    return drained;
+}
+
+// Main loop of the flusher thread.
+static void flushLoop() {
+    while (!stopping.load(std::memory_order_acquire)) {
+        if (!drain()) {
+            std::this_thread::sleep_for(FLUSH_INTERVAL);
+        }
+    }
+    drain();
+}
+
+// Trace every entry to and exit from one of Factorio's functions.
+bool trace(std::string const &symbolName) {
+    auto symbol = object::findSymbol(symbolName);
+    if (!symbol) {
+        printf("Error: Can't trace non-existent symbol `%s`\n", symbolName.c_str());
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(traceMutex);
+    init();
+    if (symbolIndex->count(symbolName)) {
+        return true;
+    } else if (symbols->size() >= MAX_TRACED) {
+        printf("Error: No trace symbol left for `%s`\n", symbolName.c_str());
+        return false;
+    }
+
+    uint32_t    index = symbols->size();
+    TraceSymbol entry = {};
+    entry.address     = (uint64_t)symbol->st_value_ptr;
+    strncpy(entry.name, symbolName.c_str(), sizeof(entry.name) - 1);
+    symbols->push_back(entry);
+    (*symbolIndex)[symbolName] = index;
+    if (file.fd >= 0) {
+        writeSymbol(index);
+    }
+
+    // The after-injection runs on every return, including through tail calls, because it replaces the return address.
+    void *entryArg = (void *)(uintptr_t)index;
+    void *exitArg  = (void *)(uintptr_t)(index | TRACE_EXIT);
+    injection::injectBefore(symbolName, injection::Injection((void *)&traceEvent, entryArg).withoutSimd());
+    injection::injectAfter(symbolName, injection::Injection((void *)&traceEvent, exitArg).withoutSimd());
+    return true;
+}
+
+// Start writing events to a new trace file.
+bool startTrace(std::string const &path) {
+    std::lock_guard<std::mutex> lock(traceMutex);
+    if (file.fd >= 0) {
+        printf("Error: Already writing a trace to %s\n", file.path.c_str());
+        return false;
+    }
+    init();
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("Creating trace file failed");
+        return false;
+    }
+    // Events start on a page boundary so that each chunk can be mapped on its own.
+    size_t pageSize     = sysconf(_SC_PAGESIZE);
+    size_t eventsOffset = sizeof(TraceHeader) + MAX_TRACED * sizeof(TraceSymbol);
+    eventsOffset        = (eventsOffset + pageSize - 1) / pageSize * pageSize;
+    void  *mem          = MAP_FAILED;
+    if (ftruncate(fd, eventsOffset)) {
+        perror("Resizing trace file failed");
+    } else if ((mem = mmap(NULL, eventsOffset, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        perror("Mapping trace file failed");
+    }
+    if (mem == MAP_FAILED) {
+        close(fd);
+        unlink(path.c_str());
+        return false;
+    }
+
+    file                      = TraceFile();
+    file.fd                   = fd;
+    file.path                 = path;
+    file.header               = (TraceHeader *)mem;
+    file.header->maxSymbols   = MAX_TRACED;
+    file.header->eventsOffset = eventsOffset;
+    file.header->pid          = getpid();
+    for (uint32_t i = 0; i < symbols->size(); i++) {
+        writeSymbol(i);
+    }
+    if (!mapNextChunk()) {
+        munmap(file.header, eventsOffset);
+        close(fd);
+        unlink(path.c_str());
+        file = TraceFile();
+        return false;
+    }
+
+    // Discard events that were pushed after the previous trace stopped.
+    for (auto trace = threadTraces.load(std::memory_order_acquire); trace; trace = trace->next) {
+        trace->tail.store(trace->head.load(std::memory_order_acquire), std::memory_order_release);
+        file.droppedBefore += trace->dropped.load(std::memory_order_relaxed);
+    }
+    file.startNs           = monotonicNs();
+    file.header->startTime = __builtin_ia32_rdtsc();
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(file.header->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+
+    stopping = false;
+    flusher  = std::thread(flushLoop);
+    recording.store(true, std::memory_order_release);
+    printf("Writing trace to %s\n", path.c_str());
+    return true;
+}
+
+// Stop tracing, write all remaining events and close the trace file.
+bool stopTrace() {
+    std::lock_guard<std::mutex> lock(traceMutex);
+    if (file.fd < 0) {
+        return false;
+    }
+    recording.store(false, std::memory_order_release);
+    stopping.store(true, std::memory_order_release);
+    flusher.join();
+
+    lastStats.written = file.header->events;
+    lastStats.dropped = file.header->dropped;
+    size_t headerSize = file.header->eventsOffset;
+    if (ftruncate(file.fd, headerSize + file.written * sizeof(TraceEvent))) {
+        perror("Truncating trace file failed");
+    }
+    if (file.chunk) {
+        munmap(file.chunk, CHUNK_SIZE);
+    }
+    munmap(file.header, headerSize);
+    close(file.fd);
+    printf(
+        "Wrote %zu trace events to %s, %zu dropped\n",
+        (size_t)lastStats.written,
+        file.path.c_str(),
+        (size_t)lastStats.dropped
+    );
+    file = TraceFile();
+    return true;
+}
+
+// Get the number of events written and dropped by the current or last trace.
+TraceStats getTraceStats() {
+    std::lock_guard<std::mutex> lock(traceMutex);
+    if (file.fd < 0) {
+        return lastStats;
+    }
+    TraceStats stats;
+    stats.written = __atomic_load_n(&file.header->events, __ATOMIC_ACQUIRE);
+    stats.dropped = __atomic_load_n(&file.header->dropped, __ATOMIC_RELAXED);
+    return stats;
+}
+
+} // namespace coretorio::tracing
@@ -0,0 +1,142 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+// Checks the linker on synthetic sections: the values written for each relocation type, branches in range of their
+// destination, branches out of range that must share a veneer, and data references out of range that must fail.
+
+#include "code_arena.hpp"
+#include "injection_priv.hpp"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+using namespace coretorio::injection;
+
+
+
+// Number of failed checks.
+static int failures;
+
+// Report a failed check.
+static void check(bool condition, char const *what) {
+    if (!condition) {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+// Read a little-endian value from a section.
+template <typename T> static T readAt(Section const &sect, size_t offset) {
+    T value;
+    memcpy(&value, &sect.code[offset], sizeof(T));
+    return value;
+}
+
+// Get an arena near this executable's code, as the real one is near Factorio's.
+static CodeArena nearArena() {
+    CodeArena arena;
+    size_t    text = (size_t)&nearArena;
+    arena.setTarget(text, text + 1);
+    return arena;
+}
+
+// Add a relocation to a context.
+static void addReloc(
+    InjectionCtx &ctx, Reloc::Type type, int64_t addend, SectionRef target, size_t targetOffset, size_t address
+) {
+    ctx.reloc.push_back(Reloc{type, addend, target, targetOffset, SECTION_ABSOLUTE, address});
+}
+
+// REL8, REL32 and ABS64 write `S + A - P` and `S + A` into a patch section.
+static void testValues() {
+    CodeArena    arena = nearArena();
+    InjectionCtx ctx;
+    ctx.generated.addr = 0;
+    ctx.patches.push_back(Section{0x10000000, std::vector<uint8_t>(32, 0x90)});
+    addReloc(ctx, Reloc::REL8, -1, 0, 1, 0x10000000 + 0x40);
+    addReloc(ctx, Reloc::REL32, -4, 0, 4, 0x10000000 - 0x12345678);
+    addReloc(ctx, Reloc::ABS64, 8, 0, 16, 0x123456789abc);
+    check(link(ctx, arena), "relocations in range link");
+
+    Section const &patch = ctx.patches[0];
+    check(readAt<int8_t>(patch, 1) == 0x40 - 1 - 1, "REL8 value");
+    check(readAt<int32_t>(patch, 4) == -0x12345678 - 4 - 4, "REL32 value");
+    check(readAt<uint64_t>(patch, 16) == 0x123456789abc + 8, "ABS64 value");
+    check(patch.code[0] == 0x90 && patch.code[8] == 0x90 && patch.code[24] == 0x90, "bytes around relocations");
+
+    // A REL8 that does not fit fails the link rather than wrapping.
+    InjectionCtx far;
+    far.patches.push_back(Section{0x10000000, std::vector<uint8_t>(2, 0x90)});
+    addReloc(far, Reloc::REL8, -1, 0, 1, 0x10000000 + 0x200);
+    check(!link(far, arena), "REL8 out of range fails");
+}
+
+// A call in range of its destination is linked directly, without a veneer.
+static void testBranchInRange() {
+    CodeArena    arena = nearArena();
+    InjectionCtx ctx;
+    ctx.generated.code = {0xe8, 0, 0, 0, 0, 0xc3}; // call rel32; ret
+    size_t dest        = (size_t)&nearArena;
+    addReloc(ctx, Reloc::BRANCH32, -4, SECTION_GENERATED, 1, dest);
+    check(link(ctx, arena), "branch in range links");
+
+    Section const &code = ctx.generated;
+    check(code.addr + 5 + readAt<int32_t>(code, 1) == dest, "branch in range goes to its destination");
+    // Space for a veneer is reserved, but not filled.
+    check(code.code.size() == 16, "branch in range adds no veneer");
+}
+
+// Calls out of range go through one `jmp [rip+0]` veneer per destination, placed after the code.
+static void testBranchVeneer() {
+    CodeArena    arena = nearArena();
+    InjectionCtx ctx;
+    ctx.generated.code = {0xe8, 0, 0, 0, 0, 0xe9, 0, 0, 0, 0, 0xe8, 0, 0, 0, 0}; // call; jmp; call
+    // Below everything the arena may use, so more than 2 GiB away from any of it.
+    size_t dest        = arena.nearLow - ((size_t)1 << 33);
+    size_t other       = arena.nearLow - ((size_t)1 << 34);
+    addReloc(ctx, Reloc::BRANCH32, -4, SECTION_GENERATED, 1, dest);
+    addReloc(ctx, Reloc::BRANCH32, -4, SECTION_GENERATED, 6, dest);
+    addReloc(ctx, Reloc::BRANCH32, -4, SECTION_GENERATED, 11, other);
+    check(link(ctx, arena), "branches out of range link");
+
+    Section const &code   = ctx.generated;
+    size_t         first  = code.addr + 5 + readAt<int32_t>(code, 1);
+    size_t         second = code.addr + 10 + readAt<int32_t>(code, 6);
+    size_t         third  = code.addr + 15 + readAt<int32_t>(code, 11);
+    check(first == second, "branches to the same destination share a veneer");
+    check(first != third, "branches to different destinations get their own veneer");
+    check(code.code.size() == 16 + 2 * 16, "one veneer per destination");
+    for (size_t veneer : {first, third}) {
+        size_t offset = veneer - code.addr;
+        check(offset >= 16 && offset % 16 == 0 && offset + 16 <= code.code.size(), "veneer placed after the code");
+        if (offset + 16 > code.code.size()) {
+            continue;
+        }
+        check(code.code[offset] == 0xff && code.code[offset + 1] == 0x25, "veneer is an indirect jmp");
+        check(readAt<int32_t>(code, offset + 2) == 0, "veneer reads the address right after itself");
+        check(readAt<uint64_t>(code, offset + 6) == (veneer == first ? dest : other), "veneer jumps to destination");
+    }
+}
+
+// A RIP-relative data reference out of range can't go through a veneer, so the link fails.
+static void testDataOutOfRange() {
+    CodeArena    arena = nearArena();
+    InjectionCtx ctx;
+    ctx.generated.code = {0x48, 0x8b, 0x05, 0, 0, 0, 0}; // mov rax, [rip+rel32]
+    addReloc(ctx, Reloc::REL32, -4, SECTION_GENERATED, 3, arena.nearLow - ((size_t)1 << 33));
+    check(!link(ctx, arena), "data reference out of range fails");
+}
+
+int main() {
+    testValues();
+    testBranchInRange();
+    testBranchVeneer();
+    testDataOutOfRange();
+    if (failures) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("All linker checks passed\n");
+    return 0;
+}
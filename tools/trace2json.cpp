@@ -0,0 +1,18 @@
+// Copyright © 2024, Julian Scheffers
+// SPDX-License-Identifier: MIT
+
+// Converts a CoreTorio trace file to JSON that can be opened in Chrome's trace viewer or Perfetto.
+
+#include "tracing.hpp"
+
+#include <stdio.h>
+
+
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        printf("Usage: %s <trace file> <JSON file>\n", argv[0]);
+        return 1;
+    }
+    return coretorio::tracing::convertToChromeJson(argv[1], argv[2]) ? 0 : 1;
+}